@@ -0,0 +1,76 @@
+#ifndef FRAME_DATA_H
+#define FRAME_DATA_H
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+
+// C++ mirrors of the std140 uniform blocks the shaders declare, written
+// through a UniformRing. std140 starts every vec3 and struct on 16 bytes, and
+// lets a float follow a vec3 in the same 16, hence the padding. the
+// static_asserts hold them to the offsets GLSL gives the members
+
+#define NR_POINT_LIGHTS 4
+
+struct DirLightData
+{
+	glm::vec3 direction; float pad0;
+	glm::vec3 ambient; float pad1;
+	glm::vec3 diffuse; float pad2;
+	glm::vec3 specular; float pad3;
+};
+
+struct PointLightData
+{
+	glm::vec3 position; float pad0;
+	glm::vec3 ambient; float pad1;
+	glm::vec3 diffuse; float pad2;
+	glm::vec3 specular;
+	float Kc;
+	float Kl;
+	float Kq;
+	float pad3[2];
+};
+
+struct SpotLightData
+{
+	glm::vec3 position; float pad0;
+	glm::vec3 direction; float pad1;
+	glm::vec3 ambient; float pad2;
+	glm::vec3 diffuse; float pad3;
+	glm::vec3 specular;
+	float cutOff;
+	float outerCutOff;
+	float Kc;
+	float Kl;
+	float Kq;
+};
+
+// "FrameData": what stays the same over a frame's draws
+struct FrameData
+{
+	static const unsigned int binding = 0;
+
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::vec3 viewPos; float pad0;
+	DirLightData dirLight;
+	PointLightData pointLight[NR_POINT_LIGHTS];
+	SpotLightData flashLight;
+};
+
+// "DrawData": what changes per draw
+struct DrawData
+{
+	static const unsigned int binding = 1;
+
+	glm::mat4 model;
+};
+
+static_assert(sizeof(DirLightData) == 64, "DirLight is 64 bytes in std140");
+static_assert(offsetof(PointLightData, Kc) == 60 && sizeof(PointLightData) == 80, "PointLight is 80 bytes in std140");
+static_assert(offsetof(SpotLightData, cutOff) == 76 && sizeof(SpotLightData) == 96, "SpotLight is 96 bytes in std140");
+static_assert(offsetof(FrameData, dirLight) == 144 && offsetof(FrameData, pointLight) == 208 && offsetof(FrameData, flashLight) == 528, "FrameData members at their std140 offsets");
+static_assert(sizeof(FrameData) == 624, "FrameData is 624 bytes in std140");
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef FRUSTUM_CULLER_H
+#define FRUSTUM_CULLER_H
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <vector>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRUSTUM_CULLER_SSE
+#endif
+
+using namespace std;
+
+// the six planes of a view frustum, taken from the rows of projection * view
+// and normalized, each facing inwards: a point p is inside a plane when
+// dot(normal, p) + d >= 0
+class Frustum
+{
+public:
+	glm::vec4 planes[6];
+
+	Frustum(const glm::mat4& viewProjection)
+	{
+		glm::vec4 rows[4];
+		for (int i = 0; i < 4; i++)
+		{
+			rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+		}
+		planes[0] = rows[3] + rows[0];   // left
+		planes[1] = rows[3] - rows[0];   // right
+		planes[2] = rows[3] + rows[1];   // bottom
+		planes[3] = rows[3] - rows[1];   // top
+		planes[4] = rows[3] + rows[2];   // near
+		planes[5] = rows[3] - rows[2];   // far
+		for (int i = 0; i < 6; i++)
+		{
+			planes[i] /= glm::length(glm::vec3(planes[i]));
+		}
+	}
+
+	// whether a box at center, reaching extents along each axis, with a
+	// sphere of radius around it, may be in view. each plane takes the
+	// tighter of the two, as both hold the whole object
+	bool intersects(const glm::vec3& center, const glm::vec3& extents, float radius) const
+	{
+		for (int i = 0; i < 6; i++)
+		{
+			glm::vec3 normal = glm::vec3(planes[i]);
+			float distance = glm::dot(normal, center) + planes[i].w;
+			float reach = glm::dot(glm::abs(normal), extents);
+			if (distance + (reach < radius ? reach : radius) < 0.0f)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// model space bounds (a box, and a sphere about its center) carried into
+// world space by a transform. the box stays axis-aligned, grown to hold the
+// rotated one; the sphere grows by the largest scale
+struct WorldBounds
+{
+	glm::vec3 center;
+	glm::vec3 extents;
+	float radius;
+
+	WorldBounds(const glm::vec3& boundsMin, const glm::vec3& boundsMax, float boundsRadius, const glm::mat4& model)
+	{
+		glm::vec3 localCenter = (boundsMin + boundsMax) * 0.5f;
+		glm::vec3 localExtents = (boundsMax - boundsMin) * 0.5f;
+		center = glm::vec3(model * glm::vec4(localCenter, 1.0f));
+		glm::mat3 linear = glm::mat3(model);
+		extents = glm::abs(linear[0]) * localExtents.x + glm::abs(linear[1]) * localExtents.y + glm::abs(linear[2]) * localExtents.z;
+		float scale = glm::max(glm::length(linear[0]), glm::max(glm::length(linear[1]), glm::length(linear[2])));
+		radius = boundsRadius * scale;
+	}
+};
+
+// tests many objects against a frustum at once. bounds are kept as a
+// structure of arrays, so the kernel loads 8 objects (AVX) or 4 (SSE) per
+// register and runs the six plane tests for all of them together; other
+// targets take the scalar loop. add everything, cull(), then ask visible()
+class FrustumCuller
+{
+public:
+	// counts from the last cull()
+	struct Stats
+	{
+		unsigned int tested = 0;
+		unsigned int visible = 0;
+		unsigned int culled = 0;
+	};
+
+	void clear()
+	{
+		count = 0;
+		for (int i = 0; i < 7; i++)
+		{
+			lanes[i].clear();
+		}
+	}
+
+	// returns the object's index, for visible()
+	unsigned int add(const WorldBounds& bounds)
+	{
+		lanes[0].push_back(bounds.center.x);
+		lanes[1].push_back(bounds.center.y);
+		lanes[2].push_back(bounds.center.z);
+		lanes[3].push_back(bounds.extents.x);
+		lanes[4].push_back(bounds.extents.y);
+		lanes[5].push_back(bounds.extents.z);
+		lanes[6].push_back(bounds.radius);
+		return count++;
+	}
+
+	void cull(const glm::mat4& viewProjection)
+	{
+		Frustum frustum(viewProjection);
+		// pad to a whole register; the padding's results are ignored
+		size_t padded = (count + 7) & ~(size_t)7;
+		for (int i = 0; i < 7; i++)
+		{
+			lanes[i].resize(padded, 0.0f);
+		}
+		results.resize(padded);
+		lastStats.visible = 0;
+
+		size_t first = cullSimd(frustum, padded);
+		for (size_t i = first; i < count; i++)
+		{
+			glm::vec3 center(lanes[0][i], lanes[1][i], lanes[2][i]);
+			glm::vec3 extents(lanes[3][i], lanes[4][i], lanes[5][i]);
+			results[i] = frustum.intersects(center, extents, lanes[6][i]) ? 1 : 0;
+			lastStats.visible += results[i];
+		}
+
+		for (int i = 0; i < 7; i++)
+		{
+			lanes[i].resize(count);
+		}
+		lastStats.tested = count;
+		lastStats.culled = count - lastStats.visible;
+	}
+
+	bool visible(unsigned int index) const
+	{
+		return results[index] != 0;
+	}
+
+	const Stats& stats() const
+	{
+		return lastStats;
+	}
+
+private:
+	// center x, y, z, extents x, y, z, radius
+	vector<float> lanes[7];
+	vector<unsigned char> results;
+	unsigned int count = 0;
+	Stats lastStats;
+
+	// fills results for as many objects as the vector kernel covers, and
+	// returns where the scalar loop is to carry on
+	size_t cullSimd(const Frustum& frustum, size_t padded)
+	{
+#if defined(__AVX__)
+		// broadcast once; results are chars, which may alias the planes as far
+		// as the compiler knows, so it won't hoist them itself
+		__m256 nx[6], ny[6], nz[6], nw[6], ax[6], ay[6], az[6];
+		for (int p = 0; p < 6; p++)
+		{
+			const glm::vec4& plane = frustum.planes[p];
+			nx[p] = _mm256_set1_ps(plane.x); ny[p] = _mm256_set1_ps(plane.y); nz[p] = _mm256_set1_ps(plane.z); nw[p] = _mm256_set1_ps(plane.w);
+			ax[p] = _mm256_set1_ps(fabsf(plane.x)); ay[p] = _mm256_set1_ps(fabsf(plane.y)); az[p] = _mm256_set1_ps(fabsf(plane.z));
+		}
+		for (size_t i = 0; i < padded; i += 8)
+		{
+			__m256 cx = _mm256_loadu_ps(&lanes[0][i]), cy = _mm256_loadu_ps(&lanes[1][i]), cz = _mm256_loadu_ps(&lanes[2][i]);
+			__m256 ex = _mm256_loadu_ps(&lanes[3][i]), ey = _mm256_loadu_ps(&lanes[4][i]), ez = _mm256_loadu_ps(&lanes[5][i]);
+			__m256 radius = _mm256_loadu_ps(&lanes[6][i]);
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			for (int p = 0; p < 6; p++)
+			{
+				__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(cx, nx[p]), _mm256_mul_ps(cy, ny[p])), _mm256_add_ps(_mm256_mul_ps(cz, nz[p]), nw[p]));
+				__m256 reach = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ex, ax[p]), _mm256_mul_ps(ey, ay[p])), _mm256_mul_ps(ez, az[p]));
+				__m256 test = _mm256_add_ps(distance, _mm256_min_ps(reach, radius));
+				inside = _mm256_and_ps(inside, _mm256_cmp_ps(test, _mm256_setzero_ps(), _CMP_GE_OQ));
+			}
+			storeMask(_mm256_movemask_ps(inside), i, 8);
+		}
+		return padded;
+#elif defined(FRUSTUM_CULLER_SSE)
+		// broadcast once, as above
+		__m128 nx[6], ny[6], nz[6], nw[6], ax[6], ay[6], az[6];
+		for (int p = 0; p < 6; p++)
+		{
+			const glm::vec4& plane = frustum.planes[p];
+			nx[p] = _mm_set1_ps(plane.x); ny[p] = _mm_set1_ps(plane.y); nz[p] = _mm_set1_ps(plane.z); nw[p] = _mm_set1_ps(plane.w);
+			ax[p] = _mm_set1_ps(fabsf(plane.x)); ay[p] = _mm_set1_ps(fabsf(plane.y)); az[p] = _mm_set1_ps(fabsf(plane.z));
+		}
+		for (size_t i = 0; i < padded; i += 4)
+		{
+			__m128 cx = _mm_loadu_ps(&lanes[0][i]), cy = _mm_loadu_ps(&lanes[1][i]), cz = _mm_loadu_ps(&lanes[2][i]);
+			__m128 ex = _mm_loadu_ps(&lanes[3][i]), ey = _mm_loadu_ps(&lanes[4][i]), ez = _mm_loadu_ps(&lanes[5][i]);
+			__m128 radius = _mm_loadu_ps(&lanes[6][i]);
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (int p = 0; p < 6; p++)
+			{
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, nx[p]), _mm_mul_ps(cy, ny[p])), _mm_add_ps(_mm_mul_ps(cz, nz[p]), nw[p]));
+				__m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, ax[p]), _mm_mul_ps(ey, ay[p])), _mm_mul_ps(ez, az[p]));
+				__m128 test = _mm_add_ps(distance, _mm_min_ps(reach, radius));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(test, _mm_setzero_ps()));
+			}
+			storeMask(_mm_movemask_ps(inside), i, 4);
+		}
+		return padded;
+#else
+		(void)frustum;
+		(void)padded;
+		return 0;
+#endif
+	}
+
+	// one result per lane, counting the visible ones short of the padding.
+	// padding is to 8, so with 4 lanes a register can be padding only
+	void storeMask(int mask, size_t first, int width)
+	{
+		if (first >= count)
+		{
+			return;
+		}
+		if (count - first < (size_t)width)
+		{
+			width = (int)(count - first);
+			mask &= (1 << width) - 1;
+		}
+		for (int lane = 0; lane < width; lane++)
+		{
+			results[first + lane] = (mask >> lane) & 1;
+		}
+		for (; mask; mask &= mask - 1)
+		{
+			lastStats.visible++;
+		}
+	}
+};
+
+#endif
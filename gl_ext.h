@@ -0,0 +1,94 @@
+#ifndef GL_EXT_H
+#define GL_EXT_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <cstddef>
+
+// glad is generated for GL 3.3, so the 4.x pieces the renderer uses are
+// declared here, and their entry points looked up at run time with
+// loadGLProc: a NULL proc means the context can't do it, and callers fall
+// back to 3.3
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_COMPUTE_SHADER
+#define GL_COMPUTE_SHADER 0x91B9
+#endif
+#ifndef GL_SAMPLER_CUBE_MAP_ARRAY
+#define GL_SAMPLER_CUBE_MAP_ARRAY 0x900C
+#define GL_SAMPLER_CUBE_MAP_ARRAY_SHADOW 0x900D
+#define GL_INT_SAMPLER_CUBE_MAP_ARRAY 0x900E
+#define GL_UNSIGNED_INT_SAMPLER_CUBE_MAP_ARRAY 0x900F
+#endif
+#ifndef GL_SHADER_STORAGE_BUFFER
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#endif
+#ifndef GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT 0x00000001
+#endif
+#ifndef GL_TEXTURE_FETCH_BARRIER_BIT
+#define GL_TEXTURE_FETCH_BARRIER_BIT 0x00000008
+#endif
+#ifndef GL_COMMAND_BARRIER_BIT
+#define GL_COMMAND_BARRIER_BIT 0x00000040
+#endif
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+
+typedef void (APIENTRY* TexStorage2DProc)(GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height);
+typedef void (APIENTRY* BufferStorageProc)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+typedef void (APIENTRY* MultiDrawElementsIndirectProc)(GLenum mode, GLenum type, const void* indirect, GLsizei drawcount, GLsizei stride);
+typedef void (APIENTRY* DispatchComputeProc)(GLuint x, GLuint y, GLuint z);
+typedef void (APIENTRY* MemoryBarrierProc)(GLbitfield barriers);
+typedef void (APIENTRY* BindImageTextureProc)(GLuint unit, GLuint texture, GLint level, GLboolean layered, GLint layer, GLenum access, GLenum format);
+
+// whether the current context is GL major.minor or later
+inline bool hasGLVersion(int major, int minor)
+{
+	return GLVersion.major > major || (GLVersion.major == major && GLVersion.minor >= minor);
+}
+
+// the entry point called name, if the current context is GL major.minor or
+// later or has the extensions given (all of them); NULL otherwise
+template <typename Proc>
+Proc loadGLProc(const char* name, int major, int minor, const char* extension = NULL, const char* otherExtension = NULL)
+{
+	bool supported = hasGLVersion(major, minor) ||
+		(extension && glfwExtensionSupported(extension) && (!otherExtension || glfwExtensionSupported(otherExtension)));
+	return supported ? (Proc)glfwGetProcAddress(name) : NULL;
+}
+
+// waits for the GPU to pass fence, then deletes it and sets it to 0. does
+// nothing if it is 0 already
+inline void waitFence(GLsync& fence)
+{
+	if (fence)
+	{
+		// the flush bit makes sure the fence gets submitted, or this could wait forever
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+		{
+		}
+		glDeleteSync(fence);
+		fence = 0;
+	}
+}
+
+// replaces the contents of the buffer bound to target with bytes of data,
+// orphaning the old storage first so the driver needn't wait for draws
+// still reading it
+inline void streamBufferData(GLenum target, size_t bytes, const void* data)
+{
+	glBufferData(target, bytes, NULL, GL_STREAM_DRAW);
+	if (bytes > 0)
+	{
+		glBufferSubData(target, 0, bytes, data);
+	}
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <glad/glad.h>
+
+// remembers the GL state set through it and skips calls that would set
+// something to what it already is. state belongs to a context, and each
+// thread here drives a context of its own (see UploadThread), so there is one
+// cache per thread. binds of programs, VAOs, textures and buffers all go
+// through it; anything that changes those behind its back must call
+// invalidate() after
+class GLState
+{
+public:
+	// calls made through the cache, and how many it skipped as redundant
+	struct Counters
+	{
+		unsigned int issued = 0;
+		unsigned int elided = 0;
+	};
+
+	// the cache for the calling thread's context
+	static GLState& current()
+	{
+		static thread_local GLState state;
+		return state;
+	}
+
+	GLState()
+	{
+		invalidate();
+	}
+
+	// forgets everything, so the next call of each kind reaches GL
+	void invalidate()
+	{
+		currentProgram = unknown;
+		vertexArray = unknown;
+		elementBuffer = unknown;
+		activeUnit = unknown;
+		for (int i = 0; i < maxUnits; i++)
+		{
+			textures[i][0] = textures[i][1] = unknown;
+		}
+		for (int i = 0; i < bufferTargets; i++)
+		{
+			buffers[i] = unknown;
+		}
+		for (int i = 0; i < capabilities; i++)
+		{
+			enabled[i] = -1;
+		}
+		depthFuncValue = unknown;
+		depthMaskValue = -1;
+		blendSrc = blendDst = unknown;
+	}
+
+	void useProgram(GLuint program)
+	{
+		if (changed(currentProgram, program))
+		{
+			glUseProgram(program);
+		}
+	}
+
+	// the program in use, asking GL if the cache doesn't know
+	GLuint program()
+	{
+		if (currentProgram == unknown)
+		{
+			GLint program = 0;
+			glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+			currentProgram = program;
+		}
+		return currentProgram;
+	}
+
+	void bindVertexArray(GLuint vao)
+	{
+		if (changed(vertexArray, vao))
+		{
+			glBindVertexArray(vao);
+			// the element array binding comes with the VAO
+			elementBuffer = unknown;
+		}
+	}
+
+	void activeTexture(unsigned int unit)
+	{
+		if (changed(activeUnit, unit))
+		{
+			glActiveTexture(GL_TEXTURE0 + unit);
+		}
+	}
+
+	// binds on the given unit, switching the active one only if needed
+	void bindTexture(unsigned int unit, GLenum target, GLuint texture)
+	{
+		int slot = textureSlot(target);
+		if (unit >= (unsigned int)maxUnits || slot < 0)
+		{
+			activeTexture(unit);
+			glBindTexture(target, texture);
+			counters.issued++;
+		}
+		else if (changed(textures[unit][slot], texture))
+		{
+			activeTexture(unit);
+			glBindTexture(target, texture);
+		}
+	}
+
+	// binds on the active unit, as glBindTexture does
+	void bindTexture(GLenum target, GLuint texture)
+	{
+		if (activeUnit == unknown)
+		{
+			activeTexture(0);
+		}
+		bindTexture(activeUnit, target, texture);
+	}
+
+	// GL unbinds a texture it deletes, and may hand its name out again
+	void deleteTexture(GLuint texture)
+	{
+		glDeleteTextures(1, &texture);
+		for (int i = 0; i < maxUnits; i++)
+		{
+			for (int j = 0; j < 2; j++)
+			{
+				if (textures[i][j] == texture)
+				{
+					textures[i][j] = 0;
+				}
+			}
+		}
+	}
+
+	void bindBuffer(GLenum target, GLuint buffer)
+	{
+		if (target == GL_ELEMENT_ARRAY_BUFFER)
+		{
+			if (changed(elementBuffer, buffer))
+			{
+				glBindBuffer(target, buffer);
+			}
+			return;
+		}
+		int slot = bufferSlot(target);
+		if (slot < 0)
+		{
+			glBindBuffer(target, buffer);
+			counters.issued++;
+		}
+		else if (changed(buffers[slot], buffer))
+		{
+			glBindBuffer(target, buffer);
+		}
+	}
+
+	// glBindBufferRange, which binds target's general binding point too
+	void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+	{
+		glBindBufferRange(target, index, buffer, offset, size);
+		counters.issued++;
+		int slot = bufferSlot(target);
+		if (slot >= 0)
+		{
+			buffers[slot] = buffer;
+		}
+	}
+
+	void enable(GLenum capability)
+	{
+		setCapability(capability, true);
+	}
+
+	void disable(GLenum capability)
+	{
+		setCapability(capability, false);
+	}
+
+	void depthFunc(GLenum func)
+	{
+		if (changed(depthFuncValue, func))
+		{
+			glDepthFunc(func);
+		}
+	}
+
+	void depthMask(bool write)
+	{
+		if (changed(depthMaskValue, write ? 1 : 0))
+		{
+			glDepthMask(write ? GL_TRUE : GL_FALSE);
+		}
+	}
+
+	void blendFunc(GLenum src, GLenum dst)
+	{
+		if (blendSrc == src && blendDst == dst)
+		{
+			counters.elided++;
+			return;
+		}
+		blendSrc = src;
+		blendDst = dst;
+		glBlendFunc(src, dst);
+		counters.issued++;
+	}
+
+	// closes the counts for a frame; lastFrame() has them until the next
+	void endFrame()
+	{
+		previous = counters;
+		counters = Counters();
+	}
+
+	const Counters& lastFrame() const
+	{
+		return previous;
+	}
+
+private:
+	static const GLuint unknown = ~0u;
+	static const int maxUnits = 32;
+	static const int bufferTargets = 5;
+	static const int capabilities = 3;
+
+	GLuint currentProgram;
+	GLuint vertexArray;
+	GLuint elementBuffer;   // of the bound VAO
+	GLuint activeUnit;
+	GLuint textures[maxUnits][2];   // GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY
+	GLuint buffers[bufferTargets];
+	int enabled[capabilities];      // -1 unknown, else 0 or 1
+	GLuint depthFuncValue;
+	int depthMaskValue;
+	GLuint blendSrc, blendDst;
+	Counters counters, previous;
+
+	// counts the call, and records value if it is one
+	template <typename T>
+	bool changed(T& cached, T value)
+	{
+		if (cached == value)
+		{
+			counters.elided++;
+			return false;
+		}
+		cached = value;
+		counters.issued++;
+		return true;
+	}
+
+	static int textureSlot(GLenum target)
+	{
+		switch (target)
+		{
+		case GL_TEXTURE_2D: return 0;
+		case GL_TEXTURE_2D_ARRAY: return 1;
+		default: return -1;
+		}
+	}
+
+	static int bufferSlot(GLenum target)
+	{
+		switch (target)
+		{
+		case GL_ARRAY_BUFFER: return 0;
+		case GL_PIXEL_UNPACK_BUFFER: return 1;
+		case GL_UNIFORM_BUFFER: return 2;
+		case GL_COPY_READ_BUFFER: return 3;
+		case GL_COPY_WRITE_BUFFER: return 4;
+		default: return -1;
+		}
+	}
+
+	void setCapability(GLenum capability, bool on)
+	{
+		int slot = capability == GL_DEPTH_TEST ? 0 : capability == GL_BLEND ? 1 : capability == GL_CULL_FACE ? 2 : -1;
+		if (slot < 0 || changed(enabled[slot], on ? 1 : 0))
+		{
+			if (slot < 0)
+			{
+				counters.issued++;
+			}
+			if (on)
+			{
+				glEnable(capability);
+			}
+			else
+			{
+				glDisable(capability);
+			}
+		}
+	}
+};
+
+#endif
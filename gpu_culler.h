@@ -0,0 +1,259 @@
+#ifndef GPU_CULLER_H
+#define GPU_CULLER_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <vector>
+
+#include "gl_ext.h"
+#include "gl_state.h"
+#include "indirect_batch.h"
+#include "instance_set.h"
+#include "shader.h"
+
+using namespace std;
+
+// culls an IndirectBatch on the GPU, instance by instance, so neither the
+// tests nor the submission cost the CPU anything per instance. a compute
+// pass checks each instance's bounds (its mesh's box, through its transform)
+// against the view frustum and against a depth pyramid (Hi-Z) built from
+// the previous frame, and appends the ones that survive to their command's
+// range of a second instance buffer, counting them into a copy of the
+// batch's commands. the batch then draws from those, with no readback.
+//
+// the pyramid holds, per texel of each level, the farthest depth under it;
+// an instance is hidden when its nearest point, seen from where the camera
+// was last frame, is behind the farthest depth over the area it covers.
+// something that comes into view from behind an occluder can so be missing
+// for a frame.
+//
+// needs GL 4.3 (compute shaders and storage buffers); without it
+// supported() is false and the calls do nothing, leaving batches unculled.
+// meant for one batch: culling another re-uploads the per-command data
+class GpuCuller
+{
+public:
+	// needs a current context
+	GpuCuller()
+	{
+		dispatchCompute = loadGLProc<DispatchComputeProc>("glDispatchCompute", 4, 3);
+		memoryBarrier = loadGLProc<MemoryBarrierProc>("glMemoryBarrier", 4, 3);
+		bindImageTexture = loadGLProc<BindImageTextureProc>("glBindImageTexture", 4, 3);
+		if (!dispatchCompute || !memoryBarrier || !bindImageTexture)
+		{
+			dispatchCompute = NULL;
+			return;
+		}
+
+		cullProgram.reset(new Shader("shaders/cullCompute.glsl"));
+		instanceCount = cullProgram->uniform<int>("instanceCount");
+		viewProjection = cullProgram->uniform<glm::mat4>("viewProjection");
+		previousViewProjection = cullProgram->uniform<glm::mat4>("previousViewProjection");
+		occlusion = cullProgram->uniform<bool>("occlusion");
+		hiZLevels = cullProgram->uniform<int>("hiZLevels");
+
+		hiZProgram.reset(new Shader("shaders/hiZCompute.glsl"));
+		sourceLevel = hiZProgram->uniform<int>("sourceLevel");
+		copyDepth = hiZProgram->uniform<bool>("copyDepth");
+	}
+
+	bool supported() const
+	{
+		return dispatchCompute != NULL;
+	}
+
+	// culls batch for a camera at view and projection; its next draw() shows
+	// only what passed. until captureDepth() has run once there is only the
+	// frustum test
+	void cull(IndirectBatch& batch, const glm::mat4& view, const glm::mat4& projection)
+	{
+		if (!supported() || !batch.multiDrawElementsIndirect || batch.commands.empty())
+		{
+			return;
+		}
+		if (source != &batch || generation != batch.generation)
+		{
+			uploadLayout(batch);
+		}
+
+		GLState& state = GLState::current();
+		// every command starts out with no instances; the pass counts them back in
+		state.bindBuffer(GL_COPY_READ_BUFFER, emptyCommands);
+		state.bindBuffer(GL_COPY_WRITE_BUFFER, culledCommands);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, batch.commands.size() * sizeof(DrawElementsIndirectCommand));
+
+		cullProgram->use();
+		instanceCount.set((int)batch.perDraw.size());
+		viewProjection.set(projection * view);
+		previousViewProjection.set(previousFrame);
+		occlusion.set(hiZReady);
+		hiZLevels.set(levels);
+		state.bindTexture(cullProgram->samplerUnit("hiZ"), GL_TEXTURE_2D, pyramid);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, batch.instanceBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, instanceCommands);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, commandBounds);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, culledCommands);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, visibleInstances);
+		dispatchCompute((GLuint)(batch.perDraw.size() + 63) / 64, 1, 1);
+		// the draws read what was written as commands and as vertex attributes
+		memoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+		batch.culled = true;
+		batch.culledVAO = culledVAO;
+		batch.culledCommands = culledCommands;
+	}
+
+	// builds the pyramid the next cull() tests against from the depth buffer
+	// of the frame just drawn, in the default framebuffer of width by height,
+	// seen through view and projection. call once everything is drawn,
+	// before swapping buffers
+	void captureDepth(int width, int height, const glm::mat4& view, const glm::mat4& projection)
+	{
+		if (!supported() || width <= 0 || height <= 0)
+		{
+			return;
+		}
+		GLState& state = GLState::current();
+		if (width != pyramidWidth || height != pyramidHeight)
+		{
+			allocatePyramid(width, height);
+		}
+		state.bindTexture(GL_TEXTURE_2D, depthCopy);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+		// level 0 is a copy of the depth, each level after the max of the last
+		hiZProgram->use();
+		GLint unit = hiZProgram->samplerUnit("source");
+		for (int level = 0; level < levels; level++)
+		{
+			copyDepth.set(level == 0);
+			sourceLevel.set(level == 0 ? 0 : level - 1);
+			state.bindTexture(unit, GL_TEXTURE_2D, level == 0 ? depthCopy : pyramid);
+			bindImageTexture(0, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+			int w = width >> level > 0 ? width >> level : 1;
+			int h = height >> level > 0 ? height >> level : 1;
+			dispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+			memoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		}
+
+		previousFrame = projection * view;
+		hiZReady = true;
+	}
+
+private:
+	DispatchComputeProc dispatchCompute = NULL;
+	MemoryBarrierProc memoryBarrier = NULL;
+	BindImageTextureProc bindImageTexture = NULL;
+
+	unique_ptr<Shader> cullProgram, hiZProgram;
+	Uniform<int> instanceCount, hiZLevels, sourceLevel;
+	Uniform<glm::mat4> viewProjection, previousViewProjection;
+	Uniform<bool> occlusion, copyDepth;
+
+	// the batch the per-command data below describes, as of which compile()
+	IndirectBatch* source = NULL;
+	unsigned int generation = 0;
+	unsigned int instanceCommands = 0, commandBounds = 0, emptyCommands = 0;
+	unsigned int culledCommands = 0, visibleInstances = 0, culledVAO = 0;
+
+	unsigned int depthCopy = 0, pyramid = 0;
+	int pyramidWidth = 0, pyramidHeight = 0, levels = 0;
+	glm::mat4 previousFrame = glm::mat4(1.0f);
+	bool hiZReady = false;
+
+	// what the pass needs besides the instances: each instance's command,
+	// each command's mesh bounds, and the commands with no instances to
+	// reset to. sizes the outputs, and makes the VAO that draws from them
+	void uploadLayout(IndirectBatch& batch)
+	{
+		source = &batch;
+		generation = batch.generation;
+
+		vector<unsigned int> commandOf(batch.perDraw.size());
+		vector<glm::vec4> bounds;
+		vector<DrawElementsIndirectCommand> empty = batch.commands;
+		for (unsigned int i = 0; i < batch.commands.size(); i++)
+		{
+			const DrawElementsIndirectCommand& command = batch.commands[i];
+			for (unsigned int j = 0; j < command.instanceCount; j++)
+			{
+				commandOf[command.baseInstance + j] = i;
+			}
+			bounds.push_back(glm::vec4(batch.commandMeshes[i]->boundsMin, 1.0f));
+			bounds.push_back(glm::vec4(batch.commandMeshes[i]->boundsMax, 1.0f));
+			empty[i].instanceCount = 0;
+		}
+
+		if (instanceCommands == 0)
+		{
+			glGenBuffers(1, &instanceCommands);
+			glGenBuffers(1, &commandBounds);
+			glGenBuffers(1, &emptyCommands);
+			glGenBuffers(1, &culledCommands);
+			glGenBuffers(1, &visibleInstances);
+		}
+		upload(instanceCommands, commandOf.size() * sizeof(unsigned int), &commandOf[0], GL_STATIC_DRAW);
+		upload(commandBounds, bounds.size() * sizeof(glm::vec4), &bounds[0], GL_STATIC_DRAW);
+		upload(emptyCommands, empty.size() * sizeof(DrawElementsIndirectCommand), &empty[0], GL_STATIC_DRAW);
+		upload(culledCommands, empty.size() * sizeof(DrawElementsIndirectCommand), NULL, GL_DYNAMIC_COPY);
+		upload(visibleInstances, batch.perDraw.size() * sizeof(InstanceData), NULL, GL_DYNAMIC_COPY);
+
+		// the VAO refers to the batch's geometry buffers, so it goes with the batch
+		GLState& state = GLState::current();
+		if (culledVAO != 0)
+		{
+			state.bindVertexArray(0);
+			glDeleteVertexArrays(1, &culledVAO);
+		}
+		culledVAO = batch.makeVertexArray(visibleInstances);
+	}
+
+	static void upload(unsigned int buffer, size_t bytes, const void* data, GLenum usage)
+	{
+		GLState::current().bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, bytes, data, usage);
+	}
+
+	// a depth texture to copy the framebuffer's into, and an R32F one with a
+	// full mip chain for the pyramid, both the size of the framebuffer
+	void allocatePyramid(int width, int height)
+	{
+		GLState& state = GLState::current();
+		if (pyramid == 0)
+		{
+			glGenTextures(1, &depthCopy);
+			glGenTextures(1, &pyramid);
+		}
+
+		state.bindTexture(GL_TEXTURE_2D, depthCopy);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+		state.bindTexture(GL_TEXTURE_2D, pyramid);
+		levels = 0;
+		while (true)
+		{
+			int w = width >> levels > 0 ? width >> levels : 1;
+			int h = height >> levels > 0 ? height >> levels : 1;
+			glTexImage2D(GL_TEXTURE_2D, levels, GL_R32F, w, h, 0, GL_RED, GL_FLOAT, NULL);
+			levels++;
+			if (w == 1 && h == 1)
+			{
+				break;
+			}
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+
+		pyramidWidth = width;
+		pyramidHeight = height;
+	}
+};
+
+#endif
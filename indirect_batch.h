@@ -0,0 +1,257 @@
+#ifndef INDIRECT_BATCH_H
+#define INDIRECT_BATCH_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "gl_ext.h"
+#include "gl_state.h"
+#include "instance_set.h"
+#include "mesh.h"
+#include "shader.h"
+
+using namespace std;
+
+// one draw, laid out as glMultiDrawElementsIndirect reads it
+struct DrawElementsIndirectCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+// draws compiled ahead of time into a buffer of DrawElementsIndirectCommands.
+// the meshes added are copied into one vertex and one index buffer, so a
+// single VAO serves every draw, and each draw's InstanceData sits in one more
+// buffer from its baseInstance on, which is where instanced attributes start
+// reading. draws are grouped by material, and with GL 4.3 (or the
+// multi_draw_indirect and base_instance extensions) a group goes out as one
+// glMultiDrawElementsIndirect, however many meshes and models it holds. on
+// GL 3.3 the commands are looped instead, repointing the instance attributes
+// at each baseInstance, since 3.3 draws have none.
+//
+// shaders get the same inputs as with InstanceSet: "instanced" is set while
+// drawing, and "model" is left alone
+class IndirectBatch
+{
+public:
+	// needs a current context
+	IndirectBatch()
+	{
+		multiDrawElementsIndirect = loadGLProc<MultiDrawElementsIndirectProc>("glMultiDrawElementsIndirect", 4, 3, "GL_ARB_multi_draw_indirect", "GL_ARB_base_instance");
+	}
+
+	// adds a draw of mesh for each of count instances, and returns the index
+	// of the first one's data (see instance()). shows from the next compile()
+	unsigned int add(Mesh& mesh, const InstanceData* instances, unsigned int count)
+	{
+		unsigned int first = perDraw.size();
+		perDraw.insert(perDraw.end(), instances, instances + count);
+		draws.push_back(Draw{ &mesh, first, count });
+		return first;
+	}
+
+	void clear()
+	{
+		perDraw.clear();
+		draws.clear();
+	}
+
+	// builds the commands and uploads them with the geometry and instance
+	// data. costs as much as the meshes are big; call when the set of draws
+	// changes, not every frame
+	void compile()
+	{
+		vector<Vertex> vertices;
+		vector<unsigned int> indices;
+		// where each mesh went, as a command to copy; a mesh drawn many
+		// times is stored once
+		map<Mesh*, DrawElementsIndirectCommand> placed;
+
+		stable_sort(draws.begin(), draws.end(), [](const Draw& a, const Draw& b) { return a.mesh->materialId() < b.mesh->materialId(); });
+		commands.clear();
+		commandMeshes.clear();
+		runs.clear();
+		for (unsigned int i = 0; i < draws.size(); i++)
+		{
+			Mesh* mesh = draws[i].mesh;
+			map<Mesh*, DrawElementsIndirectCommand>::iterator found = placed.find(mesh);
+			if (found == placed.end())
+			{
+				DrawElementsIndirectCommand command;
+				command.count = mesh->indices.size();
+				command.firstIndex = indices.size();
+				command.baseVertex = vertices.size();
+				command.instanceCount = 0;
+				command.baseInstance = 0;
+				vertices.insert(vertices.end(), mesh->vertices.begin(), mesh->vertices.end());
+				indices.insert(indices.end(), mesh->indices.begin(), mesh->indices.end());
+				found = placed.insert(make_pair(mesh, command)).first;
+			}
+
+			DrawElementsIndirectCommand command = found->second;
+			command.instanceCount = draws[i].count;
+			command.baseInstance = draws[i].first;
+			if (runs.empty() || runs.back().material != mesh->materialId())
+			{
+				runs.push_back(Run{ mesh, mesh->materialId(), (unsigned int)commands.size(), 0 });
+			}
+			runs.back().count++;
+			commands.push_back(command);
+			commandMeshes.push_back(mesh);
+		}
+		// anything culled is out of date
+		culled = false;
+		generation++;
+
+		GLState& state = GLState::current();
+		if (VAO == 0)
+		{
+			setupVertexArray();
+		}
+		state.bindBuffer(GL_ARRAY_BUFFER, VBO);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.empty() ? NULL : &vertices[0], GL_STATIC_DRAW);
+		state.bindVertexArray(VAO);
+		state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.empty() ? NULL : &indices[0], GL_STATIC_DRAW);
+		if (multiDrawElementsIndirect)
+		{
+			state.bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.empty() ? NULL : &commands[0], GL_STATIC_DRAW);
+		}
+		updateInstances();
+	}
+
+	// the data of a drawn instance, by the index add() counted from. send
+	// changes with updateInstances()
+	InstanceData& instance(unsigned int index)
+	{
+		return perDraw[index];
+	}
+
+	// uploads the instance data alone, for moving things without a compile()
+	void updateInstances()
+	{
+		GLState& state = GLState::current();
+		state.bindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		streamBufferData(GL_ARRAY_BUFFER, perDraw.size() * sizeof(InstanceData), perDraw.data());
+	}
+
+	// draws everything as of the last compile(). shader must be in use with
+	// "view" and "projection" set
+	void draw(Shader& shader)
+	{
+		if (commands.empty())
+		{
+			return;
+		}
+		GLState& state = GLState::current();
+		// what GpuCuller wrote can only be drawn indirectly; the loop below
+		// draws every command from the batch's own buffers
+		if (culled && multiDrawElementsIndirect)
+		{
+			state.bindVertexArray(culledVAO);
+			state.bindBuffer(GL_DRAW_INDIRECT_BUFFER, culledCommands);
+		}
+		else if (multiDrawElementsIndirect)
+		{
+			state.bindVertexArray(VAO);
+			state.bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+		}
+		else
+		{
+			state.bindVertexArray(VAO);
+			state.bindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		}
+
+		Uniform<bool> instanced = shader.uniform<bool>("instanced");
+		instanced.set(true);
+		for (unsigned int i = 0; i < runs.size(); i++)
+		{
+			const Run& run = runs[i];
+			run.mesh->bindMaterial(shader);
+			if (multiDrawElementsIndirect)
+			{
+				multiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const void*)(run.first * sizeof(DrawElementsIndirectCommand)), run.count, 0);
+				continue;
+			}
+			for (unsigned int j = run.first; j < run.first + run.count; j++)
+			{
+				const DrawElementsIndirectCommand& command = commands[j];
+				Mesh::instanceAttributes(command.baseInstance * sizeof(InstanceData));
+				glDrawElementsInstancedBaseVertex(GL_TRIANGLES, command.count, GL_UNSIGNED_INT, (void*)(command.firstIndex * sizeof(unsigned int)), command.instanceCount, command.baseVertex);
+			}
+		}
+		instanced.set(false);
+	}
+
+	// draw calls draw() makes: one per material with multi-draw, else one per command
+	unsigned int calls() const
+	{
+		return multiDrawElementsIndirect ? runs.size() : commands.size();
+	}
+
+private:
+	friend class GpuCuller;
+
+	struct Draw
+	{
+		Mesh* mesh;
+		unsigned int first;
+		unsigned int count;
+	};
+	// commands sharing a material, drawn with one bindMaterial
+	struct Run
+	{
+		Mesh* mesh;
+		unsigned int material;
+		unsigned int first;
+		unsigned int count;
+	};
+
+	MultiDrawElementsIndirectProc multiDrawElementsIndirect = NULL;
+	vector<Draw> draws;
+	vector<InstanceData> perDraw;
+	vector<DrawElementsIndirectCommand> commands;
+	vector<Mesh*> commandMeshes;
+	vector<Run> runs;
+	unsigned int VAO = 0, VBO = 0, EBO = 0, instanceBuffer = 0, indirectBuffer = 0;
+	// set by GpuCuller::cull: draw() then takes commands and instance data
+	// from what it wrote, through a VAO of its own
+	bool culled = false;
+	unsigned int culledVAO = 0, culledCommands = 0;
+	// counts compile()s, so GpuCuller knows when its copy of the layout is stale
+	unsigned int generation = 0;
+
+	void setupVertexArray()
+	{
+		glGenBuffers(1, &VBO);
+		glGenBuffers(1, &EBO);
+		glGenBuffers(1, &instanceBuffer);
+		glGenBuffers(1, &indirectBuffer);
+
+		VAO = makeVertexArray(instanceBuffer);
+	}
+
+	// a VAO over the geometry, with instance attributes from instances
+	unsigned int makeVertexArray(unsigned int instances)
+	{
+		GLState& state = GLState::current();
+		unsigned int vao;
+		glGenVertexArrays(1, &vao);
+		state.bindVertexArray(vao);
+		state.bindBuffer(GL_ARRAY_BUFFER, VBO);
+		Mesh::vertexAttributes();
+		state.bindBuffer(GL_ARRAY_BUFFER, instances);
+		Mesh::instanceAttributes(0);
+		state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+		return vao;
+	}
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef INSTANCE_SET_H
+#define INSTANCE_SET_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <vector>
+
+#include "gl_ext.h"
+#include "gl_state.h"
+
+using namespace std;
+
+// what each copy of an instanced draw gets; the vertex shader reads it as
+// attributes 5 to 8 (model) and 9 (tint)
+struct InstanceData
+{
+	glm::mat4 model = glm::mat4(1.0f);
+	// multiplies the material's color; a per-copy override
+	glm::vec4 tint = glm::vec4(1.0f);
+};
+
+// a vertex buffer of InstanceData, for Model::DrawInstanced. fill instances,
+// then update() to send them to GL
+class InstanceSet
+{
+public:
+	vector<InstanceData> instances;
+
+	void update()
+	{
+		GLState& state = GLState::current();
+		if (id == 0)
+		{
+			glGenBuffers(1, &id);
+		}
+		state.bindBuffer(GL_ARRAY_BUFFER, id);
+		streamBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(InstanceData), instances.data());
+		count = instances.size();
+	}
+
+	unsigned int buffer() const
+	{
+		return id;
+	}
+
+	// instances as of the last update()
+	int size() const
+	{
+		return count;
+	}
+
+private:
+	unsigned int id = 0;
+	int count = 0;
+};
+
+#endif
@@ -7,10 +7,14 @@
 
 #include <iostream>
 #include <cmath>
+#include <thread>
 
 #include "shader.h"
 #include "camera.h"
 #include "model.h"
+#include "gpu_culler.h"
+#include "frame_data.h"
+#include "uniform_ring.h"
 
 #define ATTENUATION_CONSTANT    1.0f
 #define ATTENUATION_LINEAR      0.14f
@@ -26,10 +30,20 @@ const unsigned int SCR_WIDTH = 1200;
 const unsigned int SCR_HEIGHT = 600;
 
 const bool wireframe = false;
+// extra nanosuits drawn in a grid behind the first, culled on the GPU where
+// it can; 0 for none
+const int crowdSize = 0;
 bool firstMouse = true;
 
 Camera camera(glm::vec3(0.0f, 0.0f, 3.0f));
 
+glm::vec3 pointLightPositions[NR_POINT_LIGHTS] = {
+    glm::vec3(0.7f, 0.2f, 2.0f),
+    glm::vec3(2.3f, -3.3f, -4.0f),
+    glm::vec3(-4.0f, 2.0f, -12.0f),
+    glm::vec3(0.0f, 0.0f, -3.0f)
+};
+
 
 float deltaTime = 0.0f;		// Time between current frame and last frame
 float lastFrame = 0.0f;		// Time of last frame
@@ -76,18 +90,47 @@ int main()
         return -1;
     }
 
-    glEnable(GL_DEPTH_TEST);
+    GLState& glState = GLState::current();
+    glState.enable(GL_DEPTH_TEST);
+
+    // let stb_image decode large JPEGs across all cores
+    stbi_set_thread_count(std::thread::hardware_concurrency());
 
     // load shaders
     Shader shader("shaders/modelVertexShader.glsl", "shaders/modelFragShader.glsl");
     //Shader lampShader("shaders/lampVertexShader.glsl", "shaders/lampFragmentShader.glsl");
 
-    // load models
-    Model ourModel("models/nanosuit/nanosuit.obj");
+    // uniform blocks are written here, a segment per frame in flight
+    UniformRing uniforms;
+    shader.bindUniformBlock("FrameData", FrameData::binding);
+    shader.bindUniformBlock("DrawData", DrawData::binding);
+
+    // draws are queued over the frame, then sorted to share state
+    RenderQueue renderQueue(&uniforms);
+
+    // placed once; compiled into an indirect batch once the model is in
+    std::vector<InstanceData> crowd;
+    int crowdColumns = (int)std::ceil(std::sqrt((float)crowdSize));
+    for (int i = 0; i < crowdSize; i++)
+    {
+        InstanceData instance;
+        instance.model = glm::translate(instance.model, glm::vec3((i % crowdColumns - crowdColumns / 2) * 1.0f, -1.75f, -2.0f - (i / crowdColumns) * 1.5f));
+        instance.model = glm::scale(instance.model, glm::vec3(0.2f, 0.2f, 0.2f));
+        instance.tint = glm::vec4(0.6f + 0.4f * (i % 3 == 0), 0.6f + 0.4f * (i % 3 == 1), 0.6f + 0.4f * (i % 3 == 2), 1.0f);
+        crowd.push_back(instance);
+    }
+    IndirectBatch crowdBatch;
+    bool crowdCompiled = false;
+    GpuCuller culler;
+
+    // load models on a thread of their own, so the window stays responsive
+    UploadThread uploads(window);
+    Model ourModel("models/nanosuit/nanosuit.obj", uploads);
 
     //------------------------------------------------
     // GLFW: Render loop (displays individual FRAMES)
     //------------------------------------------------
+    float lastTitleUpdate = 0.0f;
     while (!glfwWindowShouldClose(window))
     {
         float currentFrame = glfwGetTime();
@@ -114,30 +157,92 @@ int main()
         float lightZ = cos(glfwGetTime());
         glm::vec3 lightPos(lightX, lightY, lightZ);*/
 
-        // Draw model 
-        shader.use();
-
         // view/projection transformations
         glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
         glm::mat4 view = camera.GetViewMatrix();
-        shader.setMat4("projection", projection);
-        shader.setMat4("view", view);
+
+        // everything the frame's shaders share, in one write
+        uniforms.beginFrame();
+        FrameData frame = FrameData();
+        frame.view = view;
+        frame.projection = projection;
+        frame.viewPos = camera.Position;
+        frame.dirLight.direction = glm::vec3(-0.2f, -1.0f, -0.3f);
+        frame.dirLight.ambient = glm::vec3(0.05f);
+        frame.dirLight.diffuse = glm::vec3(0.4f);
+        frame.dirLight.specular = glm::vec3(0.5f);
+        for (int i = 0; i < NR_POINT_LIGHTS; i++)
+        {
+            frame.pointLight[i].position = pointLightPositions[i];
+            frame.pointLight[i].ambient = glm::vec3(0.05f);
+            frame.pointLight[i].diffuse = glm::vec3(0.8f);
+            frame.pointLight[i].specular = glm::vec3(1.0f);
+            frame.pointLight[i].Kc = ATTENUATION_CONSTANT;
+            frame.pointLight[i].Kl = ATTENUATION_LINEAR;
+            frame.pointLight[i].Kq = ATTENUATION_QUADRATIC;
+        }
+        frame.flashLight.position = camera.Position;
+        frame.flashLight.direction = camera.Front;
+        frame.flashLight.diffuse = glm::vec3(1.0f);
+        frame.flashLight.specular = glm::vec3(1.0f);
+        frame.flashLight.cutOff = std::cos(glm::radians(12.5f));
+        frame.flashLight.outerCutOff = std::cos(glm::radians(15.0f));
+        frame.flashLight.Kc = ATTENUATION_CONSTANT;
+        frame.flashLight.Kl = ATTENUATION_LINEAR;
+        frame.flashLight.Kq = ATTENUATION_QUADRATIC;
+        uniforms.push(FrameData::binding, &frame, sizeof(frame));
+
+        renderQueue.begin(view, projection, 100.0f);
 
         // world transformation
         glm::mat4 model = glm::mat4(1.0f);
         model = glm::translate(model, glm::vec3(0.0f, -1.75f, 0.0f)); // translate it down so it's at the center of the scene
         model = glm::scale(model, glm::vec3(0.2f, 0.2f, 0.2f)); // it's a bit too big so scale the model down
-        shader.setMat4("model", model);
-        ourModel.Draw(shader);
+        ourModel.Submit(renderQueue, shader, model);
 
+        // Draw model 
+        renderQueue.execute();
 
+        if (!crowdCompiled && ourModel.Compile(crowdBatch, crowd))
+        {
+            crowdBatch.compile();
+            crowdCompiled = true;
+        }
+        if (crowdCompiled)
+        {
+            culler.cull(crowdBatch, view, projection);
+            shader.use();
+            crowdBatch.draw(shader);
+
+            // this frame's depth is what the next one is culled against
+            int framebufferWidth, framebufferHeight;
+            glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+            culler.captureDepth(framebufferWidth, framebufferHeight, view, projection);
+        }
+
+
+        uniforms.endFrame();
 
         // check and call events and swap buffers
         glfwSwapBuffers(window);
         glfwPollEvents();
+
+        // show how many state changes GLState passed on and skipped
+        glState.endFrame();
+        if (currentFrame - lastTitleUpdate >= 1.0f)
+        {
+            const GLState::Counters& calls = glState.lastFrame();
+            const FrustumCuller::Stats& culled = renderQueue.cullStats();
+            std::string title = "OpenGL Lighting - GL state calls per frame: " + std::to_string(calls.issued) +
+                " issued, " + std::to_string(calls.elided) + " elided - meshes in view: " +
+                std::to_string(culled.visible) + " of " + std::to_string(culled.tested);
+            glfwSetWindowTitle(window, title.c_str());
+            lastTitleUpdate = currentFrame;
+        }
     }
 
     // terminate glfw and clean up memory allocations
+    uploads.stop();
     glfwTerminate();
     return 0;
 }
@@ -267,7 +372,7 @@ unsigned int loadTexture(char const* path)
         else if (nrComponents == 4)
             format = GL_RGBA;
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
+        GLState::current().bindTexture(GL_TEXTURE_2D, textureID);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
 
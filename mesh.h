@@ -7,12 +7,15 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "shader.h"
+#include "gl_state.h"
+#include "instance_set.h"
 
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <vector>
+#include <chrono>
 
 using namespace std;
 
@@ -28,6 +31,19 @@ struct Texture {
 	unsigned int id;
 	string type;
 	string path;
+	// JPEGs loaded as planes (see YCbCrTextureFromFile): id holds Y and these
+	// the Cb and Cr planes, converted to RGB in the shader; 0 otherwise
+	unsigned int cbId = 0;
+	unsigned int crId = 0;
+	// VRAM the texture takes, mipmaps included, and what picking its format
+	// by content saved over storing every channel of the file
+	size_t vramBytes = 0;
+	size_t vramSaved = 0;
+	// animated GIFs (see GifTextureArrayFromFile): id is 0, framesId holds one
+	// frame per layer of a GL_TEXTURE_2D_ARRAY and frameDelays how long each
+	// is shown, in milliseconds
+	unsigned int framesId = 0;
+	vector<int> frameDelays;
 };
 
 
@@ -37,7 +53,13 @@ public:
 	vector<Vertex> vertices;
 	vector<unsigned int> indices;
 	vector<Texture> textures;
-	unsigned int VAO;
+	unsigned int VAO = 0;
+	// axis-aligned bounds of the vertices, in model space
+	glm::vec3 boundsMin = glm::vec3(0.0f);
+	glm::vec3 boundsMax = glm::vec3(0.0f);
+	// of the sphere about the bounds' center holding every vertex, often
+	// tighter than the box's corners
+	float boundsRadius = 0.0f;
 
 	/* Functions */
 	Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
@@ -46,18 +68,200 @@ public:
 		this->indices = indices;
 		this->textures = textures;
 
-		setupMesh();
+		if (!vertices.empty())
+		{
+			boundsMin = boundsMax = vertices[0].Position;
+			for (unsigned int i = 1; i < vertices.size(); i++)
+			{
+				boundsMin = glm::min(boundsMin, vertices[i].Position);
+				boundsMax = glm::max(boundsMax, vertices[i].Position);
+			}
+			glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+			for (unsigned int i = 0; i < vertices.size(); i++)
+			{
+				boundsRadius = glm::max(boundsRadius, glm::length(vertices[i].Position - center));
+			}
+		}
+
+		setupBuffers();
+	}
+
+	void Draw(Shader& shader)
+	{
+		bindMaterial(shader);
+		drawElements();
+	}
+
+	// binds this mesh's textures for shader and sets the flags saying how to
+	// sample them; shader must be in use
+	void bindMaterial(Shader& shader)
+	{
+		GLState& state = GLState::current();
+		const MaterialBindings& material = bindingsFor(shader);
+		for (unsigned int i = 0; i < material.textures.size(); i++)
+		{
+			state.bindTexture(material.textures[i].unit, material.textures[i].target, material.textures[i].id);
+		}
+		for (unsigned int i = 0; i < material.flags.size(); i++)
+		{
+			glUniform1i(material.flags[i].location, material.flags[i].value);
+		}
+		for (unsigned int i = 0; i < material.layers.size(); i++)
+		{
+			glUniform1i(material.layers[i].location, currentFrame(textures[material.layers[i].texture].frameDelays));
+		}
+	}
+
+	// the draw call alone, with whatever material is bound
+	void drawElements()
+	{
+		// left bound: whatever binds next goes through GLState too
+		GLState::current().bindVertexArray(vertexArray());
+		glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+	}
+
+	// one copy per instance in buffer (an InstanceSet's), with whatever
+	// material is bound
+	void drawInstanced(unsigned int buffer, int count)
+	{
+		bindInstanceBuffer(buffer);
+		glDrawElementsInstanced(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0, count);
+	}
+
+	// points attributes 0-4 of the bound VAO at Vertex data in the bound
+	// GL_ARRAY_BUFFER
+	static void vertexAttributes()
+	{
+		// vertex positions
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+		// vertex normals
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
+		// vertex texture coords
+		glEnableVertexAttribArray(2);
+		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+		// vertex tangent
+		glEnableVertexAttribArray(3);
+		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Tangent));
+		// vertex bitangent
+		glEnableVertexAttribArray(4);
+		glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
+	}
+
+	// points attributes 5-9 of the bound VAO at InstanceData in the bound
+	// GL_ARRAY_BUFFER, one element per instance from byte offset on
+	static void instanceAttributes(size_t offset)
+	{
+		// a mat4 attribute takes four locations, a column each
+		for (unsigned int i = 0; i < 4; i++)
+		{
+			glEnableVertexAttribArray(5 + i);
+			glVertexAttribPointer(5 + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offset + offsetof(InstanceData, model) + i * sizeof(glm::vec4)));
+			glVertexAttribDivisor(5 + i, 1);
+		}
+		glEnableVertexAttribArray(9);
+		glVertexAttribPointer(9, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offset + offsetof(InstanceData, tint)));
+		glVertexAttribDivisor(9, 1);
 	}
 
-	void Draw(Shader shader)
+	// the VAO, set up on first use; render thread only
+	unsigned int vertexArray()
+	{
+		if (VAO == 0)
+		{
+			setupVertexArray();
+		}
+		return VAO;
+	}
+
+	// meshes with the same textures share an id from 1 up, so a sorted queue
+	// can keep them together and bind the material once (see RenderQueue)
+	unsigned int materialId()
+	{
+		if (material == 0)
+		{
+			static vector<vector<unsigned int>> materials;
+			vector<unsigned int> set;
+			for (unsigned int i = 0; i < textures.size(); i++)
+			{
+				set.push_back(textures[i].id);
+				set.push_back(textures[i].cbId);
+				set.push_back(textures[i].crId);
+				set.push_back(textures[i].framesId);
+			}
+			unsigned int i = 0;
+			while (i < materials.size() && materials[i] != set)
+			{
+				i++;
+			}
+			if (i == materials.size())
+			{
+				materials.push_back(set);
+			}
+			material = i + 1;
+		}
+		return material;
+	}
+
+private:
+	// how this mesh's textures meet one program's samplers (see bindingsFor):
+	// textures to bind, and the flag uniforms that say how to sample them
+	struct TextureBinding
+	{
+		unsigned int unit;
+		GLenum target;
+		unsigned int id;
+	};
+	struct FlagBinding
+	{
+		GLint location;
+		int value;
+	};
+	// animations, whose layer uniform changes with time
+	struct LayerBinding
+	{
+		GLint location;
+		unsigned int texture;
+	};
+	struct MaterialBindings
+	{
+		unsigned int program;
+		vector<TextureBinding> textures;
+		vector<FlagBinding> flags;
+		vector<LayerBinding> layers;
+	};
+
+	/* Render Data */
+	unsigned int VBO, EBO;
+	vector<MaterialBindings> bindings;
+	unsigned int material = 0;
+	// what the VAO's per-instance attributes point at
+	unsigned int instanceBuffer = 0;
+
+	/* Functions */
+
+	// the bindings for shader, worked out on the first Draw with it. sampler
+	// units are fixed per program (see Shader::samplerUnit), so drawing only
+	// binds textures, and names are only built here
+	const MaterialBindings& bindingsFor(const Shader& shader)
 	{
+		for (unsigned int i = 0; i < bindings.size(); i++)
+		{
+			if (bindings[i].program == shader.ID)
+			{
+				return bindings[i];
+			}
+		}
+
+		MaterialBindings material;
+		material.program = shader.ID;
 		unsigned int diffuseNr = 1;
 		unsigned int specularNr = 1;
 		unsigned int normalNr = 1;
 		unsigned int heightNr = 1;
 		for (unsigned int i = 0; i < textures.size(); i++)
 		{
-			glActiveTexture(GL_TEXTURE0 + i); // activate proper texture unit before binding
 			// retrieve texture number ( the 'N' in texture_diffuseN)
 			string number;
 			string name = textures[i].type;
@@ -77,55 +281,115 @@ public:
 			{
 				number = std::to_string(heightNr++);
 			}
+			name += number;
 
-			shader.setFloat(("material." + name + number).c_str(), i);
-			glBindTexture(GL_TEXTURE_2D, textures[i].id);
+			// animated textures have no 2D image (id is 0)
+			if (textures[i].id != 0)
+			{
+				addSampler(material, shader, name, GL_TEXTURE_2D, textures[i].id);
+			}
+			addFlag(material, shader, name + "_ycbcr", textures[i].cbId != 0);
+			if (textures[i].cbId != 0)
+			{
+				addSampler(material, shader, name + "_cb", GL_TEXTURE_2D, textures[i].cbId);
+				addSampler(material, shader, name + "_cr", GL_TEXTURE_2D, textures[i].crId);
+			}
+			addFlag(material, shader, name + "_animated", textures[i].framesId != 0);
+			if (textures[i].framesId != 0)
+			{
+				addSampler(material, shader, name + "_frames", GL_TEXTURE_2D_ARRAY, textures[i].framesId);
+				const Shader::UniformInfo* layer = shader.findUniform((name + "_layer").c_str());
+				if (layer)
+				{
+					material.layers.push_back(LayerBinding{ layer->location, i });
+				}
+			}
 		}
+		bindings.push_back(material);
+		return bindings.back();
+	}
 
-		// draw mesh
-		glBindVertexArray(VAO);
-		glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
-		glActiveTexture(GL_TEXTURE0);
+	// samplers and flags the shader doesn't use are left out
+	static void addSampler(MaterialBindings& material, const Shader& shader, const string& name, GLenum target, unsigned int id)
+	{
+		GLint unit = shader.samplerUnit(name.c_str());
+		if (unit >= 0)
+		{
+			material.textures.push_back(TextureBinding{ (unsigned int)unit, target, id });
+		}
 	}
 
-private:
-	/* Render Data */
-	unsigned int VBO, EBO;
+	static void addFlag(MaterialBindings& material, const Shader& shader, const string& name, bool value)
+	{
+		const Shader::UniformInfo* flag = shader.findUniform(name.c_str());
+		if (flag)
+		{
+			material.flags.push_back(FlagBinding{ flag->location, (int)value });
+		}
+	}
 
-	/* Functions */
+	// the frame an animation is on, playing in a loop since the first call
+	static int currentFrame(const vector<int>& delays)
+	{
+		static const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		long long length = 0;
+		for (unsigned int i = 0; i < delays.size(); i++)
+		{
+			length += delays[i];
+		}
+		if (length == 0)
+		{
+			return 0;
+		}
+		long long t = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() % length;
+		int frame = 0;
+		while (t >= delays[frame])
+		{
+			t -= delays[frame++];
+		}
+		return frame;
+	}
 
-	void setupMesh()
+	// buffers are shared between contexts, so this may run on the upload
+	// thread (see UploadThread). the element array binding belongs to a VAO,
+	// so both go in through GL_ARRAY_BUFFER
+	void setupBuffers()
 	{
-		glGenVertexArrays(1, &VAO);
 		glGenBuffers(1, &VBO);
 		glGenBuffers(1, &EBO);
 
-		glBindVertexArray(VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, VBO);
-
+		GLState& state = GLState::current();
+		state.bindBuffer(GL_ARRAY_BUFFER, VBO);
 		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
 
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+		state.bindBuffer(GL_ARRAY_BUFFER, EBO);
+		glBufferData(GL_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+	}
 
-		// vertex positions
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-		// vertex normals
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
-		// vertex texture coords
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
-		// vertex tangent
-		glEnableVertexAttribArray(3);
-		glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Tangent));
-		// vertex bitangent
-		glEnableVertexAttribArray(4);
-		glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
+	// binds the VAO with its per-instance attributes reading from buffer.
+	// they stay enabled for ordinary draws too, where the shader ignores them
+	void bindInstanceBuffer(unsigned int buffer)
+	{
+		GLState& state = GLState::current();
+		state.bindVertexArray(vertexArray());
+		if (instanceBuffer == buffer)
+		{
+			return;
+		}
+		state.bindBuffer(GL_ARRAY_BUFFER, buffer);
+		instanceAttributes(0);
+		instanceBuffer = buffer;
+	}
 
-		glBindVertexArray(0);
+	// VAOs are not shared, so this waits for the first Draw, on the render thread
+	void setupVertexArray()
+	{
+		GLState& state = GLState::current();
+		glGenVertexArrays(1, &VAO);
+		state.bindVertexArray(VAO);
+		state.bindBuffer(GL_ARRAY_BUFFER, VBO);
+		state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+		vertexAttributes();
 	}
 };
 
@@ -14,14 +14,22 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <algorithm>
 
+#include "frustum_culler.h"
+#include "indirect_batch.h"
 #include "mesh.h"
+#include "render_queue.h"
 #include "shader.h"
 #include "stb_image.h"
+#include "texture_uploader.h"
+#include "upload_thread.h"
 
 using namespace std;
 
-unsigned int TextureFromFile(const char* path, const string& directory, bool gamma = false);
+unsigned int TextureFromFile(const char* path, const string& directory, bool gamma = false, Texture* texture = NULL);
+bool YCbCrTextureFromFile(const char* path, const string& directory, Texture& texture);
+bool GifTextureArrayFromFile(const char* path, const string& directory, Texture& texture);
 
 class Model
 {
@@ -36,15 +44,87 @@ public:
 	{
 		loadModel(path);
 	}
-	void Draw(Shader shader)
+	// loads on the upload thread instead; Draw skips the model until it is in.
+	// the model must stay put until then, or until uploads is stopped
+	Model(string const &path, UploadThread& uploads, bool gamma = false) : gammaCorrection(gamma)
 	{
+		loaded = uploads.submit([this, path]() { loadModel(path); });
+	}
+	void Draw(Shader& shader)
+	{
+		if (loaded && !loaded->ready())
+		{
+			return;
+		}
 		for (unsigned int i = 0; i < meshes.size(); i++)
 		{
 			meshes[i].Draw(shader);
 		}
 	}
+	// draws the meshes of the model at transform that frustum may see; the
+	// "model" uniform is the caller's to set
+	void Draw(Shader& shader, const Frustum& frustum, const glm::mat4& transform)
+	{
+		if (loaded && !loaded->ready())
+		{
+			return;
+		}
+		for (unsigned int i = 0; i < meshes.size(); i++)
+		{
+			WorldBounds bounds(meshes[i].boundsMin, meshes[i].boundsMax, meshes[i].boundsRadius, transform);
+			if (frustum.intersects(bounds.center, bounds.extents, bounds.radius))
+			{
+				meshes[i].Draw(shader);
+			}
+		}
+	}
+	// draws a copy of the model per instance, with one glDrawElementsInstanced
+	// per mesh. shader must be in use with "view" and "projection" set; its
+	// "model" uniform gives way to each instance's transform
+	void DrawInstanced(Shader& shader, const InstanceSet& instances)
+	{
+		if ((loaded && !loaded->ready()) || instances.size() == 0)
+		{
+			return;
+		}
+		Uniform<bool> instanced = shader.uniform<bool>("instanced");
+		instanced.set(true);
+		for (unsigned int i = 0; i < meshes.size(); i++)
+		{
+			meshes[i].bindMaterial(shader);
+			meshes[i].drawInstanced(instances.buffer(), instances.size());
+		}
+		instanced.set(false);
+	}
+	// adds a draw of every mesh, once per instance, to batch (see
+	// IndirectBatch); false, adding nothing, while the model is still loading
+	bool Compile(IndirectBatch& batch, const vector<InstanceData>& instances)
+	{
+		if ((loaded && !loaded->ready()) || instances.empty())
+		{
+			return false;
+		}
+		for (unsigned int i = 0; i < meshes.size(); i++)
+		{
+			batch.add(meshes[i], &instances[0], instances.size());
+		}
+		return true;
+	}
+	// queues every mesh instead of drawing it (see RenderQueue)
+	void Submit(RenderQueue& queue, Shader& shader, const glm::mat4& transform, RenderQueue::Pass pass = RenderQueue::Opaque)
+	{
+		if (loaded && !loaded->ready())
+		{
+			return;
+		}
+		for (unsigned int i = 0; i < meshes.size(); i++)
+		{
+			queue.submit(meshes[i], shader, transform, pass);
+		}
+	}
 
 private:
+	shared_ptr<UploadTicket> loaded;
 
 	/* Functions */
 	void loadModel(string const &path)
@@ -60,6 +140,15 @@ private:
 		directory = path.substr(0, path.find_last_of('/'));
 		// recursively process ASSIMP's root node
 		processNode(scene->mRootNode, scene);
+
+		size_t vramBytes = 0, vramSaved = 0;
+		for (unsigned int i = 0; i < textures_loaded.size(); i++)
+		{
+			vramBytes += textures_loaded[i].vramBytes;
+			vramSaved += textures_loaded[i].vramSaved;
+		}
+		cout << "Model " << path << ": " << textures_loaded.size() << " textures, " << vramBytes / 1024 << " KB of VRAM ("
+			<< vramSaved / 1024 << " KB saved by picking formats by content)" << endl;
 	}
 	void processNode(aiNode* node, const aiScene* scene)
 	{
@@ -180,10 +269,16 @@ private:
 			}
 			if (!skip)
 			{
-				// if texture hasn't been loaded already, load it
+				// if texture hasn't been loaded already, load it. only the diffuse
+				// sampler converts YCbCr and plays animations in the shader, so only
+				// it takes JPEG planes and GIF frame arrays
 				Texture texture;
-				texture.id = TextureFromFile(str.C_Str(), this->directory);
 				texture.type = typeName;
+				if (typeName != "texture_diffuse" ||
+					(!YCbCrTextureFromFile(str.C_Str(), this->directory, texture) && !GifTextureArrayFromFile(str.C_Str(), this->directory, texture)))
+				{
+					texture.id = TextureFromFile(str.C_Str(), this->directory, false, &texture);
+				}
 				texture.path = str.C_Str();
 				textures.push_back(texture);
 				textures_loaded.push_back(texture);
@@ -194,50 +289,345 @@ private:
 
 };
 
-unsigned int TextureFromFile(const char* path, const string& directory, bool gamma)
+// which of an image's channels to store, given what it uses: gray RGB(A)
+// keeps one channel and alpha that is all 0 or all 255 is dropped. fills
+// keep with the file channel each stored one comes from and swizzle so the
+// result samples like the full image; returns how many channels are kept.
+// normal maps keep their z: no shader here samples them to rebuild it from x
+// and y
+static int reducedChannels(const stbi_channels& channels, int nrComponents, int keep[4], GLint swizzle[4])
+{
+	// a swizzle can only stand in for an alpha of 0 or 1
+	GLint constantAlpha = 0;
+	if (channels.alpha_min == 255)
+	{
+		constantAlpha = GL_ONE;
+	}
+	else if (channels.alpha_max == 0)
+	{
+		constantAlpha = GL_ZERO;
+	}
+
+	int keepCount = 0;
+	swizzle[0] = GL_RED;
+	swizzle[1] = GL_GREEN;
+	swizzle[2] = GL_BLUE;
+	keep[keepCount++] = 0;
+	if (channels.gray)
+	{
+		swizzle[1] = swizzle[2] = GL_RED;
+	}
+	else
+	{
+		keep[keepCount++] = 1;
+		keep[keepCount++] = 2;
+	}
+	if (constantAlpha)
+	{
+		swizzle[3] = constantAlpha;
+	}
+	else
+	{
+		swizzle[3] = keepCount == 1 ? GL_GREEN : GL_ALPHA;
+		keep[keepCount++] = nrComponents - 1;
+	}
+	return keepCount;
+}
+
+// allocates the bound texture for tightly packed 8-bit pixels with
+// channelCount channels; returns the pixel format to upload them with
+static GLenum allocateTexture(int width, int height, int channelCount)
+{
+	static const GLenum internalFormats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+	static const GLenum formats[] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+	TextureUploader::instance().allocate(internalFormats[channelCount - 1], width, height, formats[channelCount - 1], GL_UNSIGNED_BYTE);
+	return formats[channelCount - 1];
+}
+
+// packs an image held whole down to the channels reducedChannels keeps, in
+// place, and uploads it; returns the number of channels kept
+static int uploadReduced(stbi_uc* data, int width, int height, int nrComponents, const stbi_channels& channels)
+{
+	int keep[4];
+	GLint swizzle[4];
+	int keepCount = reducedChannels(channels, nrComponents, keep, swizzle);
+
+	size_t pixels = (size_t)width * height;
+	const stbi_uc* in = data;
+	stbi_uc* out = data;
+	for (size_t i = 0; i < pixels; i++, in += nrComponents)
+	{
+		for (int k = 0; k < keepCount; k++)
+		{
+			*out++ = in[keep[k]];
+		}
+	}
+
+	GLenum format = allocateTexture(width, height, keepCount);
+	TextureUploader::instance().subImage(0, 0, width, height, format, GL_UNSIGNED_BYTE, keepCount, data);
+	glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+	return keepCount;
+}
+
+// stbi_load_rows hands the decoded image over in bands of rows; each band
+// goes straight into the texture, so the whole image never sits in memory.
+// the exception is an image that could be stored in fewer channels: the
+// format depends on every pixel, so bands are held back while all of them
+// so far could be, and the first band that can't sends the held ones on and
+// streams the rest at the file's channel count
+struct TextureUpload
+{
+	int width, height, nrComponents;
+	GLenum format;
+	bool reducing = false;
+	stbi_channels channels;
+	vector<stbi_uc> held;
+	// bytes per texel as stored
+	int texelBytes = 0;
+};
+
+static int uploadTextureRows(void* user, int y, int rowCount, const stbi_uc* rows)
+{
+	TextureUpload* upload = (TextureUpload*)user;
+	if (y == 0)
+	{
+		if (upload->nrComponents < 1 || upload->nrComponents > 4)
+		{
+			return 0;
+		}
+		upload->texelBytes = upload->nrComponents;
+		upload->reducing = upload->nrComponents > 1;
+		upload->channels.gray = 1;
+		upload->channels.alpha_min = 255;
+		upload->channels.alpha_max = 0;
+		if (!upload->reducing)
+		{
+			upload->format = allocateTexture(upload->width, upload->height, 1);
+		}
+	}
+
+	if (upload->reducing)
+	{
+		stbi_channels band;
+		stbi_analyze_channels(rows, upload->width, rowCount, upload->nrComponents, &band);
+		upload->channels.gray = upload->channels.gray && band.gray;
+		upload->channels.alpha_min = std::min(upload->channels.alpha_min, band.alpha_min);
+		upload->channels.alpha_max = std::max(upload->channels.alpha_max, band.alpha_max);
+
+		int keep[4];
+		GLint swizzle[4];
+		if (reducedChannels(upload->channels, upload->nrComponents, keep, swizzle) < upload->nrComponents)
+		{
+			upload->held.insert(upload->held.end(), rows, rows + (size_t)upload->width * rowCount * upload->nrComponents);
+			return 1;
+		}
+
+		// keeps every channel, so the swizzle only spreads gray and alpha out
+		upload->reducing = false;
+		upload->format = allocateTexture(upload->width, upload->height, upload->nrComponents);
+		glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+		if (y > 0)
+		{
+			TextureUploader::instance().subImage(0, 0, upload->width, y, upload->format, GL_UNSIGNED_BYTE, upload->nrComponents, upload->held.data());
+		}
+		vector<stbi_uc>().swap(upload->held);
+	}
+	// rows are tightly packed, whatever the width
+	TextureUploader::instance().subImage(0, y, upload->width, rowCount, upload->format, GL_UNSIGNED_BYTE, upload->nrComponents, rows);
+	return 1;
+}
+
+// bytes a texture takes with its full mip chain
+static size_t mipChainBytes(int width, int height, int texelBytes)
+{
+	size_t bytes = (size_t)width * height * texelBytes;
+	while (width > 1 || height > 1)
+	{
+		width = width > 1 ? width / 2 : 1;
+		height = height > 1 ? height / 2 : 1;
+		bytes += (size_t)width * height * texelBytes;
+	}
+	return bytes;
+}
+
+// texture, if given, gets how much VRAM the image took
+unsigned int TextureFromFile(const char* path, const string& directory, bool gamma, Texture* texture)
 {
 	string filename = string(path);
 	filename = directory + '/' + filename;
 
 	unsigned int textureID;
 	glGenTextures(1, &textureID);
+	GLState::current().bindTexture(GL_TEXTURE_2D, textureID);
 
-	int width, height, nrComponents;
-	unsigned char* data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-	if (data)
+	bool loaded;
+	int width, height;
+	// bytes per texel as stored, and at the file's channel count
+	int texelBytes = 0, fileTexelBytes = 0;
+	if (stbi_is_hdr(filename.c_str()))
 	{
-		GLenum format;
-		if (nrComponents == 1)
+		// Radiance maps keep their range, packed into 4 bytes a pixel
+		unsigned int* data = stbi_load_rgb9e5(filename.c_str(), &width, &height);
+		loaded = data != NULL;
+		if (loaded)
 		{
-			format = GL_RED;
+			TextureUploader& uploader = TextureUploader::instance();
+			uploader.allocate(GL_RGB9_E5, width, height, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV);
+			uploader.subImage(0, 0, width, height, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV, 4, data);
+			stbi_image_free(data);
+			texelBytes = fileTexelBytes = 4;
 		}
-		else if (nrComponents == 3)
+	}
+	else
+	{
+		TextureUpload upload;
+		loaded = stbi_load_rows(filename.c_str(), &upload.width, &upload.height, &upload.nrComponents, 0, uploadTextureRows, &upload) != 0;
+		if (loaded && upload.reducing)
 		{
-			format = GL_RGB;
+			// every band could be stored in fewer channels
+			upload.texelBytes = uploadReduced(upload.held.data(), upload.width, upload.height, upload.nrComponents, upload.channels);
 		}
-		else if (nrComponents == 4)
+		width = upload.width;
+		height = upload.height;
+		texelBytes = upload.texelBytes;
+		fileTexelBytes = upload.nrComponents;
+	}
+
+	if (loaded)
+	{
+		if (texture)
 		{
-			format = GL_RGBA;
+			texture->vramBytes = mipChainBytes(width, height, texelBytes);
+			texture->vramSaved = mipChainBytes(width, height, fileTexelBytes) - texture->vramBytes;
 		}
 
-		glBindTexture(GL_TEXTURE_2D, textureID);
-		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
 		glGenerateMipmap(GL_TEXTURE_2D);
 
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-		stbi_image_free(data);
 	}
 	else
 	{
 		std::cout << "Texture failed to load at path: " << path << std::endl;
-		stbi_image_free(data);
 	}
 
 	return textureID;
 }
 
+// one R8 texture per JPEG plane; the planes are tightly packed
+static unsigned int uploadPlane(int width, int height, const stbi_uc* data)
+{
+	unsigned int textureID;
+	glGenTextures(1, &textureID);
+	GLState::current().bindTexture(GL_TEXTURE_2D, textureID);
+
+	TextureUploader& uploader = TextureUploader::instance();
+	uploader.allocate(GL_R8, width, height, GL_RED, GL_UNSIGNED_BYTE);
+	uploader.subImage(0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, 1, data);
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	return textureID;
+}
+
+// uploads a JPEG as stored, Y at full size and Cb/Cr usually at half, and
+// leaves upsampling and color conversion to the shader (see sampleYCbCr).
+// returns false for anything that isn't a YCbCr or grayscale JPEG
+bool YCbCrTextureFromFile(const char* path, const string& directory, Texture& texture)
+{
+	string filename = string(path);
+	filename = directory + '/' + filename;
+
+	int width, height;
+	stbi_planes planes;
+	if (!stbi_load_planes(filename.c_str(), &width, &height, &planes))
+	{
+		return false;
+	}
+
+	// grayscale comes out as a single GL_RED texture, as TextureFromFile does
+	texture.id = uploadPlane(planes.w[0], planes.h[0], planes.data[0]);
+	if (planes.count == 3)
+	{
+		texture.cbId = uploadPlane(planes.w[1], planes.h[1], planes.data[1]);
+		texture.crId = uploadPlane(planes.w[2], planes.h[2], planes.data[2]);
+	}
+	stbi_image_free(planes.data[0]);
+
+	texture.vramBytes = 0;
+	for (int i = 0; i < planes.count; i++)
+	{
+		texture.vramBytes += mipChainBytes(planes.w[i], planes.h[i], 1);
+	}
+	texture.vramSaved = mipChainBytes(width, height, planes.count) - texture.vramBytes;
+	return true;
+}
+
+// stbi_load_gif_frames hands over one frame at a time as it is decoded; each
+// goes straight into its layer of the array, so the animation never sits in
+// memory whole
+struct GifUpload
+{
+	int width, height, frames;
+	vector<int> delays;
+};
+
+static int uploadGifFrame(void* user, int frame, int delay, const stbi_uc* pixels)
+{
+	GifUpload* upload = (GifUpload*)user;
+	if (frame == 0)
+	{
+		// a still GIF is an ordinary texture; stopping here leaves it to TextureFromFile
+		if (upload->frames < 2)
+		{
+			return 0;
+		}
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, upload->width, upload->height, upload->frames, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, frame, upload->width, upload->height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	// browsers show frames with next to no delay for 100 ms, and files count on it
+	upload->delays.push_back(delay < 20 ? 100 : delay);
+	return 1;
+}
+
+// uploads an animated GIF as a GL_TEXTURE_2D_ARRAY, one frame per layer, for
+// the shader to pick from by time (see Mesh::Draw). returns false for anything
+// that isn't a GIF with more than one frame
+bool GifTextureArrayFromFile(const char* path, const string& directory, Texture& texture)
+{
+	string filename = string(path);
+	filename = directory + '/' + filename;
+
+	unsigned int textureID;
+	glGenTextures(1, &textureID);
+	GLState::current().bindTexture(GL_TEXTURE_2D_ARRAY, textureID);
+
+	GifUpload upload;
+	if (!stbi_load_gif_frames(filename.c_str(), &upload.width, &upload.height, &upload.frames, uploadGifFrame, &upload))
+	{
+		GLState::current().deleteTexture(textureID);
+		return false;
+	}
+	// frames past a corrupt one never arrive; their layers just go unused
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	texture.id = 0;
+	texture.framesId = textureID;
+	texture.frameDelays = upload.delays;
+	texture.vramBytes = mipChainBytes(upload.width, upload.height, 4) * upload.frames;
+	texture.vramSaved = 0;
+	return true;
+}
+
 #endif
\ No newline at end of file
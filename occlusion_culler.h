@@ -0,0 +1,568 @@
+#ifndef OCCLUSION_CULLER_H
+#define OCCLUSION_CULLER_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frustum_culler.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_CULLER_SSE
+#endif
+
+using namespace std;
+
+// software occlusion culling: a few low-poly occluders (walls, floors, big
+// props) are rasterized on the CPU into a small depth buffer every frame, and
+// boxes are tested against it before anything is submitted, so hidden
+// objects cost the GPU nothing and no result has to be read back from it.
+//
+// the rasterizer only counts a pixel as covered when the whole pixel lies
+// inside the occluders, and writes the farthest depth they reach over it, so
+// the coarse buffer never claims more than the occluders hide at full
+// resolution. a pixel is covered when it is inside a triangle, or when it
+// straddles an edge two triangles share from either side and is inside the
+// pair, so the diagonal of a quad leaves no crack. pixels where three or
+// more triangles meet at a corner can still be left out, which only hides
+// less.
+//
+// coverage is kept as a 64-bit mask per 8x8 tile, next to the farthest depth
+// of the tile's covered pixels. a box is hidden when every pixel under its
+// screen rectangle is covered and nearer than it: a pixel missing from the
+// mask shows it at once, and the tile depth settles most of the rest without
+// touching pixels. rows of pixels are rasterized 4 at a time with SSE2
+// where it's there.
+//
+// the buffer is split into horizontal bands, one per thread: the calling one
+// and up to three workers of its own, which also split the box tests
+class OcclusionCuller
+{
+public:
+	// counts from the last render() and test()
+	struct Stats
+	{
+		unsigned int triangles = 0;
+		unsigned int tested = 0;
+		unsigned int occluded = 0;
+	};
+
+	// width and height are rounded up to whole tiles. threads 0 picks from
+	// the cores there are
+	OcclusionCuller(int width = 320, int height = 192, int threads = 0)
+	{
+		this->width = (width + tileSize - 1) / tileSize * tileSize;
+		this->height = (height + tileSize - 1) / tileSize * tileSize;
+		tilesX = this->width / tileSize;
+		tilesY = this->height / tileSize;
+		depth.assign(this->width * this->height, 1.0f);
+		coverage.assign(tilesX * tilesY, 0);
+		tileMax.assign(tilesX * tilesY, 0.0f);
+
+		if (threads <= 0)
+		{
+			unsigned int cores = thread::hardware_concurrency();
+			threads = cores > 4 ? 4 : cores > 0 ? (int)cores : 1;
+		}
+		bands = threads < tilesY ? threads : tilesY;
+		for (int i = 1; i < bands; i++)
+		{
+			workers.push_back(thread(&OcclusionCuller::work, this, i));
+		}
+	}
+
+	~OcclusionCuller()
+	{
+		{
+			lock_guard<mutex> lock(poolMutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (unsigned int i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+	}
+
+	// starts a frame seen through viewProjection, with no occluders
+	void begin(const glm::mat4& viewProjection)
+	{
+		this->viewProjection = viewProjection;
+		triangles.clear();
+	}
+
+	// adds the triangles of positions and indices, placed by model. ones
+	// reaching behind the near plane are left out, which only hides less
+	void addOccluder(const vector<glm::vec3>& positions, const vector<unsigned int>& indices, const glm::mat4& model)
+	{
+		addOccluder(positions.empty() ? NULL : &positions[0], sizeof(glm::vec3), positions.size(), indices, model);
+	}
+
+	// the same, with count positions stride bytes apart, so interleaved
+	// vertices can be read in place: &mesh.vertices[0].Position, sizeof(Vertex)
+	void addOccluder(const glm::vec3* positions, size_t stride, size_t count, const vector<unsigned int>& indices, const glm::mat4& model)
+	{
+		projected.resize(count);
+		glm::mat4 clipFromModel = viewProjection * model;
+		const unsigned char* position = (const unsigned char*)positions;
+		for (size_t i = 0; i < count; i++, position += stride)
+		{
+			projected[i] = clipFromModel * glm::vec4(*(const glm::vec3*)position, 1.0f);
+		}
+		for (unsigned int i = 0; i + 2 < indices.size(); i += 3)
+		{
+			addTriangle(projected[indices[i]], projected[indices[i + 1]], projected[indices[i + 2]]);
+		}
+	}
+
+	// rasterizes the frame's occluders
+	void render()
+	{
+		findNeighbors();
+		parallel([this](int band) { renderBand(band); });
+		lastStats.triangles = triangles.size();
+	}
+
+	// whether each box may be seen past the occluders; visible gets a 1 or 0
+	// per box
+	void test(const vector<WorldBounds>& bounds, vector<unsigned char>& visible)
+	{
+		visible.resize(bounds.size());
+		atomic<unsigned int> occluded(0);
+		parallel([&](int band)
+		{
+			size_t first = bounds.size() * band / bands;
+			size_t last = bounds.size() * (band + 1) / bands;
+			unsigned int hidden = 0;
+			for (size_t i = first; i < last; i++)
+			{
+				visible[i] = occludes(bounds[i]) ? 0 : 1;
+				hidden += 1 - visible[i];
+			}
+			occluded += hidden;
+		});
+		lastStats.tested = bounds.size();
+		lastStats.occluded = occluded;
+	}
+
+	const Stats& stats() const
+	{
+		return lastStats;
+	}
+
+	// threads render() and test() run on, the caller's included
+	int threads() const
+	{
+		return bands;
+	}
+
+private:
+	// a tile's coverage is a uint64_t, a bit per pixel, a byte per row
+	static const int tileSize = 8;
+
+	// a triangle in pixels, with window depth in [0, 1], counter-clockwise.
+	// edge e runs from corner e to the next, and its function a * x + b * y +
+	// c is positive inside; a pixel is wholly inside the edge when the value
+	// at its center is at least inner. depth is a plane over the screen,
+	// pushed to its farthest over a pixel, but no farther than zLimit
+	struct ScreenTriangle
+	{
+		float x[3], y[3], z[3];
+		float a[3], b[3], c[3], inner[3];
+		float dzdx, dzdy, z0, zLimit;
+		// across each edge, the triangle this one fills the straddling
+		// pixels with (see findNeighbors), or -1, and that triangle's edge
+		int neighbor[3];
+		int neighborEdge[3];
+	};
+
+	// an edge by its ends, for matching up triangles that share it
+	struct Edge
+	{
+		float x0, y0, x1, y1;
+		unsigned int triangle;
+		int edge;
+
+		bool operator<(const Edge& other) const
+		{
+			if (x0 != other.x0) return x0 < other.x0;
+			if (y0 != other.y0) return y0 < other.y0;
+			if (x1 != other.x1) return x1 < other.x1;
+			return y1 < other.y1;
+		}
+	};
+
+	int width, height, tilesX, tilesY, bands;
+	vector<float> depth;
+	// per tile: which pixels are covered (bit y * 8 + x), and the farthest of
+	// their depths
+	vector<uint64_t> coverage;
+	vector<float> tileMax;
+	glm::mat4 viewProjection = glm::mat4(1.0f);
+	vector<ScreenTriangle> triangles;
+	vector<Edge> edges;
+	vector<glm::vec4> projected;
+	Stats lastStats;
+
+	vector<thread> workers;
+	mutex poolMutex;
+	condition_variable wake, done;
+	function<void(int)> job;
+	unsigned int generation = 0;
+	int pending = 0;
+	bool stopping = false;
+
+	void addTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+	{
+		const float nearW = 1e-5f;
+		if (a.w <= nearW || b.w <= nearW || c.w <= nearW)
+		{
+			return;
+		}
+		ScreenTriangle triangle;
+		const glm::vec4* v[3] = { &a, &b, &c };
+		for (int i = 0; i < 3; i++)
+		{
+			triangle.x[i] = (v[i]->x / v[i]->w * 0.5f + 0.5f) * width;
+			triangle.y[i] = (v[i]->y / v[i]->w * 0.5f + 0.5f) * height;
+			triangle.z[i] = v[i]->z / v[i]->w * 0.5f + 0.5f;
+		}
+		// either winding occludes; make it counter-clockwise
+		float area = (triangle.x[1] - triangle.x[0]) * (triangle.y[2] - triangle.y[0]) - (triangle.x[2] - triangle.x[0]) * (triangle.y[1] - triangle.y[0]);
+		if (fabsf(area) < 1e-6f)
+		{
+			return;
+		}
+		if (area < 0.0f)
+		{
+			swap(triangle.x[1], triangle.x[2]);
+			swap(triangle.y[1], triangle.y[2]);
+			swap(triangle.z[1], triangle.z[2]);
+			area = -area;
+		}
+
+		const float* x = triangle.x;
+		const float* y = triangle.y;
+		const float* z = triangle.z;
+		for (int e = 0; e < 3; e++)
+		{
+			int n = (e + 1) % 3;
+			triangle.a[e] = y[e] - y[n];
+			triangle.b[e] = x[n] - x[e];
+			triangle.c[e] = x[e] * y[n] - x[n] * y[e];
+			triangle.inner[e] = 0.5f * (fabsf(triangle.a[e]) + fabsf(triangle.b[e]));
+			triangle.neighbor[e] = -1;
+			triangle.neighborEdge[e] = -1;
+		}
+		triangle.dzdx = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+		triangle.dzdy = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+		triangle.z0 = z[0] - triangle.dzdx * x[0] - triangle.dzdy * y[0] + 0.5f * (fabsf(triangle.dzdx) + fabsf(triangle.dzdy));
+		triangle.zLimit = max(z[0], max(z[1], z[2]));
+		triangles.push_back(triangle);
+	}
+
+	// pairs up triangles that share an edge from either side. corners match
+	// by exact screen position, so vertices split for their normals or
+	// texture coordinates still meet. the two are on opposite sides of the
+	// edge, so a pixel inside both triangles' other edges is inside one or the
+	// other all over; the first of the pair fills those pixels for both
+	void findNeighbors()
+	{
+		edges.clear();
+		for (unsigned int i = 0; i < triangles.size(); i++)
+		{
+			const ScreenTriangle& t = triangles[i];
+			for (int e = 0; e < 3; e++)
+			{
+				int n = (e + 1) % 3;
+				edges.push_back(Edge{ t.x[e], t.y[e], t.x[n], t.y[n], i, e });
+			}
+		}
+		sort(edges.begin(), edges.end());
+
+		for (unsigned int i = 0; i < edges.size(); i++)
+		{
+			const Edge& edge = edges[i];
+			Edge reverse = { edge.x1, edge.y1, edge.x0, edge.y0, 0, 0 };
+			vector<Edge>::const_iterator match = lower_bound(edges.begin(), edges.end(), reverse);
+			if (match != edges.end() && !(reverse < *match) && match->triangle > edge.triangle)
+			{
+				triangles[edge.triangle].neighbor[edge.edge] = match->triangle;
+				triangles[edge.triangle].neighborEdge[edge.edge] = match->edge;
+			}
+		}
+	}
+
+	// clears the band's rows, draws every triangle into them, then refreshes
+	// the band's tile maxima
+	void renderBand(int band)
+	{
+		int tileRowFirst = tilesY * band / bands;
+		int tileRowLast = tilesY * (band + 1) / bands;
+		int rowFirst = tileRowFirst * tileSize;
+		int rowLast = tileRowLast * tileSize;
+		fill(depth.begin() + rowFirst * width, depth.begin() + rowLast * width, 1.0f);
+		fill(coverage.begin() + tileRowFirst * tilesX, coverage.begin() + tileRowLast * tilesX, 0);
+
+		for (unsigned int i = 0; i < triangles.size(); i++)
+		{
+			rasterize(triangles[i], rowFirst, rowLast);
+		}
+
+		for (int ty = tileRowFirst; ty < tileRowLast; ty++)
+		{
+			for (int tx = 0; tx < tilesX; tx++)
+			{
+				uint64_t covered = coverage[ty * tilesX + tx];
+				float farthest = 0.0f;
+				for (int y = 0; y < tileSize && covered != 0; y++, covered >>= tileSize)
+				{
+					const float* row = &depth[(ty * tileSize + y) * width + tx * tileSize];
+					for (int x = 0; x < tileSize; x++)
+					{
+						if ((covered >> x) & 1)
+						{
+							farthest = row[x] > farthest ? row[x] : farthest;
+						}
+					}
+				}
+				tileMax[ty * tilesX + tx] = farthest;
+			}
+		}
+	}
+
+	// half-space rasterization over the triangle's bounds, clipped to rows
+	// [rowFirst, rowLast), taking edge functions at pixel centers. a pixel is
+	// covered when it is wholly inside the triangle, or wholly inside this
+	// triangle's and a neighbor's other edges, where it takes the farther of
+	// the two depths
+	void rasterize(const ScreenTriangle& t, int rowFirst, int rowLast)
+	{
+		float minX = min(t.x[0], min(t.x[1], t.x[2])), maxX = max(t.x[0], max(t.x[1], t.x[2]));
+		float minY = min(t.y[0], min(t.y[1], t.y[2])), maxY = max(t.y[0], max(t.y[1], t.y[2]));
+		int x0 = max((int)floorf(minX), 0) & ~3;
+		int x1 = min((int)ceilf(maxX), width);
+		int y0 = max((int)floorf(minY), rowFirst);
+		int y1 = min((int)ceilf(maxY), rowLast);
+		if (x0 >= x1 || y0 >= y1)
+		{
+			return;
+		}
+
+		// the edges shared with a neighbor this triangle fills for
+		int seamEdge[3];
+		int seamCount = 0;
+		for (int e = 0; e < 3; e++)
+		{
+			if (t.neighbor[e] >= 0)
+			{
+				seamEdge[seamCount++] = e;
+			}
+		}
+
+		for (int y = y0; y < y1; y++)
+		{
+			float py = y + 0.5f;
+			float* row = &depth[y * width];
+			uint64_t* tileRow = &coverage[(y / tileSize) * tilesX];
+			int bit = (y % tileSize) * tileSize;
+#ifdef OCCLUSION_CULLER_SSE
+			__m128 step = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+			for (int x = x0; x < x1; x += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)x), step);
+				__m128 inside[3];
+				for (int e = 0; e < 3; e++)
+				{
+					__m128 value = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(t.a[e])), _mm_set1_ps(t.b[e] * py + t.c[e]));
+					inside[e] = _mm_cmpge_ps(value, _mm_set1_ps(t.inner[e]));
+				}
+				__m128 covered = _mm_and_ps(inside[0], _mm_and_ps(inside[1], inside[2]));
+				__m128 z = _mm_min_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(t.dzdx)), _mm_set1_ps(t.dzdy * py + t.z0)), _mm_set1_ps(t.zLimit));
+				for (int s = 0; s < seamCount; s++)
+				{
+					int e = seamEdge[s];
+					const ScreenTriangle& n = triangles[t.neighbor[e]];
+					__m128 pair = _mm_andnot_ps(covered, _mm_and_ps(inside[(e + 1) % 3], inside[(e + 2) % 3]));
+					for (int k = 1; k < 3; k++)
+					{
+						int f = (t.neighborEdge[e] + k) % 3;
+						__m128 value = _mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(n.a[f])), _mm_set1_ps(n.b[f] * py + n.c[f]));
+						pair = _mm_and_ps(pair, _mm_cmpge_ps(value, _mm_set1_ps(n.inner[f])));
+					}
+					if (_mm_movemask_ps(pair) == 0)
+					{
+						continue;
+					}
+					__m128 nz = _mm_min_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(n.dzdx)), _mm_set1_ps(n.dzdy * py + n.z0)), _mm_set1_ps(n.zLimit));
+					z = _mm_or_ps(_mm_and_ps(pair, _mm_max_ps(z, nz)), _mm_andnot_ps(pair, z));
+					covered = _mm_or_ps(covered, pair);
+				}
+				int mask = _mm_movemask_ps(covered);
+				if (mask == 0)
+				{
+					continue;
+				}
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 nearer = _mm_min_ps(old, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(covered, nearer), _mm_andnot_ps(covered, old)));
+				tileRow[x / tileSize] |= (uint64_t)mask << (bit + x % tileSize);
+			}
+#else
+			for (int x = x0; x < x1; x++)
+			{
+				float px = x + 0.5f;
+				bool inside[3];
+				for (int e = 0; e < 3; e++)
+				{
+					inside[e] = t.a[e] * px + (t.b[e] * py + t.c[e]) >= t.inner[e];
+				}
+				bool covered = inside[0] && inside[1] && inside[2];
+				float z = min(t.dzdx * px + (t.dzdy * py + t.z0), t.zLimit);
+				for (int s = 0; s < seamCount && !covered; s++)
+				{
+					int e = seamEdge[s];
+					const ScreenTriangle& n = triangles[t.neighbor[e]];
+					bool pair = inside[(e + 1) % 3] && inside[(e + 2) % 3];
+					for (int k = 1; k < 3; k++)
+					{
+						int f = (t.neighborEdge[e] + k) % 3;
+						pair = pair && n.a[f] * px + (n.b[f] * py + n.c[f]) >= n.inner[f];
+					}
+					if (pair)
+					{
+						z = max(z, min(n.dzdx * px + (n.dzdy * py + n.z0), n.zLimit));
+						covered = true;
+					}
+				}
+				if (covered)
+				{
+					row[x] = min(row[x], z);
+					tileRow[x / tileSize] |= (uint64_t)1 << (bit + x % tileSize);
+				}
+			}
+#endif
+		}
+	}
+
+	// whether the box is certainly behind the occluders
+	bool occludes(const WorldBounds& bounds) const
+	{
+		float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearest = 1.0f;
+		for (int i = 0; i < 8; i++)
+		{
+			glm::vec3 offset((i & 1) ? bounds.extents.x : -bounds.extents.x, (i & 2) ? bounds.extents.y : -bounds.extents.y, (i & 4) ? bounds.extents.z : -bounds.extents.z);
+			glm::vec4 clip = viewProjection * glm::vec4(bounds.center + offset, 1.0f);
+			if (clip.w <= 1e-5f)
+			{
+				// reaches behind the camera
+				return false;
+			}
+			float x = (clip.x / clip.w * 0.5f + 0.5f) * width;
+			float y = (clip.y / clip.w * 0.5f + 0.5f) * height;
+			minX = min(minX, x);
+			maxX = max(maxX, x);
+			minY = min(minY, y);
+			maxY = max(maxY, y);
+			nearest = min(nearest, clip.z / clip.w * 0.5f + 0.5f);
+		}
+		int x0 = max((int)floorf(minX), 0), x1 = min((int)ceilf(maxX), width);
+		int y0 = max((int)floorf(minY), 0), y1 = min((int)ceilf(maxY), height);
+		if (x0 >= x1 || y0 >= y1)
+		{
+			// off screen: the frustum's call, not this
+			return false;
+		}
+
+		for (int ty = y0 / tileSize; ty <= (y1 - 1) / tileSize; ty++)
+		{
+			for (int tx = x0 / tileSize; tx <= (x1 - 1) / tileSize; tx++)
+			{
+				int rowFirst = max(y0, ty * tileSize), rowLast = min(y1, (ty + 1) * tileSize);
+				int columnFirst = max(x0, tx * tileSize), columnLast = min(x1, (tx + 1) * tileSize);
+				// the rectangle's pixels in the tile, as a mask: its columns
+				// repeated on every row, then cut to its rows
+				uint64_t columns = ((1ull << (columnLast - columnFirst)) - 1) << (columnFirst - tx * tileSize);
+				uint64_t rows = (~0ull >> (64 - tileSize * (rowLast - rowFirst))) << (tileSize * (rowFirst - ty * tileSize));
+				uint64_t under = columns * 0x0101010101010101ull & rows;
+				if (under & ~coverage[ty * tilesX + tx])
+				{
+					// nothing in front of part of the box
+					return false;
+				}
+				if (tileMax[ty * tilesX + tx] < nearest)
+				{
+					continue;
+				}
+				// the tile has something as far as the box; look closer
+				for (int y = rowFirst; y < rowLast; y++)
+				{
+					for (int x = columnFirst; x < columnLast; x++)
+					{
+						if (depth[y * width + x] >= nearest)
+						{
+							return false;
+						}
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	// runs work(band) for every band, the first on the calling thread
+	void parallel(function<void(int)> work)
+	{
+		if (workers.empty())
+		{
+			work(0);
+			return;
+		}
+		{
+			lock_guard<mutex> lock(poolMutex);
+			job = work;
+			pending = workers.size();
+			generation++;
+		}
+		wake.notify_all();
+		work(0);
+		unique_lock<mutex> lock(poolMutex);
+		done.wait(lock, [this] { return pending == 0; });
+	}
+
+	void work(int band)
+	{
+		unsigned int seen = 0;
+		for (;;)
+		{
+			function<void(int)> current;
+			{
+				unique_lock<mutex> lock(poolMutex);
+				wake.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping)
+				{
+					return;
+				}
+				seen = generation;
+				current = job;
+			}
+			current(band);
+			{
+				lock_guard<mutex> lock(poolMutex);
+				pending--;
+			}
+			done.notify_one();
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "frame_data.h"
+#include "frustum_culler.h"
+#include "mesh.h"
+#include "occlusion_culler.h"
+#include "shader.h"
+#include "uniform_ring.h"
+
+using namespace std;
+
+// draws collected over a frame, radix sorted on a 64-bit key and then run,
+// so that draws sharing a shader, material and VAO come back to back and
+// their state is set once per run. keys, from the top bit down:
+//
+//   opaque       pass:2 | shader:8 | material:16 | vao:14 | depth:24
+//   transparent  pass:2 | far-to-near depth:24 | shader:8 | material:16 | vao:14
+//
+// so opaque draws go front to back within a run, for early depth rejection,
+// and transparent ones strictly back to front, as blending needs. the
+// transparent ones are drawn alpha blended without writing depth; blending
+// and depth writes go back to off and on once they are done. shaders get
+// "view", "projection" and "model" mat4 uniforms from the queue, or, given a
+// UniformRing, a DrawData block per draw, all written with one copy ahead of
+// the draws (FrameData is the caller's). draws out of the view frustum are
+// dropped before sorting, in one batch (see FrustumCuller), and so are ones
+// hidden behind the occluders of an OcclusionCuller, if given one
+class RenderQueue
+{
+public:
+	explicit RenderQueue(UniformRing* ring = NULL) : ring(ring)
+	{
+	}
+
+	enum Pass
+	{
+		Opaque = 0,
+		Transparent = 1
+	};
+
+	// starts a frame seen through view and projection. depths are quantized
+	// over [0, farPlane]
+	void begin(const glm::mat4& view, const glm::mat4& projection, float farPlane)
+	{
+		this->view = view;
+		this->projection = projection;
+		this->farPlane = farPlane;
+		items.clear();
+		entries.clear();
+		culler.clear();
+	}
+
+	// culler has to have rendered the frame's occluders by execute(); NULL
+	// stops occlusion culling
+	void setOcclusionCuller(OcclusionCuller* occlusionCuller)
+	{
+		occlusion = occlusionCuller;
+	}
+
+	void submit(Mesh& mesh, Shader& shader, const glm::mat4& model, Pass pass = Opaque)
+	{
+		unsigned int shaderIndex = shaderSlot(shader);
+		uint64_t material = mesh.materialId() & 0xFFFF;
+		uint64_t vao = mesh.vertexArray() & 0x3FFF;
+
+		WorldBounds bounds(mesh.boundsMin, mesh.boundsMax, mesh.boundsRadius, model);
+		culler.add(bounds);
+
+		// view space distance of the mesh's center
+		glm::vec4 center = view * glm::vec4(bounds.center, 1.0f);
+		float distance = -center.z / farPlane;
+		uint64_t depth = distance <= 0.0f ? 0 : distance >= 1.0f ? 0xFFFFFF : (uint64_t)(distance * 0xFFFFFF);
+
+		uint64_t key = (uint64_t)pass << 62;
+		if (pass == Opaque)
+		{
+			key |= (uint64_t)(shaderIndex & 0xFF) << 54 | material << 38 | vao << 24 | depth;
+		}
+		else
+		{
+			key |= (0xFFFFFF - depth) << 38 | (uint64_t)(shaderIndex & 0xFF) << 30 | material << 14 | vao;
+		}
+
+		entries.push_back(SortEntry{ key, (uint32_t)items.size() });
+		items.push_back(Item{ &mesh, shaderIndex, model, bounds });
+	}
+
+	// sorts and draws everything submitted since begin
+	void execute()
+	{
+		culler.cull(projection * view);
+		unsigned int kept = 0;
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			if (culler.visible(entries[i].item))
+			{
+				entries[kept++] = entries[i];
+			}
+		}
+		entries.resize(kept);
+		if (occlusion && !entries.empty())
+		{
+			occlusionBounds.clear();
+			for (unsigned int i = 0; i < entries.size(); i++)
+			{
+				occlusionBounds.push_back(items[entries[i].item].bounds);
+			}
+			occlusion->test(occlusionBounds, occlusionVisible);
+			kept = 0;
+			for (unsigned int i = 0; i < entries.size(); i++)
+			{
+				if (occlusionVisible[i])
+				{
+					entries[kept++] = entries[i];
+				}
+			}
+			entries.resize(kept);
+		}
+		radixSort();
+
+		GLintptr drawData = -1;
+		size_t stride = 0;
+		if (ring && !entries.empty())
+		{
+			stride = ring->align(sizeof(DrawData));
+			staging.resize(stride * entries.size());
+			for (unsigned int i = 0; i < entries.size(); i++)
+			{
+				memcpy(&staging[i * stride], &items[entries[i].item].model, sizeof(glm::mat4));
+			}
+			drawData = ring->write(&staging[0], staging.size());
+		}
+
+		GLState& state = GLState::current();
+		unsigned int currentShader = ~0u;
+		unsigned int currentMaterial = 0;
+		bool blending = false;
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			// the pass is the key's top bits, so transparent draws come last
+			if (!blending && (entries[i].key >> 62) == Transparent)
+			{
+				state.enable(GL_BLEND);
+				state.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+				state.depthMask(false);
+				blending = true;
+			}
+			Item& item = items[entries[i].item];
+			ShaderSlot& slot = shaders[item.shader];
+			if (item.shader != currentShader)
+			{
+				slot.shader->use();
+				slot.view.set(view);
+				slot.projection.set(projection);
+				currentShader = item.shader;
+				currentMaterial = 0;
+			}
+			if (item.mesh->materialId() != currentMaterial)
+			{
+				item.mesh->bindMaterial(*slot.shader);
+				currentMaterial = item.mesh->materialId();
+			}
+			if (slot.drawBlock && drawData >= 0)
+			{
+				ring->bind(DrawData::binding, drawData + i * stride, sizeof(DrawData));
+			}
+			else if (slot.drawBlock && ring)
+			{
+				// the frame ran out of ring; this frame's draws go one by one
+				DrawData draw;
+				draw.model = item.model;
+				ring->push(DrawData::binding, &draw, sizeof(draw));
+			}
+			else
+			{
+				slot.model.set(item.model);
+			}
+			item.mesh->drawElements();
+		}
+		if (blending)
+		{
+			state.depthMask(true);
+			state.disable(GL_BLEND);
+		}
+	}
+
+	size_t size() const
+	{
+		return items.size();
+	}
+
+	// how many of the draws the last execute() found in view
+	const FrustumCuller::Stats& cullStats() const
+	{
+		return culler.stats();
+	}
+
+private:
+	struct Item
+	{
+		Mesh* mesh;
+		unsigned int shader;
+		glm::mat4 model;
+		WorldBounds bounds;
+	};
+	struct SortEntry
+	{
+		uint64_t key;
+		uint32_t item;
+	};
+	struct ShaderSlot
+	{
+		Shader* shader;
+		Uniform<glm::mat4> view, projection, model;
+		// takes "model" from a DrawData block
+		bool drawBlock;
+	};
+
+	glm::mat4 view, projection;
+	float farPlane = 100.0f;
+	vector<Item> items;
+	vector<SortEntry> entries, scratch;
+	FrustumCuller culler;
+	OcclusionCuller* occlusion = NULL;
+	vector<WorldBounds> occlusionBounds;
+	vector<unsigned char> occlusionVisible;
+	// kept across frames, so a shader's uniforms are resolved once
+	vector<ShaderSlot> shaders;
+	UniformRing* ring;
+	vector<unsigned char> staging;
+
+	unsigned int shaderSlot(Shader& shader)
+	{
+		for (unsigned int i = 0; i < shaders.size(); i++)
+		{
+			if (shaders[i].shader == &shader)
+			{
+				return i;
+			}
+		}
+		ShaderSlot slot;
+		slot.shader = &shader;
+		slot.view = shader.uniform<glm::mat4>("view");
+		slot.projection = shader.uniform<glm::mat4>("projection");
+		slot.model = shader.uniform<glm::mat4>("model");
+		slot.drawBlock = shader.findUniformBlock("DrawData") != NULL;
+		shaders.push_back(slot);
+		return shaders.size() - 1;
+	}
+
+	// LSD radix sort, a byte at a time. a byte every key shares (most of the
+	// high ones, in a typical frame) takes no pass
+	void radixSort()
+	{
+		scratch.resize(entries.size());
+		for (int shift = 0; shift < 64; shift += 8)
+		{
+			size_t counts[256] = { 0 };
+			for (size_t i = 0; i < entries.size(); i++)
+			{
+				counts[(entries[i].key >> shift) & 0xFF]++;
+			}
+			if (entries.empty() || counts[(entries[0].key >> shift) & 0xFF] == entries.size())
+			{
+				continue;
+			}
+
+			size_t offset = 0;
+			for (int b = 0; b < 256; b++)
+			{
+				size_t count = counts[b];
+				counts[b] = offset;
+				offset += count;
+			}
+			for (size_t i = 0; i < entries.size(); i++)
+			{
+				scratch[counts[(entries[i].key >> shift) & 0xFF]++] = entries[i];
+			}
+			entries.swap(scratch);
+		}
+	}
+};
+
+#endif
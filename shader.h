@@ -3,10 +3,62 @@
 
 #include <glad/glad.h>
 
+#include "gl_ext.h"
+#include "gl_state.h"
+
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+
+// a uniform's location, looked up once through Shader::uniform so that
+// setting it needs no name. like glUniform*, set() affects the program in use.
+// an inactive uniform, or one of another type, gets location -1, which GL
+// ignores
+template <typename T>
+struct Uniform
+{
+    GLint location = -1;
+
+    void set(const T& value) const;
+    // whether a uniform of GLSL type 'type' can be set from a T
+    static bool accepts(GLenum type);
+};
+
+template <> inline void Uniform<bool>::set(const bool& value) const { glUniform1i(location, (int)value); }
+template <> inline void Uniform<int>::set(const int& value) const { glUniform1i(location, value); }
+template <> inline void Uniform<float>::set(const float& value) const { glUniform1f(location, value); }
+template <> inline void Uniform<glm::vec2>::set(const glm::vec2& value) const { glUniform2fv(location, 1, &value[0]); }
+template <> inline void Uniform<glm::vec3>::set(const glm::vec3& value) const { glUniform3fv(location, 1, &value[0]); }
+template <> inline void Uniform<glm::vec4>::set(const glm::vec4& value) const { glUniform4fv(location, 1, &value[0]); }
+template <> inline void Uniform<glm::mat2>::set(const glm::mat2& value) const { glUniformMatrix2fv(location, 1, GL_FALSE, &value[0][0]); }
+template <> inline void Uniform<glm::mat3>::set(const glm::mat3& value) const { glUniformMatrix3fv(location, 1, GL_FALSE, &value[0][0]); }
+template <> inline void Uniform<glm::mat4>::set(const glm::mat4& value) const { glUniformMatrix4fv(location, 1, GL_FALSE, &value[0][0]); }
+
+template <> inline bool Uniform<bool>::accepts(GLenum type) { return type == GL_BOOL; }
+template <> inline bool Uniform<float>::accepts(GLenum type) { return type == GL_FLOAT; }
+template <> inline bool Uniform<glm::vec2>::accepts(GLenum type) { return type == GL_FLOAT_VEC2; }
+template <> inline bool Uniform<glm::vec3>::accepts(GLenum type) { return type == GL_FLOAT_VEC3; }
+template <> inline bool Uniform<glm::vec4>::accepts(GLenum type) { return type == GL_FLOAT_VEC4; }
+template <> inline bool Uniform<glm::mat2>::accepts(GLenum type) { return type == GL_FLOAT_MAT2; }
+template <> inline bool Uniform<glm::mat3>::accepts(GLenum type) { return type == GL_FLOAT_MAT3; }
+template <> inline bool Uniform<glm::mat4>::accepts(GLenum type) { return type == GL_FLOAT_MAT4; }
+// ints also set bools and samplers (the texture unit), which is everything
+// that isn't float based
+template <> inline bool Uniform<int>::accepts(GLenum type)
+{
+    switch (type)
+    {
+    case GL_FLOAT: case GL_FLOAT_VEC2: case GL_FLOAT_VEC3: case GL_FLOAT_VEC4:
+    case GL_FLOAT_MAT2: case GL_FLOAT_MAT3: case GL_FLOAT_MAT4:
+    case GL_FLOAT_MAT2x3: case GL_FLOAT_MAT2x4: case GL_FLOAT_MAT3x2:
+    case GL_FLOAT_MAT3x4: case GL_FLOAT_MAT4x2: case GL_FLOAT_MAT4x3:
+        return false;
+    default:
+        return true;
+    }
+}
 
 class Shader
 {
@@ -14,6 +66,24 @@ public:
     // program ID
     unsigned int ID;
 
+    // an active uniform of the default block, as reflected after linking
+    struct UniformInfo
+    {
+        std::string name;   // as GLSL spells it, e.g. "lights[2].color"
+        GLint location;
+        GLenum type;
+        GLint size;         // array length, 1 otherwise
+        GLint unit;         // texture unit, for samplers; -1 otherwise
+    };
+
+    // an active uniform block
+    struct UniformBlockInfo
+    {
+        std::string name;
+        GLuint index;
+        GLint dataSize;     // bytes a buffer bound to it needs
+    };
+
     // constructor reads and builds the shader
     Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr)
     {
@@ -104,65 +174,330 @@ public:
         glDeleteShader(vertex);
         glDeleteShader(fragment);
 
+        reflect();
+    }
+    // builds a compute program from one file; needs GL 4.3 (see GpuCuller
+    // for running it)
+    explicit Shader(const char* computePath)
+    {
+        std::string computeCode;
+        std::ifstream cShaderFile;
+        cShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        try
+        {
+            cShaderFile.open(computePath);
+            std::stringstream cShaderStream;
+            cShaderStream << cShaderFile.rdbuf();
+            cShaderFile.close();
+            computeCode = cShaderStream.str();
+        }
+        catch (std::ifstream::failure e)
+        {
+            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
+        }
+        const char* cShaderCode = computeCode.c_str();
+
+        int success;
+        char infoLog[512];
+        unsigned int compute = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(compute, 1, &cShaderCode, NULL);
+        glCompileShader(compute);
+        glGetShaderiv(compute, GL_COMPILE_STATUS, &success);
+        if (!success)
+        {
+            glGetShaderInfoLog(compute, 512, NULL, infoLog);
+            std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+        }
+
+        ID = glCreateProgram();
+        glAttachShader(ID, compute);
+        glLinkProgram(ID);
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            glGetProgramInfoLog(ID, 512, NULL, infoLog);
+            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        }
+        glDeleteShader(compute);
 
+        reflect();
+    }
+    // the active uniform called name, or NULL; no driver call
+    const UniformInfo* findUniform(const char* name) const
+    {
+        if (uniforms.empty())
+        {
+            return NULL;
+        }
+        size_t mask = uniforms.size() - 1;
+        for (size_t i = hashName(name) & mask;; i = (i + 1) & mask)
+        {
+            if (uniforms[i].name.empty())
+            {
+                return NULL;
+            }
+            if (uniforms[i].name == name)
+            {
+                return &uniforms[i];
+            }
+        }
+    }
+    // resolves a uniform once, for setting it without names from then on
+    template <typename T>
+    Uniform<T> uniform(const char* name) const
+    {
+        Uniform<T> handle;
+        const UniformInfo* info = findUniform(name);
+        if (info == NULL)
+        {
+            // inactive, or not declared: setting it does nothing, as before
+            return handle;
+        }
+        if (!Uniform<T>::accepts(info->type))
+        {
+            std::cout << "ERROR::SHADER::UNIFORM_TYPE_MISMATCH " << name << std::endl;
+            return handle;
+        }
+        handle.location = info->location;
+        return handle;
+    }
+    // the texture unit the sampler called name reads from, or -1. units are
+    // handed out once, at link time, so the sampler uniforms never need
+    // setting again: bind textures to these units instead
+    GLint samplerUnit(const char* name) const
+    {
+        const UniformInfo* info = findUniform(name);
+        return info ? info->unit : -1;
+    }
+    // the active uniform block called name, or NULL
+    const UniformBlockInfo* findUniformBlock(const char* name) const
+    {
+        for (unsigned int i = 0; i < uniformBlocks.size(); i++)
+        {
+            if (uniformBlocks[i].name == name)
+            {
+                return &uniformBlocks[i];
+            }
+        }
+        return NULL;
+    }
+    // binds the block called name to uniform buffer binding point 'binding'
+    void bindUniformBlock(const char* name, GLuint binding) const
+    {
+        const UniformBlockInfo* block = findUniformBlock(name);
+        if (block)
+        {
+            glUniformBlockBinding(ID, block->index, binding);
+        }
     }
     // use/activate shader
     void use()
     {
-        glUseProgram(ID);
+        GLState::current().useProgram(ID);
     }
     // utility uniform functions
     void setBool(const std::string& name, bool value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+        glUniform1i(location(name), (int)value);
     }
     void setInt(const std::string& name, int value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1i(location(name), value);
     }
     void setFloat(const std::string& name, float value) const
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1f(location(name), value);
     }
     void setVec2(const std::string& name, const glm::vec2& value) const
     {
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform2fv(location(name), 1, &value[0]);
     }
     void setVec2(const std::string& name, float x, float y) const
     {
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y);
+        glUniform2f(location(name), x, y);
     }
     // ------------------------------------------------------------------------
     void setVec3(const std::string& name, const glm::vec3& value) const
     {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform3fv(location(name), 1, &value[0]);
     }
     void setVec3(const std::string& name, float x, float y, float z) const
     {
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
+        glUniform3f(location(name), x, y, z);
     }
     // ------------------------------------------------------------------------
     void setVec4(const std::string& name, const glm::vec4& value) const
     {
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
+        glUniform4fv(location(name), 1, &value[0]);
     }
     void setVec4(const std::string& name, float x, float y, float z, float w)
     {
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w);
+        glUniform4f(location(name), x, y, z, w);
     }
     // ------------------------------------------------------------------------
     void setMat2(const std::string& name, const glm::mat2& mat) const
     {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        glUniformMatrix2fv(location(name), 1, GL_FALSE, &mat[0][0]);
     }
     // ------------------------------------------------------------------------
     void setMat3(const std::string& name, const glm::mat3& mat) const
     {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        glUniformMatrix3fv(location(name), 1, GL_FALSE, &mat[0][0]);
     }
     void setMat4(const std::string& name, const glm::mat4& mat) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
+    }
+
+private:
+    // open addressing with linear probing; the size is a power of two, at
+    // least twice the number of names, and an empty name marks a free slot
+    std::vector<UniformInfo> uniforms;
+    std::vector<UniformBlockInfo> uniformBlocks;
+
+    // the named setters above go through the table instead of the driver
+    GLint location(const std::string& name) const
+    {
+        const UniformInfo* info = findUniform(name.c_str());
+        return info ? info->location : -1;
+    }
+
+    // FNV-1a
+    static size_t hashName(const char* name)
+    {
+        size_t hash = 2166136261u;
+        for (; *name; name++)
+        {
+            hash = (hash ^ (unsigned char)*name) * 16777619u;
+        }
+        return hash;
+    }
+
+    // the sampler types, which take texture units; anything else, images
+    // included (their units come from their layout(binding)), doesn't
+    static bool isSampler(GLenum type)
+    {
+        switch (type)
+        {
+        case GL_SAMPLER_1D: case GL_SAMPLER_2D: case GL_SAMPLER_3D: case GL_SAMPLER_CUBE:
+        case GL_SAMPLER_1D_SHADOW: case GL_SAMPLER_2D_SHADOW: case GL_SAMPLER_CUBE_SHADOW:
+        case GL_SAMPLER_1D_ARRAY: case GL_SAMPLER_2D_ARRAY:
+        case GL_SAMPLER_1D_ARRAY_SHADOW: case GL_SAMPLER_2D_ARRAY_SHADOW:
+        case GL_SAMPLER_2D_MULTISAMPLE: case GL_SAMPLER_2D_MULTISAMPLE_ARRAY:
+        case GL_SAMPLER_BUFFER: case GL_SAMPLER_2D_RECT: case GL_SAMPLER_2D_RECT_SHADOW:
+        case GL_SAMPLER_CUBE_MAP_ARRAY: case GL_SAMPLER_CUBE_MAP_ARRAY_SHADOW:
+        case GL_INT_SAMPLER_1D: case GL_INT_SAMPLER_2D: case GL_INT_SAMPLER_3D: case GL_INT_SAMPLER_CUBE:
+        case GL_INT_SAMPLER_1D_ARRAY: case GL_INT_SAMPLER_2D_ARRAY:
+        case GL_INT_SAMPLER_2D_MULTISAMPLE: case GL_INT_SAMPLER_2D_MULTISAMPLE_ARRAY:
+        case GL_INT_SAMPLER_BUFFER: case GL_INT_SAMPLER_2D_RECT: case GL_INT_SAMPLER_CUBE_MAP_ARRAY:
+        case GL_UNSIGNED_INT_SAMPLER_1D: case GL_UNSIGNED_INT_SAMPLER_2D: case GL_UNSIGNED_INT_SAMPLER_3D: case GL_UNSIGNED_INT_SAMPLER_CUBE:
+        case GL_UNSIGNED_INT_SAMPLER_1D_ARRAY: case GL_UNSIGNED_INT_SAMPLER_2D_ARRAY:
+        case GL_UNSIGNED_INT_SAMPLER_2D_MULTISAMPLE: case GL_UNSIGNED_INT_SAMPLER_2D_MULTISAMPLE_ARRAY:
+        case GL_UNSIGNED_INT_SAMPLER_BUFFER: case GL_UNSIGNED_INT_SAMPLER_2D_RECT: case GL_UNSIGNED_INT_SAMPLER_CUBE_MAP_ARRAY:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void addUniform(const UniformInfo& info)
+    {
+        size_t mask = uniforms.size() - 1;
+        size_t i = hashName(info.name.c_str()) & mask;
+        while (!uniforms[i].name.empty())
+        {
+            i = (i + 1) & mask;
+        }
+        uniforms[i] = info;
+    }
+
+    // fills the tables with every active uniform and uniform block
+    void reflect()
+    {
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+        // arrays are listed once, as "name[0]"; each element gets an entry of
+        // its own, and the array one under its bare name too
+        std::vector<UniformInfo> found;
+        std::vector<char> name(maxLength + 1);
+        GLint nextUnit = 0;
+        for (GLint i = 0; i < count; i++)
+        {
+            UniformInfo info;
+            GLsizei length = 0;
+            glGetActiveUniform(ID, i, (GLsizei)name.size(), &length, &info.size, &info.type, &name[0]);
+            info.name.assign(&name[0], length);
+            info.location = glGetUniformLocation(ID, info.name.c_str());
+            if (info.location < 0)
+            {
+                // lives in a uniform block
+                continue;
+            }
+            info.unit = -1;
+            if (isSampler(info.type))
+            {
+                info.unit = nextUnit;
+                nextUnit += info.size;
+            }
+            found.push_back(info);
+
+            size_t bracket = info.name.rfind("[0]");
+            if (bracket != std::string::npos && bracket + 3 == info.name.size())
+            {
+                std::string base = info.name.substr(0, bracket);
+                UniformInfo element = info;
+                element.name = base;
+                found.push_back(element);
+                for (GLint e = 1; e < info.size; e++)
+                {
+                    element.name = base + "[" + std::to_string(e) + "]";
+                    element.location = glGetUniformLocation(ID, element.name.c_str());
+                    element.size = info.size - e;
+                    element.unit = info.unit < 0 ? -1 : info.unit + e;
+                    found.push_back(element);
+                }
+            }
+        }
+
+        size_t slots = 1;
+        while (slots < found.size() * 2)
+        {
+            slots *= 2;
+        }
+        uniforms.assign(found.empty() ? 0 : slots, UniformInfo());
+        for (unsigned int i = 0; i < found.size(); i++)
+        {
+            addUniform(found[i]);
+        }
+
+        GLState& state = GLState::current();
+        GLuint previous = state.program();
+        state.useProgram(ID);
+        for (unsigned int i = 0; i < found.size(); i++)
+        {
+            if (found[i].unit >= 0)
+            {
+                glUniform1i(found[i].location, found[i].unit);
+            }
+        }
+        state.useProgram(previous);
+
+        GLint blockCount = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxLength);
+        name.resize(maxLength + 1);
+        for (GLint i = 0; i < blockCount; i++)
+        {
+            UniformBlockInfo block;
+            GLsizei length = 0;
+            glGetActiveUniformBlockName(ID, i, (GLsizei)name.size(), &length, &name[0]);
+            block.name.assign(&name[0], length);
+            block.index = i;
+            glGetActiveUniformBlockiv(ID, i, GL_UNIFORM_BLOCK_DATA_SIZE, &block.dataSize);
+            uniformBlocks.push_back(block);
+        }
     }
 };
 
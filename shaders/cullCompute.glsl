@@ -0,0 +1,123 @@
+#version 430 core
+// one invocation per instance of an IndirectBatch (see GpuCuller)
+layout (local_size_x = 64) in;
+
+// as InstanceData and DrawElementsIndirectCommand lay them out
+struct InstanceData
+{
+	mat4 model;
+	vec4 tint;
+};
+struct Command
+{
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int baseVertex;
+	uint baseInstance;
+};
+
+layout (std430, binding = 0) readonly buffer Instances { InstanceData instances[]; };
+layout (std430, binding = 1) readonly buffer InstanceCommands { uint instanceCommand[]; };
+// the box of each command's mesh, min then max
+layout (std430, binding = 2) readonly buffer CommandBounds { vec4 bounds[]; };
+// instance counts start at 0 and are counted up here
+layout (std430, binding = 3) buffer Commands { Command commands[]; };
+layout (std430, binding = 4) writeonly buffer Visible { InstanceData visible[]; };
+
+uniform int instanceCount;
+uniform mat4 viewProjection;
+// the camera the pyramid was drawn from, the frame before
+uniform mat4 previousViewProjection;
+uniform bool occlusion;
+// farthest depth per texel, a level per halving
+uniform sampler2D hiZ;
+uniform int hiZLevels;
+
+vec3 corner(vec3 lo, vec3 hi, int i)
+{
+	return vec3((i & 1) != 0 ? hi.x : lo.x, (i & 2) != 0 ? hi.y : lo.y, (i & 4) != 0 ? hi.z : lo.z);
+}
+
+// outside when every corner is beyond the same clip plane
+bool outsideFrustum(mat4 clipFromModel, vec3 lo, vec3 hi)
+{
+	vec4 clip[8];
+	for (int i = 0; i < 8; i++)
+	{
+		clip[i] = clipFromModel * vec4(corner(lo, hi, i), 1.0);
+	}
+	for (int axis = 0; axis < 3; axis++)
+	{
+		bool below = true, above = true;
+		for (int i = 0; i < 8; i++)
+		{
+			below = below && clip[i][axis] < -clip[i].w;
+			above = above && clip[i][axis] > clip[i].w;
+		}
+		if (below || above)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// hidden when the box's nearest depth is behind the farthest depth of the
+// pyramid over the rectangle it covers, at the level where that rectangle
+// spans no more than 2x2 texels
+bool occluded(mat4 clipFromModel, vec3 lo, vec3 hi)
+{
+	vec2 minUV = vec2(1.0);
+	vec2 maxUV = vec2(0.0);
+	float nearest = 1.0;
+	for (int i = 0; i < 8; i++)
+	{
+		vec4 clip = clipFromModel * vec4(corner(lo, hi, i), 1.0);
+		if (clip.w <= 0.0)
+		{
+			// crosses the camera plane; no rectangle to test
+			return false;
+		}
+		vec3 ndc = clip.xyz / clip.w;
+		minUV = min(minUV, ndc.xy * 0.5 + 0.5);
+		maxUV = max(maxUV, ndc.xy * 0.5 + 0.5);
+		nearest = min(nearest, ndc.z * 0.5 + 0.5);
+	}
+	minUV = clamp(minUV, 0.0, 1.0);
+	maxUV = clamp(maxUV, 0.0, 1.0);
+
+	ivec2 size0 = textureSize(hiZ, 0);
+	vec2 extent = (maxUV - minUV) * vec2(size0);
+	int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), 0, hiZLevels - 1);
+	// a level-L texel covers level-0 texels p >> L, with the last one in a
+	// row or column also taking what an odd size leaves over (see
+	// hiZCompute.glsl); scaling UVs by an odd level's size instead would
+	// land on texels that miss part of the rectangle
+	ivec2 size = textureSize(hiZ, level);
+	ivec2 a = min(min(ivec2(minUV * vec2(size0)), size0 - 1) >> level, size - 1);
+	ivec2 b = min(min(ivec2(maxUV * vec2(size0)), size0 - 1) >> level, size - 1);
+	float farthest = max(max(texelFetch(hiZ, a, level).r, texelFetch(hiZ, ivec2(b.x, a.y), level).r),
+		max(texelFetch(hiZ, ivec2(a.x, b.y), level).r, texelFetch(hiZ, b, level).r));
+	return nearest > farthest;
+}
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= uint(instanceCount))
+	{
+		return;
+	}
+	uint c = instanceCommand[i];
+	mat4 model = instances[i].model;
+	vec3 lo = bounds[c * 2].xyz;
+	vec3 hi = bounds[c * 2 + 1].xyz;
+
+	if (outsideFrustum(viewProjection * model, lo, hi) || (occlusion && occluded(previousViewProjection * model, lo, hi)))
+	{
+		return;
+	}
+	uint slot = atomicAdd(commands[c].instanceCount, 1u);
+	visible[commands[c].baseInstance + slot] = instances[i];
+}
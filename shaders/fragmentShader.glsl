@@ -47,12 +47,18 @@ in vec2 TexCoords;
 in vec3 Normal;
 in vec3 FragPos;
 
-uniform vec3 viewPos;
 uniform sampler2D texture_diffuse1;
 uniform Material material;
-uniform SpotLight flashLight;
-uniform DirLight dirLight;
-uniform PointLight pointLight[NR_POINT_LIGHTS];
+// written through a UniformRing once a frame (see frame_data.h)
+layout (std140) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+    DirLight dirLight;
+    PointLight pointLight[NR_POINT_LIGHTS];
+    SpotLight flashLight;
+};
 
 // Function Prototypes
 //------------------------
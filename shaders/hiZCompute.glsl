@@ -0,0 +1,52 @@
+#version 430 core
+// one level of GpuCuller's depth pyramid per dispatch, a texel per invocation
+layout (local_size_x = 8, local_size_y = 8) in;
+
+layout (r32f, binding = 0) uniform writeonly image2D destination;
+// the depth buffer copy for level 0, the pyramid itself after that
+uniform sampler2D source;
+uniform int sourceLevel;
+// level 0 copies source as it is
+uniform bool copyDepth;
+
+float fetch(ivec2 texel, ivec2 size)
+{
+	return texelFetch(source, min(texel, size - 1), sourceLevel).r;
+}
+
+void main()
+{
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = imageSize(destination);
+	if (any(greaterThanEqual(texel, size)))
+	{
+		return;
+	}
+	ivec2 sourceSize = textureSize(source, sourceLevel);
+	if (copyDepth)
+	{
+		imageStore(destination, texel, vec4(fetch(texel, sourceSize)));
+		return;
+	}
+
+	// the farthest of the 2x2 texels below; for an odd source the last
+	// texel of a row or column also takes the one left over past it
+	ivec2 s = texel * 2;
+	float depth = max(max(fetch(s, sourceSize), fetch(s + ivec2(1, 0), sourceSize)),
+		max(fetch(s + ivec2(0, 1), sourceSize), fetch(s + ivec2(1, 1), sourceSize)));
+	bool extraColumn = (sourceSize.x & 1) != 0 && texel.x == size.x - 1;
+	bool extraRow = (sourceSize.y & 1) != 0 && texel.y == size.y - 1;
+	if (extraColumn)
+	{
+		depth = max(depth, max(fetch(s + ivec2(2, 0), sourceSize), fetch(s + ivec2(2, 1), sourceSize)));
+	}
+	if (extraRow)
+	{
+		depth = max(depth, max(fetch(s + ivec2(0, 2), sourceSize), fetch(s + ivec2(1, 2), sourceSize)));
+	}
+	if (extraColumn && extraRow)
+	{
+		depth = max(depth, fetch(s + ivec2(2, 2), sourceSize));
+	}
+	imageStore(destination, texel, vec4(depth));
+}
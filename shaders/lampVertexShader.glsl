@@ -1,9 +1,16 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// the leading members of FrameData, and DrawData (see frame_data.h)
+layout (std140) uniform FrameData
+{
+	mat4 view;
+	mat4 projection;
+};
+layout (std140) uniform DrawData
+{
+	mat4 model;
+};
 
 void main()
 {
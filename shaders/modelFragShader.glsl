@@ -3,11 +3,37 @@
 out vec4 FragColor;
 
 in vec2 TexCoords;
+in vec4 Tint;
 
 uniform sampler2D texture_diffuse1;
+// set for JPEGs uploaded as planes (see Mesh::Draw); texture_diffuse1 is Y then
+uniform bool texture_diffuse1_ycbcr;
+uniform sampler2D texture_diffuse1_cb;
+uniform sampler2D texture_diffuse1_cr;
+// set for animated GIFs (see Mesh::Draw); texture_diffuse1 is unused and
+// the frame showing is layer texture_diffuse1_layer of texture_diffuse1_frames
+uniform bool texture_diffuse1_animated;
+uniform sampler2DArray texture_diffuse1_frames;
+uniform int texture_diffuse1_layer;
+
+// JFIF YCbCr to RGB. the chroma planes are usually half size; sampling them
+// at the same normalized coordinates upsamples them
+vec4 sampleYCbCr(sampler2D y, sampler2D cb, sampler2D cr, vec2 uv)
+{
+	float Y = texture(y, uv).r;
+	float Cb = texture(cb, uv).r - 128.0 / 255.0;
+	float Cr = texture(cr, uv).r - 128.0 / 255.0;
+	return vec4(Y + 1.402 * Cr, Y - 0.344136 * Cb - 0.714136 * Cr, Y + 1.772 * Cb, 1.0);
+}
 
 void main()
 {
-	FragColor = texture(texture_diffuse1, TexCoords);
+	if (texture_diffuse1_animated)
+		FragColor = texture(texture_diffuse1_frames, vec3(TexCoords, texture_diffuse1_layer));
+	else if (texture_diffuse1_ycbcr)
+		FragColor = sampleYCbCr(texture_diffuse1, texture_diffuse1_cb, texture_diffuse1_cr, TexCoords);
+	else
+		FragColor = texture(texture_diffuse1, TexCoords);
+	FragColor *= Tint;
 }
 
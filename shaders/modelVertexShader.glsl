@@ -2,15 +2,31 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
+// per instance, for instanced draws (see InstanceData)
+layout (location = 5) in mat4 aInstanceModel;
+layout (location = 9) in vec4 aInstanceTint;
 
 out vec2 TexCoords;
+out vec4 Tint;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// written through a UniformRing (see frame_data.h). only the leading
+// members of FrameData are declared; the rest aren't read here
+layout (std140) uniform FrameData
+{
+	mat4 view;
+	mat4 projection;
+};
+layout (std140) uniform DrawData
+{
+	mat4 model;
+};
+// set by Model::DrawInstanced
+uniform bool instanced;
 
 void main()
 {
 	TexCoords = aTexCoords;
-	gl_Position = projection * view * model * vec4(aPos, 1.0);
+	Tint = instanced ? aInstanceTint : vec4(1.0);
+	mat4 world = instanced ? aInstanceModel : model;
+	gl_Position = projection * view * world * vec4(aPos, 1.0);
 }
\ No newline at end of file
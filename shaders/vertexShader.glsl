@@ -7,9 +7,55 @@ out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// FrameData has to be declared as the fragment shader does, lights and all
+struct DirLight {
+    vec3 direction;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+};
+
+struct PointLight {
+    vec3 position;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+
+    float Kc;   // constant variable
+    float Kl;   // linear variable
+    float Kq;   // quadratic variable
+};
+
+struct SpotLight {
+    vec3 position; // Not needed when using directional lighting
+    vec3 direction;
+    vec3 ambient;
+    vec3 diffuse;
+    vec3 specular;
+    
+    float cutOff;
+    float outerCutOff;
+    float Kc;
+    float Kl;
+    float Kq;
+};
+
+#define NR_POINT_LIGHTS 4
+
+// written through a UniformRing once a frame (see frame_data.h)
+layout (std140) uniform FrameData
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPos;
+    DirLight dirLight;
+    PointLight pointLight[NR_POINT_LIGHTS];
+    SpotLight flashLight;
+};
+layout (std140) uniform DrawData
+{
+    mat4 model;
+};
 
 void main()
 {
@@ -14,6 +14,9 @@
 
    You can #define STBI_ASSERT(x) before the #include to avoid using assert.h.
    And #define STBI_MALLOC, STBI_REALLOC, and STBI_FREE to avoid using malloc,realloc,free
+   #define STBI_PROFILE_BEGIN(phase) and STBI_PROFILE_END(phase) to time decode
+   phases: inflate and unfilter for PNG; entropy, idct and color for JPEG
+   (see tools/image_bench.cpp). An END is skipped if the decode fails.
 
 
    QUICK NOTES:
@@ -226,6 +229,10 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// Expanding to 4 channels (req_comp == 4) also uses SSSE3 shuffles when
+// VC++ finds them at run time, or when GCC/Clang are allowed them with
+// -mssse3; define STBI_NO_SSSE3 to keep to SSE2.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
@@ -315,6 +322,140 @@ RECENT REVISION HISTORY:
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
 //
+//   - The functions that take a filename (stbi_load, stbi_load_16,
+//     stbi_loadf, stbi_load_rows) map the file into memory (mmap, or a
+//     file mapping on Windows) and decode straight from the mapping, falling
+//     back to stdio if it can't be mapped. This avoids copying the file
+//     through the stdio buffer, and lets the multithreaded JPEG restart
+//     decoding apply to file loads. The file must not be truncated while
+//     it is being loaded. #define STBI_NO_MMAP to always use stdio.
+//
+// ===========================================================================
+//
+// Multithreaded decoding   (enable by defining STBI_THREADS)
+//
+// If you #define STBI_THREADS before creating the implementation, some
+// decode stages can be spread over worker threads (Win32 threads on Windows,
+// pthreads elsewhere, so link with -pthread). Nothing changes until you ask
+// for more than one thread:
+//
+//     stbi_set_thread_count(4);
+//
+// Currently this splits JPEG scans that have restart markers (DRI) into
+// their restart intervals and decodes those concurrently; this only happens
+// when the whole file is in memory. The JPEG finish stage is split too: the
+// dequantize+IDCT pass of progressive images runs per block row, and
+// upsampling plus color conversion runs in one band of rows per thread.
+// Output is identical to the serial decoder.
+// stbi_failure_reason() is kept per thread, so it reports the failures of
+// the thread asking.
+// Without STBI_THREADS, stbi_set_thread_count() is accepted and ignored.
+//
+// ===========================================================================
+//
+// Scaled JPEG decoding
+//
+// When only a smaller version of a JPEG is needed (low mip levels,
+// thumbnails), call
+//
+//     stbi_set_jpeg_scale(2);   // or 4 or 8; 1 restores full size
+//
+// and subsequent JPEG loads return an image of ceil(w/2) x ceil(h/2) (etc.)
+// pixels. Each 8x8 block goes through a 4x4, 2x2 or DC-only IDCT instead of
+// the full one, so the IDCT, upsampling and color conversion work and the
+// intermediate buffers all shrink with the square of the scale. Entropy
+// decoding still reads every coefficient, and progressive JPEGs still keep
+// their full coefficient buffers. The result is close to, but not identical
+// to, a box-filtered full-size decode. stbi_info() reports the full size;
+// other formats are unaffected.
+//
+// ===========================================================================
+//
+// Streaming decode
+//
+// stbi_load_rows() and friends decode like stbi_load() but, instead of
+// returning one buffer, pass the result to a callback in bands of rows, top
+// to bottom (after any vertical flip). *x, *y and *channels_in_file are
+// filled in before the first call, so the callback can size a texture or
+// destination up front:
+//
+//     int upload(void* user, int y, int rows, const stbi_uc* pixels)
+//     {
+//        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, width, rows, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+//        return 1;
+//     }
+//
+// JPEGs are color-converted band by band, so the full output image is never
+// held and peak memory is the component planes plus a 64-row band (per
+// thread). Other formats are still decoded whole and then handed over in
+// bands, which saves nothing but lets callers use one code path.
+//
+// ===========================================================================
+//
+// Animated GIF
+//
+// stbi_load_gif_from_memory() returns every frame of an animation in one
+// buffer. stbi_load_gif_frames() and stbi_load_gif_frames_from_memory()
+// instead pass each frame to a callback as soon as it is decoded, as *x by *y
+// RGBA pixels (flipped if stbi_set_flip_vertically_on_load is set), with its
+// delay in milliseconds. *x, *y and *frames are filled in before the first
+// call; the frame count comes from a quick scan of the file that skips the
+// compressed data, so the callback can allocate one layer per frame up front.
+//
+// Only the frame being built and the canvas it is drawn over are kept, plus
+// a copy of an earlier frame when the file's disposal modes need one to
+// restore from. Like stbi_load_gif_from_memory(), a corrupt or truncated
+// frame ends the animation early; *frames is then lowered to the number of
+// frames delivered.
+//
+// ===========================================================================
+//
+// Packed HDR
+//
+// stbi_loadf() on a Radiance .hdr file spends 12-16 bytes per pixel on
+// floats. stbi_load_rgb9e5() packs each RGBE pixel into the 4-byte shared
+// exponent format GL_RGB9_E5 uses instead, which holds every RGBE value
+// from 2^-24 to 65408 exactly (smaller ones lose low bits, larger ones
+// clamp). stbi_load_half() returns half floats, 6 or 8 bytes per pixel,
+// rounded to nearest and clamped to 65504. Neither goes through float
+// images, and both honor vertical flip. Other formats are rejected.
+//
+// ===========================================================================
+//
+// Planar decode
+//
+// stbi_load_planes() returns a JPEG as it is stored: a Y plane at full size
+// and, for color images, Cb and Cr planes at their own (usually half) size,
+// without upsampling or color conversion. Renderers that convert in a shader
+// upload half as much data for 4:2:0 images and skip that CPU pass. Only
+// YCbCr and grayscale JPEGs qualify; for anything else it fails, so callers
+// fall back to stbi_load(). Vertical flip and stbi_set_jpeg_scale() apply
+// to each plane.
+//
+// ===========================================================================
+//
+// Region decode
+//
+// stbi_load_region() returns just the region_w x region_h rectangle at
+// (region_x, region_y) of the image, clipped to the image, in the same
+// orientation stbi_load() would return (so with vertical flip on, region_y
+// counts from the bottom of the file). JPEGs still entropy-decode the whole
+// scan but only run the IDCT for blocks under the region, and only upsample
+// and color-convert the region itself. Non-interlaced PNGs stop inflating
+// after the last row the region needs and only expand the region. Other
+// formats (and interlaced PNGs) decode the whole image and crop it.
+//
+// ===========================================================================
+//
+// Channel analysis
+//
+// stbi_analyze_channels() scans a decoded 8-bit image for channels that
+// carry less than their count suggests: RGB(A) images whose pixels are all
+// gray, and the range of the alpha channel (so opaque or constant alpha).
+// It only reads the image, so it can run on each band stbi_load_rows()
+// hands over and the results be combined; a texture loader can use it to
+// pick a smaller format.
+//
 
 
 #ifndef STBI_NO_STDIO
@@ -387,6 +528,84 @@ extern "C" {
     STBIDEF int stbi_convert_wchar_to_utf8(char* buffer, size_t bufferlen, const wchar_t* input);
 #endif
 
+    ////////////////////////////////////
+    //
+    // row-band interface, 8 bits per channel (see "Streaming decode" above)
+    //
+
+    // receives 'row_count' consecutive output rows starting at row 'y', tightly
+    // packed; 'rows' is only valid during the call. return 0 to stop the load
+    typedef int (*stbi_rows_callback)(void* user, int y, int row_count, const stbi_uc* rows);
+
+    // these return 1 once every row has been delivered, 0 on failure
+    STBIDEF int stbi_load_rows_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* channels_in_file, int desired_channels, stbi_rows_callback callback, void* user);
+
+#ifndef STBI_NO_STDIO
+    STBIDEF int stbi_load_rows(char const* filename, int* x, int* y, int* channels_in_file, int desired_channels, stbi_rows_callback callback, void* user);
+    STBIDEF int stbi_load_rows_from_file(FILE* f, int* x, int* y, int* channels_in_file, int desired_channels, stbi_rows_callback callback, void* user);
+#endif
+
+    ////////////////////////////////////
+    //
+    // frame-by-frame GIF interface (see "Animated GIF" above)
+    //
+
+    // receives frame 'frame' (counting from 0) as RGBA pixels, shown for 'delay'
+    // milliseconds; 'pixels' is only valid during the call. return 0 to stop
+    typedef int (*stbi_gif_frame_callback)(void* user, int frame, int delay, const stbi_uc* pixels);
+
+    // these return 1 once every frame has been delivered, 0 on failure
+    STBIDEF int stbi_load_gif_frames_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* frames, stbi_gif_frame_callback callback, void* user);
+
+#ifndef STBI_NO_STDIO
+    STBIDEF int stbi_load_gif_frames(char const* filename, int* x, int* y, int* frames, stbi_gif_frame_callback callback, void* user);
+#endif
+
+    ////////////////////////////////////
+    //
+    // planar JPEG interface (see "Planar decode" above)
+    //
+
+    typedef struct
+    {
+        int count;           // 1 for grayscale, 3 for Y, Cb, Cr
+        int w[3], h[3];      // size of each plane, in samples
+        stbi_uc* data[3];    // w*h bytes each, all in one allocation: free data[0]
+    } stbi_planes;
+
+    // returns 1 on success; *x and *y receive the size of the image
+    STBIDEF int stbi_load_planes_from_memory(stbi_uc const* buffer, int len, int* x, int* y, stbi_planes* planes);
+
+#ifndef STBI_NO_STDIO
+    STBIDEF int stbi_load_planes(char const* filename, int* x, int* y, stbi_planes* planes);
+#endif
+
+    ////////////////////////////////////
+    //
+    // region interface, 8 bits per channel (see "Region decode" above)
+    //
+
+    // *x and *y receive the size of the region after clipping it to the image
+    STBIDEF stbi_uc* stbi_load_region_from_memory(stbi_uc const* buffer, int len, int region_x, int region_y, int region_w, int region_h, int* x, int* y, int* channels_in_file, int desired_channels);
+
+#ifndef STBI_NO_STDIO
+    STBIDEF stbi_uc* stbi_load_region(char const* filename, int region_x, int region_y, int region_w, int region_h, int* x, int* y, int* channels_in_file, int desired_channels);
+#endif
+
+    ////////////////////////////////////
+    //
+    // channel analysis of decoded 8-bit images (see "Channel analysis" above)
+    //
+
+    typedef struct
+    {
+        int gray;            // 3 or 4 channels with r == g == b everywhere; 1 for 1 or 2 channels
+        int alpha_min;       // range of the alpha channel; 255 for images without one
+        int alpha_max;
+    } stbi_channels;
+
+    STBIDEF void stbi_analyze_channels(stbi_uc const* data, int x, int y, int comp, stbi_channels* channels);
+
     ////////////////////////////////////
     //
     // 16-bits-per-channel interface
@@ -417,6 +636,21 @@ extern "C" {
 #ifndef STBI_NO_HDR
     STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma);
     STBIDEF void   stbi_hdr_to_ldr_scale(float scale);
+
+    ////////////////////////////////////
+    //
+    // packed HDR interface, Radiance .hdr only (see "Packed HDR" above)
+    //
+
+    // one GL_RGB9_E5 (GL_UNSIGNED_INT_5_9_9_9_REV) word per pixel
+    STBIDEF unsigned int* stbi_load_rgb9e5_from_memory(stbi_uc const* buffer, int len, int* x, int* y);
+    // desired_channels half floats per pixel (GL_HALF_FLOAT)
+    STBIDEF stbi_us* stbi_load_half_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* channels_in_file, int desired_channels);
+
+#ifndef STBI_NO_STDIO
+    STBIDEF unsigned int* stbi_load_rgb9e5(char const* filename, int* x, int* y);
+    STBIDEF stbi_us* stbi_load_half(char const* filename, int* x, int* y, int* channels_in_file, int desired_channels);
+#endif
 #endif // STBI_NO_HDR
 
 #ifndef STBI_NO_LINEAR
@@ -467,6 +701,14 @@ extern "C" {
     // flip the image vertically, so the first pixel in the output array is the bottom left
     STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+    // decode JPEGs at 1/denominator of their size (2, 4 or 8; 1 turns it off)
+    // using reduced IDCTs; see "Scaled JPEG decoding" above
+    STBIDEF void stbi_set_jpeg_scale(int denominator);
+
+    // maximum number of threads a single decode may use (see "Multithreaded
+    // decoding" above); 1, the default, decodes everything on the calling thread
+    STBIDEF void stbi_set_thread_count(int thread_count);
+
     // ZLIB client - used by PNG, available for other purposes
 
     STBIDEF char* stbi_zlib_decode_malloc_guesssize(const char* buffer, int len, int initial_size, int* outlen);
@@ -569,12 +811,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -614,6 +858,11 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32) == 4 ? 1 : -1];
 #define STBI_REALLOC_SIZED(p,oldsz,newsz) STBI_REALLOC(p,newsz)
 #endif
 
+#ifndef STBI_PROFILE_BEGIN
+#define STBI_PROFILE_BEGIN(phase)
+#define STBI_PROFILE_END(phase)
+#endif
+
 // x86/x64 detection
 #if defined(__x86_64__) || defined(_M_X64)
 #define STBI__X64_TARGET
@@ -700,6 +949,25 @@ static int stbi__sse2_available(void)
 #endif
 #endif
 
+// SSSE3 byte shuffles, for the channel conversions. Same deal as SSE2 with
+// GCC/Clang: only used if compiled with -mssse3 (or an -march implying it).
+// VC++ can always compile them, so it checks for them at runtime.
+#if defined(STBI_SSE2) && !defined(STBI_NO_SSSE3) && (defined(__SSSE3__) || (defined(_MSC_VER) && _MSC_VER >= 1500 && !defined(__clang__)))
+#define STBI_SSSE3
+#include <tmmintrin.h>
+
+static int stbi__ssse3_available(void)
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return ((info[2] >> 9) & 1) != 0;
+#else
+    return 1;
+#endif
+}
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -715,6 +983,36 @@ static int stbi__sse2_available(void)
 #define STBI_SIMD_ALIGN(type, name) type name
 #endif
 
+// worker threads
+#ifdef STBI_THREADS
+#ifdef _WIN32
+STBI_EXTERN __declspec(dllimport) void* __stdcall CreateThread(void* attributes, size_t stack_size, unsigned long(__stdcall* start)(void*), void* param, unsigned long flags, unsigned long* thread_id);
+STBI_EXTERN __declspec(dllimport) unsigned long __stdcall WaitForSingleObject(void* handle, unsigned long milliseconds);
+STBI_EXTERN __declspec(dllimport) int __stdcall CloseHandle(void* handle);
+#else
+#include <pthread.h>
+#endif
+#endif
+
+// memory-mapped file input
+#if defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP)
+#define STBI_NO_MMAP
+#endif
+
+#ifndef STBI_NO_MMAP
+#ifdef _WIN32
+#include <io.h> // _get_osfhandle, _filelengthi64
+struct _SECURITY_ATTRIBUTES;
+STBI_EXTERN __declspec(dllimport) void* __stdcall CreateFileMappingA(void* file, struct _SECURITY_ATTRIBUTES* attributes, unsigned long protect, unsigned long size_high, unsigned long size_low, const char* name);
+STBI_EXTERN __declspec(dllimport) void* __stdcall MapViewOfFile(void* mapping, unsigned long access, unsigned long offset_high, unsigned long offset_low, size_t bytes);
+STBI_EXTERN __declspec(dllimport) int __stdcall UnmapViewOfFile(const void* base);
+STBI_EXTERN __declspec(dllimport) int __stdcall CloseHandle(void* handle);
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
+
 ///////////////////////////////////////////////
 //
 //  stbi__context struct and start_xxx functions
@@ -735,8 +1033,16 @@ typedef struct
 
     stbi_uc* img_buffer, * img_buffer_end;
     stbi_uc* img_buffer_original, * img_buffer_original_end;
+
+    // stbi_load_region: the wanted rectangle. loaders that can decode just
+    // that part clip it with stbi__clip_region; anything else gets cropped
+    int region; // 0, or STBI__REGION_requested/_clipped
+    int region_x, region_y, region_w, region_h;
 } stbi__context;
 
+#define STBI__REGION_requested  1
+#define STBI__REGION_clipped    2
+
 
 static void stbi__refill_buffer(stbi__context* s);
 
@@ -745,6 +1051,7 @@ static void stbi__start_mem(stbi__context* s, stbi_uc const* buffer, int len)
 {
     s->io.read = NULL;
     s->read_from_callbacks = 0;
+    s->region = 0;
     s->img_buffer = s->img_buffer_original = (stbi_uc*)buffer;
     s->img_buffer_end = s->img_buffer_original_end = (stbi_uc*)buffer + len;
 }
@@ -756,6 +1063,7 @@ static void stbi__start_callbacks(stbi__context* s, stbi_io_callbacks* c, void*
     s->io_user_data = user;
     s->buflen = sizeof(s->buffer_start);
     s->read_from_callbacks = 1;
+    s->region = 0;
     s->img_buffer_original = s->buffer_start;
     stbi__refill_buffer(s);
     s->img_buffer_original_end = s->img_buffer_end;
@@ -814,14 +1122,20 @@ typedef struct
     int bits_per_channel;
     int num_channels;
     int channel_order;
+    int flipped; // rows were already stored bottom-up, for stbi__vertically_flip_on_load
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
 static int      stbi__jpeg_test(stbi__context* s);
 static void* stbi__jpeg_load(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi__result_info* ri);
 static int      stbi__jpeg_info(stbi__context* s, int* x, int* y, int* comp);
+static int      stbi__jpeg_load_rows(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi_rows_callback callback, void* user);
+static int      stbi__jpeg_load_planes(stbi__context* s, int* x, int* y, stbi_planes* planes);
 #endif
 
+// rows handed to a stbi_rows_callback at a time (per thread, for JPEG)
+#define STBI__ROWS_PER_BAND  64
+
 #ifndef STBI_NO_PNG
 static int      stbi__png_test(stbi__context* s);
 static void* stbi__png_load(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi__result_info* ri);
@@ -851,7 +1165,13 @@ static int      stbi__psd_is16(stbi__context* s);
 #ifndef STBI_NO_HDR
 static int      stbi__hdr_test(stbi__context* s);
 static float* stbi__hdr_load(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi__result_info* ri);
+static void* stbi__hdr_load_as(stbi__context* s, int* x, int* y, int* comp, int req_comp, int format);
 static int      stbi__hdr_info(stbi__context* s, int* x, int* y, int* comp);
+
+// output formats for stbi__hdr_load_as
+#define STBI__HDR_float    0 // req_comp floats per pixel
+#define STBI__HDR_half     1 // req_comp half floats per pixel
+#define STBI__HDR_rgb9e5   2 // one shared-exponent word per pixel
 #endif
 
 #ifndef STBI_NO_PIC
@@ -865,6 +1185,8 @@ static int      stbi__gif_test(stbi__context* s);
 static void* stbi__gif_load(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi__result_info* ri);
 static void* stbi__load_gif_main(stbi__context* s, int** delays, int* x, int* y, int* z, int* comp, int req_comp);
 static int      stbi__gif_info(stbi__context* s, int* x, int* y, int* comp);
+static int      stbi__gif_count_frames(stbi__context* s);
+static int      stbi__gif_load_frames(stbi__context* s, int frames, int* x, int* y, int* out_frames, stbi_gif_frame_callback callback, void* user);
 #endif
 
 #ifndef STBI_NO_PNM
@@ -873,8 +1195,23 @@ static void* stbi__pnm_load(stbi__context* s, int* x, int* y, int* comp, int req
 static int      stbi__pnm_info(stbi__context* s, int* x, int* y, int* comp);
 #endif
 
-// this is not threadsafe
-static const char* stbi__g_failure_reason;
+// with STBI_THREADS each thread has its own, so decode workers can fail
+// without racing each other or the caller; otherwise this is not threadsafe
+#ifdef STBI_THREADS
+#if defined(_MSC_VER)
+#define STBI__THREAD_LOCAL __declspec(thread)
+#elif defined(__cplusplus) && __cplusplus >= 201103L
+#define STBI__THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define STBI__THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define STBI__THREAD_LOCAL __thread
+#endif
+#endif
+#ifndef STBI__THREAD_LOCAL
+#define STBI__THREAD_LOCAL
+#endif
+static STBI__THREAD_LOCAL const char* stbi__g_failure_reason;
 
 STBIDEF const char* stbi_failure_reason(void)
 {
@@ -1002,6 +1339,138 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
     stbi__vertically_flip_on_load = flag_true_if_should_flip;
 }
 
+static int stbi__jpeg_scale = 1;
+
+STBIDEF void stbi_set_jpeg_scale(int denominator)
+{
+    stbi__jpeg_scale = denominator == 2 || denominator == 4 || denominator == 8 ? denominator : 1;
+}
+
+#define STBI__MAX_THREADS  64
+
+static int stbi__thread_count = 1;
+
+STBIDEF void stbi_set_thread_count(int thread_count)
+{
+    if (thread_count < 1) thread_count = 1;
+    if (thread_count > STBI__MAX_THREADS) thread_count = STBI__MAX_THREADS;
+    stbi__thread_count = thread_count;
+}
+
+#ifdef STBI_THREADS
+// minimal fork/join: stbi__parallel_for() calls job(ctx, i) for every i in
+// [0,count), spread over at most stbi__thread_count threads, the calling
+// thread being one of them. threads are created per call; the stages that use
+// this are long enough that a persistent pool wouldn't buy anything.
+typedef void (*stbi__job_func)(void* ctx, int index);
+
+typedef struct
+{
+    stbi__job_func job;
+    void* ctx;
+    int first, count, stride;
+} stbi__job_slice;
+
+static void stbi__run_slice(stbi__job_slice* slice)
+{
+    int i;
+    for (i = slice->first; i < slice->count; i += slice->stride)
+        slice->job(slice->ctx, i);
+}
+
+#ifdef _WIN32
+static unsigned long __stdcall stbi__thread_main(void* param)
+{
+    stbi__run_slice((stbi__job_slice*)param);
+    return 0;
+}
+#else
+static void* stbi__thread_main(void* param)
+{
+    stbi__run_slice((stbi__job_slice*)param);
+    return NULL;
+}
+#endif
+
+// number of threads stbi__parallel_for() will use for 'count' jobs
+static int stbi__worker_count(int count)
+{
+    return count < stbi__thread_count ? (count < 1 ? 1 : count) : stbi__thread_count;
+}
+
+static void stbi__parallel_for(stbi__job_func job, void* ctx, int count)
+{
+    stbi__job_slice slice[STBI__MAX_THREADS];
+#ifdef _WIN32
+    void* thread[STBI__MAX_THREADS];
+#else
+    pthread_t thread[STBI__MAX_THREADS];
+#endif
+    int started[STBI__MAX_THREADS];
+    int i, n = stbi__worker_count(count);
+
+    for (i = 0; i < n; ++i) {
+        slice[i].job = job;
+        slice[i].ctx = ctx;
+        slice[i].first = i;
+        slice[i].count = count;
+        slice[i].stride = n;
+    }
+    // if a thread can't be created, its share just runs on this thread
+    for (i = 1; i < n; ++i) {
+#ifdef _WIN32
+        thread[i] = CreateThread(NULL, 0, stbi__thread_main, &slice[i], 0, NULL);
+        started[i] = thread[i] != NULL;
+#else
+        started[i] = pthread_create(&thread[i], NULL, stbi__thread_main, &slice[i]) == 0;
+#endif
+        if (!started[i])
+            stbi__run_slice(&slice[i]);
+    }
+    stbi__run_slice(&slice[0]);
+    for (i = 1; i < n; ++i) {
+        if (!started[i]) continue;
+#ifdef _WIN32
+        WaitForSingleObject(thread[i], 0xffffffff); // INFINITE
+        CloseHandle(thread[i]);
+#else
+        pthread_join(thread[i], NULL);
+#endif
+    }
+}
+#endif // STBI_THREADS
+
+// clip the requested region to a w*h image; with flip_rows, also turn it
+// into top-down rows of the file, for loaders that flip their output later.
+// a loader that calls this returns just the region
+static int stbi__clip_region(stbi__context* s, int w, int h, int flip_rows)
+{
+    int x0 = s->region_x, y0 = s->region_y;
+    int x1 = w - x0 < s->region_w ? w : x0 + s->region_w;
+    int y1 = h - y0 < s->region_h ? h : y0 + s->region_h;
+    if (x0 >= x1 || y0 >= y1) return stbi__err("bad region", "Region is outside the image");
+    if (flip_rows) {
+        int t = h - y1;
+        y1 = h - y0;
+        y0 = t;
+    }
+    s->region_x = x0;
+    s->region_y = y0;
+    s->region_w = x1 - x0;
+    s->region_h = y1 - y0;
+    s->region = STBI__REGION_clipped;
+    return 1;
+}
+
+// move the region (as clipped above) of a w-pixel-wide image to its start
+static void stbi__crop_to_region(stbi__context* s, stbi_uc* data, int w, int bytes_per_pixel)
+{
+    int row;
+    size_t row_bytes = (size_t)s->region_w * bytes_per_pixel;
+    for (row = 0; row < s->region_h; ++row)
+        memmove(data + row * row_bytes, data + ((size_t)(s->region_y + row) * w + s->region_x) * bytes_per_pixel, row_bytes);
+}
+
 static void* stbi__load_main(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi__result_info* ri, int bpc)
 {
     memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
@@ -1133,7 +1602,7 @@ static unsigned char* stbi__load_and_postprocess_8bit(stbi__context* s, int* x,
 
     // @TODO: move stbi__convert_format to here
 
-    if (stbi__vertically_flip_on_load) {
+    if (stbi__vertically_flip_on_load && !ri.flipped) {
         int channels = req_comp ? req_comp : *comp;
         stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
     }
@@ -1158,7 +1627,7 @@ static stbi__uint16* stbi__load_and_postprocess_16bit(stbi__context* s, int* x,
     // @TODO: move stbi__convert_format16 to here
     // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-    if (stbi__vertically_flip_on_load) {
+    if (stbi__vertically_flip_on_load && !ri.flipped) {
         int channels = req_comp ? req_comp : *comp;
         stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
     }
@@ -1218,12 +1687,73 @@ static FILE* stbi__fopen(char const* filename, char const* mode)
     return f;
 }
 
+#ifndef STBI_NO_MMAP
+// loading by filename maps the whole file read-only and runs the memory
+// decoder over it, instead of copying it through stdio in small refills
+typedef struct
+{
+    stbi_uc const* data;
+    int len;
+#ifdef _WIN32
+    void* mapping;
+#endif
+} stbi__file_map;
+
+// map all of 'f' (just opened, so at offset 0); on failure, which includes
+// empty, huge or unmappable files such as pipes, the caller uses stdio instead
+static int stbi__map_file(FILE* f, stbi__file_map* m)
+{
+#ifdef _WIN32
+    __int64 size = _filelengthi64(_fileno(f));
+    void* file = (void*)_get_osfhandle(_fileno(f));
+    if (size <= 0 || size > INT_MAX || file == (void*)-1) return 0;
+    m->mapping = CreateFileMappingA(file, NULL, 0x02 /* PAGE_READONLY */, 0, 0, NULL);
+    if (!m->mapping) return 0;
+    m->data = (stbi_uc const*)MapViewOfFile(m->mapping, 0x0004 /* FILE_MAP_READ */, 0, 0, 0);
+    if (!m->data) { CloseHandle(m->mapping); return 0; }
+    m->len = (int)size;
+    return 1;
+#else
+    struct stat st;
+    void* base;
+    if (fstat(fileno(f), &st) != 0 || st.st_size <= 0 || st.st_size > INT_MAX) return 0;
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (base == MAP_FAILED) return 0;
+    // the decoders read front to back, so let the kernel read ahead
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+    m->data = (stbi_uc const*)base;
+    m->len = (int)st.st_size;
+    return 1;
+#endif
+}
+
+static void stbi__unmap_file(stbi__file_map* m)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(m->data);
+    CloseHandle(m->mapping);
+#else
+    munmap((void*)m->data, (size_t)m->len);
+#endif
+}
+#endif // STBI_NO_MMAP
 
 STBIDEF stbi_uc* stbi_load(char const* filename, int* x, int* y, int* comp, int req_comp)
 {
     FILE* f = stbi__fopen(filename, "rb");
     unsigned char* result;
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
     if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        result = stbi_load_from_memory(m.data, m.len, x, y, comp, req_comp);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
     result = stbi_load_from_file(f, x, y, comp, req_comp);
     fclose(f);
     return result;
@@ -1242,58 +1772,415 @@ STBIDEF stbi_uc* stbi_load_from_file(FILE* f, int* x, int* y, int* comp, int req
     return result;
 }
 
-STBIDEF stbi__uint16* stbi_load_from_file_16(FILE* f, int* x, int* y, int* comp, int req_comp)
+STBIDEF stbi__uint16* stbi_load_from_file_16(FILE* f, int* x, int* y, int* comp, int req_comp)
+{
+    stbi__uint16* result;
+    stbi__context s;
+    stbi__start_file(&s, f);
+    result = stbi__load_and_postprocess_16bit(&s, x, y, comp, req_comp);
+    if (result) {
+        // need to 'unget' all the characters in the IO buffer
+        fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+    }
+    return result;
+}
+
+STBIDEF stbi_us* stbi_load_16(char const* filename, int* x, int* y, int* comp, int req_comp)
+{
+    FILE* f = stbi__fopen(filename, "rb");
+    stbi__uint16* result;
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
+    if (!f) return (stbi_us*)stbi__errpuc("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        result = stbi_load_16_from_memory(m.data, m.len, x, y, comp, req_comp);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
+    result = stbi_load_from_file_16(f, x, y, comp, req_comp);
+    fclose(f);
+    return result;
+}
+
+
+#endif //!STBI_NO_STDIO
+
+STBIDEF stbi_us* stbi_load_16_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* channels_in_file, int desired_channels)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__load_and_postprocess_16bit(&s, x, y, channels_in_file, desired_channels);
+}
+
+STBIDEF stbi_us* stbi_load_16_from_callbacks(stbi_io_callbacks const* clbk, void* user, int* x, int* y, int* channels_in_file, int desired_channels)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks*)clbk, user);
+    return stbi__load_and_postprocess_16bit(&s, x, y, channels_in_file, desired_channels);
+}
+
+STBIDEF stbi_uc* stbi_load_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
+}
+
+STBIDEF stbi_uc* stbi_load_from_callbacks(stbi_io_callbacks const* clbk, void* user, int* x, int* y, int* comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_callbacks(&s, (stbi_io_callbacks*)clbk, user);
+    return stbi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
+}
+
+// hand a fully decoded image to a row callback a band at a time
+static int stbi__emit_rows(stbi_uc* data, int w, int h, int channels, stbi_rows_callback callback, void* user)
+{
+    int y, rows;
+    for (y = 0; y < h; y += rows) {
+        rows = h - y < STBI__ROWS_PER_BAND ? h - y : STBI__ROWS_PER_BAND;
+        if (!callback(user, y, rows, data + (size_t)y * w * channels))
+            return stbi__err("stopped", "Row callback stopped the load");
+    }
+    return 1;
+}
+
+static int stbi__load_rows_main(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi_rows_callback callback, void* user)
+{
+    stbi_uc* data;
+    int ok, channels;
+#ifndef STBI_NO_JPEG
+    // JPEG color-converts straight into a band buffer and never holds the
+    // whole output image
+    if (stbi__jpeg_test(s)) return stbi__jpeg_load_rows(s, x, y, comp, req_comp, callback, user);
+#endif
+    // comp may be NULL, but the band stride needs the channel count
+    data = stbi__load_and_postprocess_8bit(s, x, y, &channels, req_comp);
+    if (data == NULL) return 0;
+    if (comp) *comp = channels;
+    ok = stbi__emit_rows(data, *x, *y, req_comp ? req_comp : channels, callback, user);
+    STBI_FREE(data);
+    return ok;
+}
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* comp, int req_comp, stbi_rows_callback callback, void* user)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__load_rows_main(&s, x, y, comp, req_comp, callback, user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows(char const* filename, int* x, int* y, int* comp, int req_comp, stbi_rows_callback callback, void* user)
+{
+    FILE* f = stbi__fopen(filename, "rb");
+    int result;
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        result = stbi_load_rows_from_memory(m.data, m.len, x, y, comp, req_comp, callback, user);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
+    result = stbi_load_rows_from_file(f, x, y, comp, req_comp, callback, user);
+    fclose(f);
+    return result;
+}
+
+STBIDEF int stbi_load_rows_from_file(FILE* f, int* x, int* y, int* comp, int req_comp, stbi_rows_callback callback, void* user)
+{
+    int result;
+    stbi__context s;
+    stbi__start_file(&s, f);
+    result = stbi__load_rows_main(&s, x, y, comp, req_comp, callback, user);
+    if (result) {
+        // need to 'unget' all the characters in the IO buffer
+        fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+    }
+    return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF int stbi_load_gif_frames_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* frames, stbi_gif_frame_callback callback, void* user)
+{
+#ifndef STBI_NO_GIF
+    stbi__context s;
+    int count;
+    stbi__start_mem(&s, buffer, len);
+    if (!stbi__gif_test(&s)) return stbi__err("not GIF", "Image was not as a gif type.");
+    count = stbi__gif_count_frames(&s);
+    stbi__start_mem(&s, buffer, len);
+    return stbi__gif_load_frames(&s, count, x, y, frames, callback, user);
+#else
+    STBI_NOTUSED(buffer);
+    STBI_NOTUSED(len);
+    STBI_NOTUSED(x);
+    STBI_NOTUSED(y);
+    STBI_NOTUSED(frames);
+    STBI_NOTUSED(callback);
+    STBI_NOTUSED(user);
+    return stbi__err("not GIF", "Image was not as a gif type.");
+#endif
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_gif_frames(char const* filename, int* x, int* y, int* frames, stbi_gif_frame_callback callback, void* user)
+{
+    FILE* f = stbi__fopen(filename, "rb");
+    int result;
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        result = stbi_load_gif_frames_from_memory(m.data, m.len, x, y, frames, callback, user);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
+#ifndef STBI_NO_GIF
+    {
+        // the count takes a pass over the file of its own, so go back to
+        // the start for the decode
+        stbi__context s;
+        long pos = ftell(f);
+        int count;
+        stbi__start_file(&s, f);
+        if (stbi__gif_test(&s)) {
+            count = stbi__gif_count_frames(&s);
+            fseek(f, pos, SEEK_SET);
+            stbi__start_file(&s, f);
+            result = stbi__gif_load_frames(&s, count, x, y, frames, callback, user);
+        }
+        else
+            result = stbi__err("not GIF", "Image was not as a gif type.");
+    }
+#else
+    result = stbi__err("not GIF", "Image was not as a gif type.");
+#endif
+    fclose(f);
+    return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF int stbi_load_planes_from_memory(stbi_uc const* buffer, int len, int* x, int* y, stbi_planes* planes)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+#ifndef STBI_NO_JPEG
+    if (stbi__jpeg_test(&s)) return stbi__jpeg_load_planes(&s, x, y, planes);
+#else
+    STBI_NOTUSED(x);
+    STBI_NOTUSED(y);
+    STBI_NOTUSED(planes);
+#endif
+    return stbi__err("not a JPEG", "Only JPEG images can be loaded as planes");
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_planes(char const* filename, int* x, int* y, stbi_planes* planes)
+{
+    FILE* f = stbi__fopen(filename, "rb");
+    int result;
+    stbi__context s;
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
+    if (!f) return stbi__err("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        result = stbi_load_planes_from_memory(m.data, m.len, x, y, planes);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
+    stbi__start_file(&s, f);
+#ifndef STBI_NO_JPEG
+    if (stbi__jpeg_test(&s))
+        result = stbi__jpeg_load_planes(&s, x, y, planes);
+    else
+#endif
+        result = stbi__err("not a JPEG", "Only JPEG images can be loaded as planes");
+    fclose(f);
+    return result;
+}
+#endif //!STBI_NO_STDIO
+
+static stbi_uc* stbi__load_region_main(stbi__context* s, int rx, int ry, int rw, int rh, int* x, int* y, int* comp, int req_comp)
+{
+    stbi_uc* result;
+    if (rx < 0 || ry < 0 || rw <= 0 || rh <= 0) return stbi__errpuc("bad region", "Region is outside the image");
+    s->region = STBI__REGION_requested;
+    s->region_x = rx;
+    s->region_y = ry;
+    s->region_w = rw;
+    s->region_h = rh;
+    result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+    if (result && s->region == STBI__REGION_requested) {
+        // this format decoded the whole image, so cut the region out of it
+        if (!stbi__clip_region(s, *x, *y, 0)) {
+            STBI_FREE(result);
+            return NULL;
+        }
+        stbi__crop_to_region(s, result, *x, req_comp ? req_comp : *comp);
+        *x = s->region_w;
+        *y = s->region_h;
+    }
+    return result;
+}
+
+STBIDEF stbi_uc* stbi_load_region_from_memory(stbi_uc const* buffer, int len, int region_x, int region_y, int region_w, int region_h, int* x, int* y, int* comp, int req_comp)
 {
-    stbi__uint16* result;
     stbi__context s;
-    stbi__start_file(&s, f);
-    result = stbi__load_and_postprocess_16bit(&s, x, y, comp, req_comp);
-    if (result) {
-        // need to 'unget' all the characters in the IO buffer
-        fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
-    }
-    return result;
+    stbi__start_mem(&s, buffer, len);
+    return stbi__load_region_main(&s, region_x, region_y, region_w, region_h, x, y, comp, req_comp);
 }
 
-STBIDEF stbi_us* stbi_load_16(char const* filename, int* x, int* y, int* comp, int req_comp)
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc* stbi_load_region(char const* filename, int region_x, int region_y, int region_w, int region_h, int* x, int* y, int* comp, int req_comp)
 {
     FILE* f = stbi__fopen(filename, "rb");
-    stbi__uint16* result;
-    if (!f) return (stbi_us*)stbi__errpuc("can't fopen", "Unable to open file");
-    result = stbi_load_from_file_16(f, x, y, comp, req_comp);
+    stbi_uc* result;
+    stbi__context s;
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
+    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        result = stbi_load_region_from_memory(m.data, m.len, region_x, region_y, region_w, region_h, x, y, comp, req_comp);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
+    stbi__start_file(&s, f);
+    result = stbi__load_region_main(&s, region_x, region_y, region_w, region_h, x, y, comp, req_comp);
     fclose(f);
     return result;
 }
-
-
 #endif //!STBI_NO_STDIO
 
-STBIDEF stbi_us* stbi_load_16_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* channels_in_file, int desired_channels)
+STBIDEF void stbi_analyze_channels(stbi_uc const* data, int x, int y, int comp, stbi_channels* channels)
 {
-    stbi__context s;
-    stbi__start_mem(&s, buffer, len);
-    return stbi__load_and_postprocess_16bit(&s, x, y, channels_in_file, desired_channels);
-}
+    size_t i = 0, n = (size_t)x * y * comp;
+    int diff = 0, amin = 255, amax = 255;
 
-STBIDEF stbi_us* stbi_load_16_from_callbacks(stbi_io_callbacks const* clbk, void* user, int* x, int* y, int* channels_in_file, int desired_channels)
-{
-    stbi__context s;
-    stbi__start_callbacks(&s, (stbi_io_callbacks*)clbk, user);
-    return stbi__load_and_postprocess_16bit(&s, x, y, channels_in_file, desired_channels);
-}
+    if (comp == 2 || comp == 4)
+        amax = 0;
 
-STBIDEF stbi_uc* stbi_load_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* comp, int req_comp)
-{
-    stbi__context s;
-    stbi__start_mem(&s, buffer, len);
-    return stbi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
-}
+#ifdef STBI_SSE2
+    {
+        __m128i acc_diff = _mm_setzero_si128();
+        __m128i acc_min = _mm_set1_epi8((char)255);
+        __m128i acc_max = _mm_setzero_si128();
+        STBI_SIMD_ALIGN(stbi_uc, lanes[32]);
+        int k;
 
-STBIDEF stbi_uc* stbi_load_from_callbacks(stbi_io_callbacks const* clbk, void* user, int* x, int* y, int* comp, int req_comp)
-{
-    stbi__context s;
-    stbi__start_callbacks(&s, (stbi_io_callbacks*)clbk, user);
-    return stbi__load_and_postprocess_8bit(&s, x, y, comp, req_comp);
+        if (comp == 2) {
+            // 8 pixels at a time; min/max only see the alpha bytes
+            __m128i alpha = _mm_set1_epi16((short)0xff00);
+            for (; i + 16 <= n; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                acc_min = _mm_min_epu8(acc_min, _mm_or_si128(v, _mm_andnot_si128(alpha, _mm_set1_epi8((char)255))));
+                acc_max = _mm_max_epu8(acc_max, _mm_and_si128(v, alpha));
+            }
+        }
+        else if (comp == 3) {
+            // 4 pixels from each 16-byte load, comparing each byte of r and g
+            // with the byte after it
+            __m128i rg = _mm_setr_epi8(-1, -1, 0, -1, -1, 0, -1, -1, 0, -1, -1, 0, 0, 0, 0, 0);
+            for (; i + 16 <= n; i += 12) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                acc_diff = _mm_or_si128(acc_diff, _mm_and_si128(_mm_xor_si128(v, _mm_srli_si128(v, 1)), rg));
+            }
+        }
+        else if (comp == 4) {
+            __m128i rg = _mm_set1_epi32(0xffff);
+            __m128i alpha = _mm_set1_epi32((int)0xff000000);
+            for (; i + 16 <= n; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+                acc_diff = _mm_or_si128(acc_diff, _mm_and_si128(_mm_xor_si128(v, _mm_srli_epi32(v, 8)), rg));
+                acc_min = _mm_min_epu8(acc_min, _mm_or_si128(v, _mm_andnot_si128(alpha, _mm_set1_epi8((char)255))));
+                acc_max = _mm_max_epu8(acc_max, _mm_and_si128(v, alpha));
+            }
+        }
+        diff = _mm_movemask_epi8(_mm_cmpeq_epi8(acc_diff, _mm_setzero_si128())) != 0xffff;
+        _mm_store_si128((__m128i*)lanes, acc_min);
+        _mm_store_si128((__m128i*)(lanes + 16), acc_max);
+        for (k = 0; k < 16; ++k) {
+            if (lanes[k] < amin) amin = lanes[k];
+            if (lanes[16 + k] > amax) amax = lanes[16 + k];
+        }
+    }
+#endif
+
+#ifdef STBI_NEON
+    {
+        uint8x16_t acc_diff = vdupq_n_u8(0);
+        uint8x16_t acc_min = vdupq_n_u8(255);
+        uint8x16_t acc_max = vdupq_n_u8(0);
+        stbi_uc lanes[48];
+        int k;
+
+        if (comp == 2) {
+            for (; i + 32 <= n; i += 32) {
+                uint8x16x2_t v = vld2q_u8(data + i);
+                acc_min = vminq_u8(acc_min, v.val[1]);
+                acc_max = vmaxq_u8(acc_max, v.val[1]);
+            }
+        }
+        else if (comp == 3) {
+            for (; i + 48 <= n; i += 48) {
+                uint8x16x3_t v = vld3q_u8(data + i);
+                acc_diff = vorrq_u8(acc_diff, vorrq_u8(veorq_u8(v.val[0], v.val[1]), veorq_u8(v.val[1], v.val[2])));
+            }
+        }
+        else if (comp == 4) {
+            for (; i + 64 <= n; i += 64) {
+                uint8x16x4_t v = vld4q_u8(data + i);
+                acc_diff = vorrq_u8(acc_diff, vorrq_u8(veorq_u8(v.val[0], v.val[1]), veorq_u8(v.val[1], v.val[2])));
+                acc_min = vminq_u8(acc_min, v.val[3]);
+                acc_max = vmaxq_u8(acc_max, v.val[3]);
+            }
+        }
+        vst1q_u8(lanes, acc_diff);
+        vst1q_u8(lanes + 16, acc_min);
+        vst1q_u8(lanes + 32, acc_max);
+        for (k = 0; k < 16; ++k) {
+            diff |= lanes[k];
+            if (lanes[16 + k] < amin) amin = lanes[16 + k];
+            if (lanes[32 + k] > amax) amax = lanes[32 + k];
+        }
+    }
+#endif
+
+    // the rest, or all of it without SIMD
+    for (; i < n; i += comp) {
+        if (comp >= 3)
+            diff |= (data[i] ^ data[i + 1]) | (data[i + 1] ^ data[i + 2]);
+        if (comp == 2 || comp == 4) {
+            int a = data[i + comp - 1];
+            if (a < amin) amin = a;
+            if (a > amax) amax = a;
+        }
+    }
+
+    channels->gray = comp < 3 || !diff;
+    channels->alpha_min = amin;
+    channels->alpha_max = amax;
 }
 
 #ifndef STBI_NO_GIF
@@ -1350,7 +2237,18 @@ STBIDEF float* stbi_loadf(char const* filename, int* x, int* y, int* comp, int r
 {
     float* result;
     FILE* f = stbi__fopen(filename, "rb");
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
     if (!f) return stbi__errpf("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        result = stbi_loadf_from_memory(m.data, m.len, x, y, comp, req_comp);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
     result = stbi_loadf_from_file(f, x, y, comp, req_comp);
     fclose(f);
     return result;
@@ -1366,6 +2264,72 @@ STBIDEF float* stbi_loadf_from_file(FILE* f, int* x, int* y, int* comp, int req_
 
 #endif // !STBI_NO_LINEAR
 
+#ifndef STBI_NO_HDR
+static void* stbi__load_hdr_packed_main(stbi__context* s, int* x, int* y, int* comp, int req_comp, int format)
+{
+    void* result;
+    int channels;
+    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+    if (!stbi__hdr_test(s)) return stbi__errpuc("not HDR", "Only Radiance HDR images load packed");
+    result = stbi__hdr_load_as(s, x, y, comp, req_comp, format);
+    if (result && stbi__vertically_flip_on_load) {
+        channels = req_comp ? req_comp : 3;
+        stbi__vertical_flip(result, *x, *y, format == STBI__HDR_half ? channels * 2 : 4);
+    }
+    return result;
+}
+
+STBIDEF unsigned int* stbi_load_rgb9e5_from_memory(stbi_uc const* buffer, int len, int* x, int* y)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return (unsigned int*)stbi__load_hdr_packed_main(&s, x, y, NULL, 3, STBI__HDR_rgb9e5);
+}
+
+STBIDEF stbi_us* stbi_load_half_from_memory(stbi_uc const* buffer, int len, int* x, int* y, int* comp, int req_comp)
+{
+    stbi__context s;
+    stbi__start_mem(&s, buffer, len);
+    return (stbi_us*)stbi__load_hdr_packed_main(&s, x, y, comp, req_comp, STBI__HDR_half);
+}
+
+#ifndef STBI_NO_STDIO
+static void* stbi__load_hdr_packed_file(char const* filename, int* x, int* y, int* comp, int req_comp, int format)
+{
+    void* result;
+    stbi__context s;
+    FILE* f = stbi__fopen(filename, "rb");
+#ifndef STBI_NO_MMAP
+    stbi__file_map m;
+#endif
+    if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+#ifndef STBI_NO_MMAP
+    if (stbi__map_file(f, &m)) {
+        stbi__start_mem(&s, m.data, m.len);
+        result = stbi__load_hdr_packed_main(&s, x, y, comp, req_comp, format);
+        stbi__unmap_file(&m);
+        fclose(f);
+        return result;
+    }
+#endif
+    stbi__start_file(&s, f);
+    result = stbi__load_hdr_packed_main(&s, x, y, comp, req_comp, format);
+    fclose(f);
+    return result;
+}
+
+STBIDEF unsigned int* stbi_load_rgb9e5(char const* filename, int* x, int* y)
+{
+    return (unsigned int*)stbi__load_hdr_packed_file(filename, x, y, NULL, 3, STBI__HDR_rgb9e5);
+}
+
+STBIDEF stbi_us* stbi_load_half(char const* filename, int* x, int* y, int* comp, int req_comp)
+{
+    return (stbi_us*)stbi__load_hdr_packed_file(filename, x, y, comp, req_comp, STBI__HDR_half);
+}
+#endif // !STBI_NO_STDIO
+#endif // !STBI_NO_HDR
+
 // these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
 // defined, for API simplicity; if STBI_NO_LINEAR is defined, it always
 // reports false!
@@ -1581,9 +2545,101 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
     return (stbi_uc)(((r * 77) + (g * 150) + (29 * b)) >> 8);
 }
 
-static unsigned char* stbi__convert_format(unsigned char* data, int img_n, int req_comp, unsigned int x, unsigned int y)
+// expand the start of a row of x pixels to 4 channels, for the img_n that
+// have a fast path: SIMD where there is some, else a word per pixel. returns
+// how many pixels it did; the caller converts the rest
+static int stbi__convert_row_to_rgba(stbi_uc* dest, const stbi_uc* src, int img_n, int x, int ssse3)
 {
-    int i, j;
+    int i = 0;
+    stbi__uint32 alpha;
+    static const union { stbi__uint32 word; stbi_uc bytes[4]; } one = { 1 };
+
+#ifdef STBI_SSE2
+    __m128i ff = _mm_set1_epi8((char)255);
+    if (img_n == 1) {
+        for (; i + 16 <= x; i += 16) {
+            __m128i g = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i gg_lo = _mm_unpacklo_epi8(g, g), gg_hi = _mm_unpackhi_epi8(g, g);
+            __m128i ga_lo = _mm_unpacklo_epi8(g, ff), ga_hi = _mm_unpackhi_epi8(g, ff);
+            _mm_storeu_si128((__m128i*)(dest + 4 * i), _mm_unpacklo_epi16(gg_lo, ga_lo));
+            _mm_storeu_si128((__m128i*)(dest + 4 * i + 16), _mm_unpackhi_epi16(gg_lo, ga_lo));
+            _mm_storeu_si128((__m128i*)(dest + 4 * i + 32), _mm_unpacklo_epi16(gg_hi, ga_hi));
+            _mm_storeu_si128((__m128i*)(dest + 4 * i + 48), _mm_unpackhi_epi16(gg_hi, ga_hi));
+        }
+    }
+    else if (img_n == 2) {
+        for (; i + 8 <= x; i += 8) {
+            __m128i ga = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+            __m128i g = _mm_and_si128(ga, _mm_set1_epi16(0xff));
+            __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+            _mm_storeu_si128((__m128i*)(dest + 4 * i), _mm_unpacklo_epi16(gg, ga));
+            _mm_storeu_si128((__m128i*)(dest + 4 * i + 16), _mm_unpackhi_epi16(gg, ga));
+        }
+    }
+#ifdef STBI_SSSE3
+    else if (img_n == 3 && ssse3) {
+        __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        __m128i a = _mm_set1_epi32((int)0xff000000);
+        // 16-byte loads for 12 bytes of pixels, so stop short of the row end
+        for (; i + 6 <= x; i += 4) {
+            __m128i rgb = _mm_loadu_si128((const __m128i*)(src + 3 * i));
+            _mm_storeu_si128((__m128i*)(dest + 4 * i), _mm_or_si128(_mm_shuffle_epi8(rgb, spread), a));
+        }
+    }
+#endif
+#endif
+    STBI_NOTUSED(ssse3);
+
+#ifdef STBI_NEON
+    if (img_n == 1) {
+        for (; i + 16 <= x; i += 16) {
+            uint8x16x4_t rgba;
+            rgba.val[0] = rgba.val[1] = rgba.val[2] = vld1q_u8(src + i);
+            rgba.val[3] = vdupq_n_u8(255);
+            vst4q_u8(dest + 4 * i, rgba);
+        }
+    }
+    else if (img_n == 2) {
+        for (; i + 16 <= x; i += 16) {
+            uint8x16x2_t ga = vld2q_u8(src + 2 * i);
+            uint8x16x4_t rgba;
+            rgba.val[0] = rgba.val[1] = rgba.val[2] = ga.val[0];
+            rgba.val[3] = ga.val[1];
+            vst4q_u8(dest + 4 * i, rgba);
+        }
+    }
+    else if (img_n == 3) {
+        for (; i + 16 <= x; i += 16) {
+            uint8x16x3_t rgb = vld3q_u8(src + 3 * i);
+            uint8x16x4_t rgba;
+            rgba.val[0] = rgb.val[0];
+            rgba.val[1] = rgb.val[1];
+            rgba.val[2] = rgb.val[2];
+            rgba.val[3] = vdupq_n_u8(255);
+            vst4q_u8(dest + 4 * i, rgba);
+        }
+    }
+#endif
+
+    if (img_n == 3) {
+        // load each pixel as a word and set its 4th byte, stopping a pixel
+        // short so the last load doesn't run off the row
+        alpha = one.bytes[0] ? 0xff000000u : 0xffu;
+        for (; i + 1 < x; ++i) {
+            stbi__uint32 v;
+            memcpy(&v, src + 3 * i, 4);
+            v |= alpha;
+            memcpy(dest + 4 * i, &v, 4);
+        }
+    }
+    return i;
+}
+
+// if ri is given, also flip the rows while converting them when the image is
+// still due to be flipped on load, and flag ri that it was
+static unsigned char* stbi__convert_format(unsigned char* data, int img_n, int req_comp, unsigned int x, unsigned int y, stbi__result_info* ri)
+{
+    int i, j, done = 0, flip = 0, ssse3 = 0;
     unsigned char* good;
 
     if (req_comp == img_n) return data;
@@ -1595,12 +2651,25 @@ static unsigned char* stbi__convert_format(unsigned char* data, int img_n, int r
         return stbi__errpuc("outofmem", "Out of memory");
     }
 
+    if (ri && !ri->flipped && stbi__vertically_flip_on_load)
+        flip = ri->flipped = 1;
+#ifdef STBI_SSSE3
+    if (req_comp == 4 && img_n == 3)
+        ssse3 = stbi__ssse3_available();
+#endif
+
     for (j = 0; j < (int)y; ++j) {
         unsigned char* src = data + j * x * img_n;
-        unsigned char* dest = good + j * x * req_comp;
+        unsigned char* dest = good + (flip ? y - 1 - j : j) * x * req_comp;
+
+        if (req_comp == 4) {
+            done = stbi__convert_row_to_rgba(dest, src, img_n, x, ssse3);
+            src += done * img_n;
+            dest += done * 4;
+        }
 
 #define STBI__COMBO(a,b)  ((a)*8+(b))
-#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+#define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=(int)x-done-1; i >= 0; --i, src += a, dest += b)
         // convert source image with img_n components to one with req_comp components;
         // avoid switch per pixel, so use switch per scanline and massive macros
         switch (STBI__COMBO(img_n, req_comp)) {
@@ -1630,9 +2699,9 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
     return (stbi__uint16)(((r * 77) + (g * 150) + (29 * b)) >> 8);
 }
 
-static stbi__uint16* stbi__convert_format16(stbi__uint16* data, int img_n, int req_comp, unsigned int x, unsigned int y)
+static stbi__uint16* stbi__convert_format16(stbi__uint16* data, int img_n, int req_comp, unsigned int x, unsigned int y, stbi__result_info* ri)
 {
-    int i, j;
+    int i, j, flip = 0;
     stbi__uint16* good;
 
     if (req_comp == img_n) return data;
@@ -1644,9 +2713,12 @@ static stbi__uint16* stbi__convert_format16(stbi__uint16* data, int img_n, int r
         return (stbi__uint16*)stbi__errpuc("outofmem", "Out of memory");
     }
 
+    if (ri && !ri->flipped && stbi__vertically_flip_on_load)
+        flip = ri->flipped = 1;
+
     for (j = 0; j < (int)y; ++j) {
         stbi__uint16* src = data + j * x * img_n;
-        stbi__uint16* dest = good + j * x * req_comp;
+        stbi__uint16* dest = good + (flip ? y - 1 - j : j) * x * req_comp;
 
 #define STBI__COMBO(a,b)  ((a)*8+(b))
 #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
@@ -1679,14 +2751,18 @@ static float* stbi__ldr_to_hdr(stbi_uc* data, int x, int y, int comp)
 {
     int i, k, n;
     float* output;
+    float table[256];
     if (!data) return NULL;
     output = (float*)stbi__malloc_mad4(x, y, comp, sizeof(float), 0);
     if (output == NULL) { STBI_FREE(data); return stbi__errpf("outofmem", "Out of memory"); }
     // compute number of non-alpha components
     if (comp & 1) n = comp; else n = comp - 1;
+    // there are only 256 inputs, so pow() each of them once
+    for (i = 0; i < 256; ++i)
+        table[i] = (float)(pow(i / 255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
     for (i = 0; i < x * y; ++i) {
         for (k = 0; k < n; ++k) {
-            output[i * comp + k] = (float)(pow(data[i * comp + k] / 255.0f, stbi__l2h_gamma) * stbi__l2h_scale);
+            output[i * comp + k] = table[data[i * comp + k]];
         }
     }
     if (n < comp) {
@@ -1701,21 +2777,69 @@ static float* stbi__ldr_to_hdr(stbi_uc* data, int x, int y, int comp)
 
 #ifndef STBI_NO_HDR
 #define stbi__float2int(x)   ((int) (x))
+
+// the 8-bit level (before clamping) that stbi__hdr_to_ldr gives a color value
+static float stbi__h2l_level(float v)
+{
+    return (float)pow(v * stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
+}
+
+// the neighboring float, for positive values
+static float stbi__float_step(float v, int dir)
+{
+    union { float f; stbi__uint32 u; } b;
+    b.f = v;
+    b.u += dir;
+    return b.f;
+}
+
+// t[k] = the smallest color value that comes out as level k (1..255), so
+// converting a value is a binary search instead of a pow(). the estimate is
+// only off by rounding; stepping to the exact edge keeps results identical
+static int stbi__h2l_thresholds(float* t)
+{
+    int k;
+    if (!(stbi__h2l_scale_i > 0 && stbi__h2l_gamma_i > 0)) return 0;
+    t[0] = 0;
+    for (k = 1; k < 256; ++k) {
+        float v = (float)(pow((k - 0.5) / 255, 1 / stbi__h2l_gamma_i) / stbi__h2l_scale_i);
+        if (!(v > 0 && v < 3.0e38f)) return 0;
+        while (v > 0 && stbi__h2l_level(v) >= k) v = stbi__float_step(v, -1);
+        while (!(stbi__h2l_level(v) >= k)) v = stbi__float_step(v, 1);
+        t[k] = v;
+    }
+    return 1;
+}
+
+stbi_inline static stbi_uc stbi__h2l_lookup(const float* t, float v)
+{
+    int k = 0, step;
+    for (step = 128; step; step >>= 1)
+        if (t[k + step] <= v) k += step;
+    return (stbi_uc)k;
+}
+
 static stbi_uc* stbi__hdr_to_ldr(float* data, int x, int y, int comp)
 {
-    int i, k, n;
+    int i, k, n, use_table;
     stbi_uc* output;
+    float t[256];
     if (!data) return NULL;
     output = (stbi_uc*)stbi__malloc_mad3(x, y, comp, 0);
     if (output == NULL) { STBI_FREE(data); return stbi__errpuc("outofmem", "Out of memory"); }
     // compute number of non-alpha components
     if (comp & 1) n = comp; else n = comp - 1;
+    use_table = stbi__h2l_thresholds(t);
     for (i = 0; i < x * y; ++i) {
         for (k = 0; k < n; ++k) {
-            float z = (float)pow(data[i * comp + k] * stbi__h2l_scale_i, stbi__h2l_gamma_i) * 255 + 0.5f;
-            if (z < 0) z = 0;
-            if (z > 255) z = 255;
-            output[i * comp + k] = (stbi_uc)stbi__float2int(z);
+            if (use_table)
+                output[i * comp + k] = stbi__h2l_lookup(t, data[i * comp + k]);
+            else {
+                float z = stbi__h2l_level(data[i * comp + k]);
+                if (z < 0) z = 0;
+                if (z > 255) z = 255;
+                output[i * comp + k] = (stbi_uc)stbi__float2int(z);
+            }
         }
         if (k < comp) {
             float z = data[i * comp + k] * 255 + 0.5f;
@@ -1753,7 +2877,7 @@ static stbi_uc* stbi__hdr_to_ldr(float* data, int x, int y, int comp)
 #ifndef STBI_NO_JPEG
 
 // huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+#define FAST_BITS   11 // larger handles more cases; smaller stomps less cache
 
 typedef struct
 {
@@ -1778,6 +2902,7 @@ typedef struct
     int img_h_max, img_v_max;
     int img_mcu_x, img_mcu_y;
     int img_mcu_w, img_mcu_h;
+    int idct_size; // pixels per block edge in the decoded planes: 8, or 4/2/1 when scaling
 
     // definition of jpeg image component
     struct
@@ -1794,9 +2919,10 @@ typedef struct
         stbi_uc* linebuf;
         short* coeff;   // progressive only
         int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+        int      bx0, bx1, by0, by1; // blocks that need an idct, see stbi_load_region
     } img_comp[4];
 
-    stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+    stbi__uint64   code_buffer; // jpeg entropy-coded buffer
     int            code_bits;   // number of valid bits
     unsigned char  marker;      // marker seen while filling entropy buffer
     int            nomore;      // flag if we saw a marker so must stop
@@ -1889,27 +3015,44 @@ static void stbi__build_fast_ac(stbi__int16* fast_ac, stbi__huffman* h)
     }
 }
 
+// the entropy decoder keeps a left-aligned 64-bit bit reservoir; the top
+// code_bits bits of code_buffer are valid, everything below them is zero.
+// refilling a byte at a time has to look for 0xff stuffing and markers on
+// every byte, so when at least 8 bytes are available and none of them is
+// 0xff we splice in as many whole bytes as fit in one go.
 static void stbi__grow_buffer_unsafe(stbi__jpeg* j)
 {
+    stbi__context* s = j->s;
+    if (!j->nomore && j->code_bits >= 0 && s->img_buffer_end - s->img_buffer >= 8) {
+        stbi_uc* p = s->img_buffer;
+        stbi__uint64 v = ((stbi__uint64)p[0] << 56) | ((stbi__uint64)p[1] << 48) | ((stbi__uint64)p[2] << 40) | ((stbi__uint64)p[3] << 32)
+            | ((stbi__uint64)p[4] << 24) | ((stbi__uint64)p[5] << 16) | ((stbi__uint64)p[6] << 8) | (stbi__uint64)p[7];
+        stbi__uint64 nv = ~v;
+        // no byte of v is 0xff <=> no byte of ~v is zero
+        if (((nv - 0x0101010101010101ull) & ~nv & 0x8080808080808080ull) == 0) {
+            int n = (63 - j->code_bits) >> 3; // whole bytes that fit, at most 7
+            j->code_buffer |= (v & ~(~(stbi__uint64)0 >> (n * 8))) >> j->code_bits;
+            j->code_bits += n * 8;
+            s->img_buffer += n;
+            return;
+        }
+    }
     do {
-        unsigned int b = j->nomore ? 0 : stbi__get8(j->s);
+        unsigned int b = j->nomore ? 0 : stbi__get8(s);
         if (b == 0xff) {
-            int c = stbi__get8(j->s);
-            while (c == 0xff) c = stbi__get8(j->s); // consume fill bytes
+            int c = stbi__get8(s);
+            while (c == 0xff) c = stbi__get8(s); // consume fill bytes
             if (c != 0) {
                 j->marker = (unsigned char)c;
                 j->nomore = 1;
                 return;
             }
         }
-        j->code_buffer |= b << (24 - j->code_bits);
+        j->code_buffer |= (stbi__uint64)b << (56 - j->code_bits);
         j->code_bits += 8;
-    } while (j->code_bits <= 24);
+    } while (j->code_bits <= 56);
 }
 
-// (1 << n) - 1
-static const stbi__uint32 stbi__bmask[17] = { 0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535 };
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg* j, stbi__huffman* h)
 {
@@ -1920,7 +3063,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg* j, stbi__huffman* h)
 
     // look at the top FAST_BITS and determine what symbol ID it is,
     // if the code is <= FAST_BITS
-    c = (j->code_buffer >> (32 - FAST_BITS))& ((1 << FAST_BITS) - 1);
+    c = (int)(j->code_buffer >> (64 - FAST_BITS));
     k = h->fast[c];
     if (k < 255) {
         int s = h->size[k];
@@ -1937,7 +3080,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg* j, stbi__huffman* h)
     // end; in other words, regardless of the number of bits, it
     // wants to be compared against something shifted to have 16;
     // that way we don't need to shift inside the loop.
-    temp = j->code_buffer >> 16;
+    temp = (unsigned int)(j->code_buffer >> 48);
     for (k = FAST_BITS + 1; ; ++k)
         if (temp < h->maxcode[k])
             break;
@@ -1951,8 +3094,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg* j, stbi__huffman* h)
         return -1;
 
     // convert the huffman code to the symbol id
-    c = ((j->code_buffer >> (32 - k))& stbi__bmask[k]) + h->delta[k];
-    STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c]))& stbi__bmask[h->size[c]]) == h->code[c]);
+    c = (int)(j->code_buffer >> (64 - k)) + h->delta[k];
+    STBI_ASSERT((int)(j->code_buffer >> (64 - h->size[c])) == h->code[c]);
 
     // convert the id to a symbol
     j->code_bits -= k;
@@ -1970,14 +3113,13 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg* j, int n)
     unsigned int k;
     int sgn;
     if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
+    STBI_ASSERT(n > 0 && n < (int)(sizeof(stbi__jbias) / sizeof(*stbi__jbias)));
 
-    sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-    k = stbi_lrot(j->code_buffer, n);
-    STBI_ASSERT(n >= 0 && n < (int)(sizeof(stbi__bmask) / sizeof(*stbi__bmask)));
-    j->code_buffer = k & ~stbi__bmask[n];
-    k &= stbi__bmask[n];
+    sgn = (int)(j->code_buffer >> 63) - 1; // 0 if the MSB is set, -1 if not
+    k = (unsigned int)(j->code_buffer >> (64 - n));
+    j->code_buffer <<= n;
     j->code_bits -= n;
-    return k + (stbi__jbias[n] & ~sgn);
+    return k + (stbi__jbias[n] & sgn);
 }
 
 // get some unsigned bits
@@ -1985,21 +3127,21 @@ stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg* j, int n)
 {
     unsigned int k;
     if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-    k = stbi_lrot(j->code_buffer, n);
-    j->code_buffer = k & ~stbi__bmask[n];
-    k &= stbi__bmask[n];
+    STBI_ASSERT(n > 0 && n <= 16);
+    k = (unsigned int)(j->code_buffer >> (64 - n));
+    j->code_buffer <<= n;
     j->code_bits -= n;
     return k;
 }
 
 stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg* j)
 {
-    unsigned int k;
+    int k;
     if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-    k = j->code_buffer;
+    k = (int)(j->code_buffer >> 63);
     j->code_buffer <<= 1;
     --j->code_bits;
-    return k & 0x80000000;
+    return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -2027,7 +3169,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg* j, short data[64], stbi__huffman*
 
     if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
     t = stbi__jpeg_huff_decode(j, hdc);
-    if (t < 0) return stbi__err("bad huffman code", "Corrupt JPEG");
+    if (t < 0 || t > 15) return stbi__err("bad huffman code", "Corrupt JPEG");
 
     // 0 all the ac values now so we can do it 32-bits at a time
     memset(data, 0, 64 * sizeof(data[0]));
@@ -2043,7 +3185,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg* j, short data[64], stbi__huffman*
         unsigned int zig;
         int c, r, s;
         if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-        c = (j->code_buffer >> (32 - FAST_BITS))& ((1 << FAST_BITS) - 1);
+        c = (int)(j->code_buffer >> (64 - FAST_BITS));
         r = fac[c];
         if (r) { // fast-AC path
             k += (r >> 4) & 15; // run
@@ -2086,6 +3228,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg* j, short data[64], stbi__
         // first scan for DC coefficient, must be first
         memset(data, 0, 64 * sizeof(data[0])); // 0 all the ac values now
         t = stbi__jpeg_huff_decode(j, hdc);
+        if (t < 0 || t > 15) return stbi__err("bad huffman code", "Corrupt JPEG");
         diff = t ? stbi__extend_receive(j, t) : 0;
 
         dc = j->img_comp[b].dc_pred + diff;
@@ -2120,7 +3263,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg* j, short data[64], stbi__
             unsigned int zig;
             int c, r, s;
             if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-            c = (j->code_buffer >> (32 - FAST_BITS))& ((1 << FAST_BITS) - 1);
+            c = (int)(j->code_buffer >> (64 - FAST_BITS));
             r = fac[c];
             if (r) { // fast-AC path
                 k += (r >> 4) & 15; // run
@@ -2340,6 +3483,63 @@ static void stbi__idct_block(stbi_uc* out, int out_stride, short data[64])
     }
 }
 
+// reduced-size IDCTs for scaled decoding (see stbi_set_jpeg_scale): an NxN
+// output block is the 8x8 cosine basis sampled at the centre of each group of
+// 8/N pixels, which only needs the top-left NxN coefficients. the constants
+// are C(k)/2 * cos((2n+1)k*pi/(2N)), the same per-axis 1/2 as the full IDCT
+#define STBI__IDCT4_1D(s0,s1,s2,s3) \
+   int e0,e1,o0,o1; \
+   e0 = ((s0) + (s2)) * stbi__f2f(0.353553391f); \
+   e1 = ((s0) - (s2)) * stbi__f2f(0.353553391f); \
+   o0 = (s1) * stbi__f2f(0.461939766f) + (s3) * stbi__f2f(0.191341716f); \
+   o1 = (s1) * stbi__f2f(0.191341716f) - (s3) * stbi__f2f(0.461939766f);
+
+static void stbi__idct_block_4x4(stbi_uc* out, int out_stride, short data[64])
+{
+    int i, val[16], * v = val;
+    short* d = data;
+
+    // columns; constants are scaled by 1<<12, keep 2 extra bits like above
+    for (i = 0; i < 4; ++i, ++d, ++v) {
+        STBI__IDCT4_1D(d[0], d[8], d[16], d[24])
+        e0 += 512; e1 += 512;
+        v[0] = (e0 + o0) >> 10;
+        v[4] = (e1 + o1) >> 10;
+        v[8] = (e1 - o1) >> 10;
+        v[12] = (e0 - o0) >> 10;
+    }
+
+    // rows; remove the remaining 1<<14 with rounding, and add 128
+    for (i = 0, v = val; i < 4; ++i, v += 4, out += out_stride) {
+        STBI__IDCT4_1D(v[0], v[1], v[2], v[3])
+        e0 += (1 << 13) + (128 << 14);
+        e1 += (1 << 13) + (128 << 14);
+        out[0] = stbi__clamp((e0 + o0) >> 14);
+        out[1] = stbi__clamp((e1 + o1) >> 14);
+        out[2] = stbi__clamp((e1 - o1) >> 14);
+        out[3] = stbi__clamp((e0 - o0) >> 14);
+    }
+}
+
+static void stbi__idct_block_2x2(stbi_uc* out, int out_stride, short data[64])
+{
+    // with two points the basis is just sum and difference, times C(0)/2
+    // per axis, i.e. 1/8 overall
+    int a = data[0] + data[8], b = data[0] - data[8];
+    int c = data[1] + data[9], e = data[1] - data[9];
+    out[0] = stbi__clamp(((a + c + 4) >> 3) + 128);
+    out[1] = stbi__clamp(((a - c + 4) >> 3) + 128);
+    out[out_stride] = stbi__clamp(((b + e + 4) >> 3) + 128);
+    out[out_stride + 1] = stbi__clamp(((b - e + 4) >> 3) + 128);
+}
+
+static void stbi__idct_block_1x1(stbi_uc* out, int out_stride, short data[64])
+{
+    // DC only: the block average is data[0] / 8
+    STBI_NOTUSED(out_stride);
+    out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2763,132 +3963,214 @@ static void stbi__jpeg_reset(stbi__jpeg* j)
     // since we don't even allow 1<<30 pixels
 }
 
-static int stbi__parse_entropy_coded_data(stbi__jpeg* z)
+// decode the MCU at column i, row j of the current scan. for baseline data
+// the blocks are IDCT'd straight into the component planes; progressive
+// scans accumulate into the coefficient buffers instead
+// whether block (i,j) of component n is used by the output; outside a
+// region decode, all of them are
+stbi_inline static int stbi__jpeg_block_wanted(stbi__jpeg* z, int n, int i, int j)
 {
-    stbi__jpeg_reset(z);
-    if (!z->progressive) {
-        if (z->scan_n == 1) {
-            int i, j;
-            STBI_SIMD_ALIGN(short, data[64]);
-            int n = z->order[0];
-            // non-interleaved data, we just need to process one block at a time,
-            // in trivial scanline order
-            // number of blocks to do just depends on how many actual "pixels" this
-            // component has, independent of interleaved MCU blocking and such
-            int w = (z->img_comp[n].x + 7) >> 3;
-            int h = (z->img_comp[n].y + 7) >> 3;
-            for (j = 0; j < h; ++j) {
-                for (i = 0; i < w; ++i) {
-                    int ha = z->img_comp[n].ha;
-                    if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                    z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2 * j * 8 + i * 8, z->img_comp[n].w2, data);
-                    // every data block is an MCU, so countdown the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        // if it's NOT a restart, then just bail, so we get corrupt data
-                        // rather than no data
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
-                    }
-                }
-            }
-            return 1;
+    return i >= z->img_comp[n].bx0 && i < z->img_comp[n].bx1
+        && j >= z->img_comp[n].by0 && j < z->img_comp[n].by1;
+}
+
+static int stbi__jpeg_decode_mcu(stbi__jpeg* z, int i, int j)
+{
+    STBI_SIMD_ALIGN(short, block[64]);
+    if (z->scan_n == 1) {
+        // non-interleaved data, every MCU is a single block
+        int n = z->order[0];
+        int ha = z->img_comp[n].ha;
+        if (!z->progressive) {
+            if (!stbi__jpeg_decode_block(z, block, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            if (stbi__jpeg_block_wanted(z, n, i, j))
+                z->idct_block_kernel(z->img_comp[n].data + (z->img_comp[n].w2 * j + i) * z->idct_size, z->img_comp[n].w2, block);
         }
-        else { // interleaved
-            int i, j, k, x, y;
-            STBI_SIMD_ALIGN(short, data[64]);
-            for (j = 0; j < z->img_mcu_y; ++j) {
-                for (i = 0; i < z->img_mcu_x; ++i) {
-                    // scan an interleaved mcu... process scan_n components in order
-                    for (k = 0; k < z->scan_n; ++k) {
-                        int n = z->order[k];
-                        // scan out an mcu's worth of this component; that's just determined
-                        // by the basic H and V specified for the component
-                        for (y = 0; y < z->img_comp[n].v; ++y) {
-                            for (x = 0; x < z->img_comp[n].h; ++x) {
-                                int x2 = (i * z->img_comp[n].h + x) * 8;
-                                int y2 = (j * z->img_comp[n].v + y) * 8;
-                                int ha = z->img_comp[n].ha;
-                                if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                                z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2 * y2 + x2, z->img_comp[n].w2, data);
-                            }
-                        }
-                    }
-                    // after all interleaved components, that's an interleaved MCU,
-                    // so now count down the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
-                    }
-                }
+        else {
+            short* data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+            if (z->spec_start == 0) {
+                if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
+                    return 0;
+            }
+            else {
+                if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
+                    return 0;
             }
-            return 1;
         }
     }
-    else {
-        if (z->scan_n == 1) {
-            int i, j;
-            int n = z->order[0];
-            // non-interleaved data, we just need to process one block at a time,
-            // in trivial scanline order
-            // number of blocks to do just depends on how many actual "pixels" this
-            // component has, independent of interleaved MCU blocking and such
-            int w = (z->img_comp[n].x + 7) >> 3;
-            int h = (z->img_comp[n].y + 7) >> 3;
-            for (j = 0; j < h; ++j) {
-                for (i = 0; i < w; ++i) {
-                    short* data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-                    if (z->spec_start == 0) {
-                        if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                            return 0;
+    else { // interleaved
+        int k, x, y;
+        // scan an interleaved mcu... process scan_n components in order
+        for (k = 0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y = 0; y < z->img_comp[n].v; ++y) {
+                for (x = 0; x < z->img_comp[n].h; ++x) {
+                    int x2 = (i * z->img_comp[n].h + x);
+                    int y2 = (j * z->img_comp[n].v + y);
+                    if (!z->progressive) {
+                        int ha = z->img_comp[n].ha;
+                        if (!stbi__jpeg_decode_block(z, block, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        if (stbi__jpeg_block_wanted(z, n, x2, y2))
+                            z->idct_block_kernel(z->img_comp[n].data + (z->img_comp[n].w2 * y2 + x2) * z->idct_size, z->img_comp[n].w2, block);
                     }
                     else {
-                        int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block_prog_ac(z, data, &z->huff_ac[ha], z->fast_ac[ha]))
+                        // interleaved progressive scans only ever carry DC
+                        short* data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
+                        if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
                             return 0;
                     }
-                    // every data block is an MCU, so countdown the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
-                    }
                 }
             }
-            return 1;
         }
-        else { // interleaved
-            int i, j, k, x, y;
-            for (j = 0; j < z->img_mcu_y; ++j) {
-                for (i = 0; i < z->img_mcu_x; ++i) {
-                    // scan an interleaved mcu... process scan_n components in order
-                    for (k = 0; k < z->scan_n; ++k) {
-                        int n = z->order[k];
-                        // scan out an mcu's worth of this component; that's just determined
-                        // by the basic H and V specified for the component
-                        for (y = 0; y < z->img_comp[n].v; ++y) {
-                            for (x = 0; x < z->img_comp[n].h; ++x) {
-                                int x2 = (i * z->img_comp[n].h + x);
-                                int y2 = (j * z->img_comp[n].v + y);
-                                short* data = z->img_comp[n].coeff + 64 * (x2 + y2 * z->img_comp[n].coeff_w);
-                                if (!stbi__jpeg_decode_block_prog_dc(z, data, &z->huff_dc[z->img_comp[n].hd], n))
-                                    return 0;
-                            }
-                        }
-                    }
-                    // after all interleaved components, that's an interleaved MCU,
-                    // so now count down the restart interval
-                    if (--z->todo <= 0) {
-                        if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                        if (!STBI__RESTART(z->marker)) return 1;
-                        stbi__jpeg_reset(z);
-                    }
-                }
+    }
+    return 1;
+}
+
+// decode a w*h MCU scan front to back
+static int stbi__jpeg_decode_scan_serial(stbi__jpeg* z, int w, int h)
+{
+    int i, j;
+    for (j = 0; j < h; ++j) {
+        for (i = 0; i < w; ++i) {
+            if (!stbi__jpeg_decode_mcu(z, i, j)) return 0;
+            // count down the restart interval
+            if (--z->todo <= 0) {
+                if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+                // if it's NOT a restart, then just bail, so we get corrupt data
+                // rather than no data
+                if (!STBI__RESTART(z->marker)) return 1;
+                stbi__jpeg_reset(z);
             }
-            return 1;
         }
     }
+    return 1;
+}
+
+#ifdef STBI_THREADS
+// restart markers reset the DC predictors and the bit reader, so each
+// restart interval can be entropy-decoded on its own. every MCU lands in its
+// own blocks of the component planes (or coefficient buffers), so the
+// intervals can be decoded concurrently into the shared buffers.
+typedef struct
+{
+    stbi__jpeg* z;
+    stbi_uc** start;  // first entropy-coded byte of each restart interval
+    stbi_uc* end;     // the marker that terminates the scan
+    int w, mcus, intervals, workers;
+    int failed[STBI__MAX_THREADS];  // one per worker, combined once they're done
+} stbi__jpeg_scan_mt;
+
+static void stbi__jpeg_decode_intervals(void* ctx, int worker)
+{
+    stbi__jpeg_scan_mt* m = (stbi__jpeg_scan_mt*)ctx;
+    stbi__context s;
+    stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+    int k;
+    if (j == NULL) { m->failed[worker] = 1; return; }
+    // private copy of the tables and bit reader state, shared output buffers
+    memcpy(j, m->z, sizeof(*j));
+    j->s = &s;
+    for (k = worker; k < m->intervals; k += m->workers) {
+        int mcu = k * j->restart_interval;
+        int last = mcu + j->restart_interval < m->mcus ? mcu + j->restart_interval : m->mcus;
+        stbi__start_mem(&s, m->start[k], (int)(m->end - m->start[k]));
+        stbi__jpeg_reset(j);
+        for (; mcu < last; ++mcu) {
+            if (!stbi__jpeg_decode_mcu(j, mcu % m->w, mcu / m->w)) {
+                m->failed[worker] = 1;
+                break;
+            }
+        }
+    }
+    STBI_FREE(j);
+}
+
+static int stbi__jpeg_decode_scan_parallel(stbi__jpeg* z, int w, int h)
+{
+    stbi__jpeg_scan_mt m;
+    stbi_uc* p = z->s->img_buffer;
+    stbi_uc* end = z->s->img_buffer_end;
+    int i, n = 0;
+
+    m.z = z;
+    m.w = w;
+    m.mcus = w * h;
+    m.intervals = (m.mcus + z->restart_interval - 1) / z->restart_interval;
+    m.workers = stbi__worker_count(m.intervals);
+    for (i = 0; i < STBI__MAX_THREADS; ++i)
+        m.failed[i] = 0;
+    if (m.workers < 2)
+        return stbi__jpeg_decode_scan_serial(z, w, h);
+
+    m.start = (stbi_uc**)stbi__malloc_mad2(m.intervals, sizeof(stbi_uc*), 0);
+    if (m.start == NULL)
+        return stbi__jpeg_decode_scan_serial(z, w, h);
+
+    // pre-scan for the RSTn markers; 0xff00 is a stuffed byte and runs of
+    // 0xff are fill, anything else ends the scan
+    m.start[n++] = p;
+    m.end = NULL;
+    while (p + 1 < end) {
+        p = (stbi_uc*)memchr(p, 0xff, end - p - 1);
+        if (p == NULL) break;
+        if (p[1] == 0x00 || p[1] == 0xff) {
+            p += p[1] ? 1 : 2;
+        }
+        else if (STBI__RESTART(p[1])) {
+            if (n == m.intervals) break;
+            p += 2;
+            m.start[n++] = p;
+        }
+        else {
+            m.end = p;
+            break;
+        }
+    }
+    // anything unexpected (missing or extra restarts, no terminating
+    // marker) goes to the serial decoder, which knows how to limp along
+    if (m.end == NULL || n != m.intervals) {
+        STBI_FREE(m.start);
+        return stbi__jpeg_decode_scan_serial(z, w, h);
+    }
+
+    stbi__parallel_for(stbi__jpeg_decode_intervals, &m, m.workers);
+    STBI_FREE(m.start);
+    for (i = 0; i < m.workers; ++i)
+        if (m.failed[i]) return stbi__err("bad huffman code", "Corrupt JPEG");
+
+    // leave the stream just past the terminating marker, as if we'd decoded serially
+    z->s->img_buffer = m.end + 2;
+    z->marker = m.end[1];
+    z->nomore = 1;
+    return 1;
+}
+#endif // STBI_THREADS
+
+static int stbi__parse_entropy_coded_data(stbi__jpeg* z)
+{
+    int w, h;
+    stbi__jpeg_reset(z);
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        // non-interleaved data, we just need to process one block at a time,
+        // in trivial scanline order
+        // number of blocks to do just depends on how many actual "pixels" this
+        // component has, independent of interleaved MCU blocking and such
+        w = (z->img_comp[n].x + 7) >> 3;
+        h = (z->img_comp[n].y + 7) >> 3;
+    }
+    else {
+        w = z->img_mcu_x;
+        h = z->img_mcu_y;
+    }
+#ifdef STBI_THREADS
+    // random access to the restart intervals needs the whole scan in memory
+    if (z->restart_interval && stbi__thread_count > 1 && z->s->io.read == NULL)
+        return stbi__jpeg_decode_scan_parallel(z, w, h);
+#endif
+    return stbi__jpeg_decode_scan_serial(z, w, h);
 }
 
 static void stbi__jpeg_dequantize(short* data, stbi__uint16* dequant)
@@ -2898,22 +4180,39 @@ static void stbi__jpeg_dequantize(short* data, stbi__uint16* dequant)
         data[i] *= dequant[i];
 }
 
+// dequantize and idct one row of blocks; rows are numbered through all the
+// components in turn, so each one is independent of the others
+static void stbi__jpeg_finish_row(void* ctx, int row)
+{
+    stbi__jpeg* z = (stbi__jpeg*)ctx;
+    int i, w, n = 0;
+    while (row >= ((z->img_comp[n].y + 7) >> 3))
+        row -= (z->img_comp[n++].y + 7) >> 3;
+    w = (z->img_comp[n].x + 7) >> 3;
+    if (row < z->img_comp[n].by0 || row >= z->img_comp[n].by1) return;
+    if (w > z->img_comp[n].bx1) w = z->img_comp[n].bx1;
+    for (i = z->img_comp[n].bx0; i < w; ++i) {
+        short* data = z->img_comp[n].coeff + 64 * (i + row * z->img_comp[n].coeff_w);
+        stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+        z->idct_block_kernel(z->img_comp[n].data + (z->img_comp[n].w2 * row + i) * z->idct_size, z->img_comp[n].w2, data);
+    }
+}
+
 static void stbi__jpeg_finish(stbi__jpeg* z)
 {
     if (z->progressive) {
         // dequantize and idct the data
-        int i, j, n;
-        for (n = 0; n < z->s->img_n; ++n) {
-            int w = (z->img_comp[n].x + 7) >> 3;
-            int h = (z->img_comp[n].y + 7) >> 3;
-            for (j = 0; j < h; ++j) {
-                for (i = 0; i < w; ++i) {
-                    short* data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-                    stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-                    z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2 * j * 8 + i * 8, z->img_comp[n].w2, data);
-                }
-            }
+        int j, n, rows = 0;
+        for (n = 0; n < z->s->img_n; ++n)
+            rows += (z->img_comp[n].y + 7) >> 3;
+#ifdef STBI_THREADS
+        if (stbi__thread_count > 1) {
+            stbi__parallel_for(stbi__jpeg_finish_row, z, rows);
+            return;
         }
+#endif
+        for (j = 0; j < rows; ++j)
+            stbi__jpeg_finish_row(z, j);
     }
 }
 
@@ -3142,9 +4441,10 @@ static int stbi__process_frame_header(stbi__jpeg* z, int scan)
         // discard the extra data until colorspace conversion
         //
         // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
-        // so these muls can't overflow with 32-bit ints (which we require)
-        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+        // so these muls can't overflow with 32-bit ints (which we require).
+        // when scaling, each block only produces idct_size^2 pixels
+        z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->idct_size;
+        z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->idct_size;
         z->img_comp[i].coeff = 0;
         z->img_comp[i].raw_coeff = 0;
         z->img_comp[i].linebuf = NULL;
@@ -3154,14 +4454,35 @@ static int stbi__process_frame_header(stbi__jpeg* z, int scan)
         // align blocks for idct using mmx/sse
         z->img_comp[i].data = (stbi_uc*)(((size_t)z->img_comp[i].raw_data + 15) & ~15);
         if (z->progressive) {
-            // w2, h2 are multiples of 8 (see above)
-            z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-            z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-            z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+            // w2, h2 are multiples of idct_size (see above)
+            z->img_comp[i].coeff_w = z->img_comp[i].w2 / z->idct_size;
+            z->img_comp[i].coeff_h = z->img_comp[i].h2 / z->idct_size;
+            z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 64, z->img_comp[i].coeff_h, sizeof(short), 15);
             if (z->img_comp[i].raw_coeff == NULL)
                 return stbi__free_jpeg_components(z, i + 1, stbi__err("outofmem", "Out of memory"));
             z->img_comp[i].coeff = (short*)(((size_t)z->img_comp[i].raw_coeff + 15) & ~15);
         }
+        z->img_comp[i].bx0 = z->img_comp[i].by0 = 0;
+        z->img_comp[i].bx1 = z->img_comp[i].by1 = INT_MAX;
+    }
+
+    if (s->region == STBI__REGION_requested) {
+        // decoding a region: only the blocks under it, plus the one pixel
+        // border the upsamplers read, need an idct. the region is in output
+        // pixels, which are smaller when scaling
+        int out_w = (s->img_x * z->idct_size + 7) >> 3;
+        int out_h = (s->img_y * z->idct_size + 7) >> 3;
+        if (!stbi__clip_region(s, out_w, out_h, stbi__vertically_flip_on_load))
+            return stbi__free_jpeg_components(z, s->img_n, 0);
+        for (i = 0; i < s->img_n; ++i) {
+            int hs = h_max / z->img_comp[i].h, vs = v_max / z->img_comp[i].v;
+            int x0 = s->region_x / hs - 1, x1 = (s->region_x + s->region_w - 1) / hs + 2;
+            int y0 = s->region_y / vs - 1, y1 = (s->region_y + s->region_h - 1) / vs + 2;
+            z->img_comp[i].bx0 = x0 < 0 ? 0 : x0 / z->idct_size;
+            z->img_comp[i].by0 = y0 < 0 ? 0 : y0 / z->idct_size;
+            z->img_comp[i].bx1 = (x1 + z->idct_size - 1) / z->idct_size;
+            z->img_comp[i].by1 = (y1 + z->idct_size - 1) / z->idct_size;
+        }
     }
 
     return 1;
@@ -3214,7 +4535,11 @@ static int stbi__decode_jpeg_image(stbi__jpeg* j)
     while (!stbi__EOI(m)) {
         if (stbi__SOS(m)) {
             if (!stbi__process_scan_header(j)) return 0;
+            // baseline scans IDCT each block as it's decoded, so this
+            // includes their IDCT; progressive ones leave it to finish
+            STBI_PROFILE_BEGIN(entropy);
             if (!stbi__parse_entropy_coded_data(j)) return 0;
+            STBI_PROFILE_END(entropy);
             if (j->marker == STBI__MARKER_none) {
                 // handle 0s at the end of image data from IP Kamera 9060
                 while (!stbi__at_eof(j->s)) {
@@ -3238,8 +4563,11 @@ static int stbi__decode_jpeg_image(stbi__jpeg* j)
         }
         m = stbi__get_marker(j);
     }
-    if (j->progressive)
+    if (j->progressive) {
+        STBI_PROFILE_BEGIN(idct);
         stbi__jpeg_finish(j);
+        STBI_PROFILE_END(idct);
+    }
     return 1;
 }
 
@@ -3634,6 +4962,11 @@ static void stbi__setup_jpeg(stbi__jpeg* j)
     j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
     j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+    j->idct_size = 8 / stbi__jpeg_scale;
+    if (j->idct_size == 4) j->idct_block_kernel = stbi__idct_block_4x4;
+    if (j->idct_size == 2) j->idct_block_kernel = stbi__idct_block_2x2;
+    if (j->idct_size == 1) j->idct_block_kernel = stbi__idct_block_1x1;
 }
 
 // clean up the temporary component buffers
@@ -3659,186 +4992,453 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
     return (stbi_uc)((t + (t >> 8)) >> 8);
 }
 
-static stbi_uc* load_jpeg_image(stbi__jpeg* z, int* out_x, int* out_y, int* comp, int req_comp)
+typedef struct
 {
+    stbi__jpeg* z;
+    stbi_uc* output;            // receives rows [first_row,end_row), columns [x0,x0+out_w)
+    unsigned int first_row, end_row;
+    unsigned int x0, out_w;
+    int flip;                   // store the rows bottom-up
+    stbi__resample res_comp[4]; // resampler state for output row 0
+    stbi_uc* scratch;           // one spare output row per band, if needed
     int n, decode_n, is_rgb;
-    z->s->img_n = 0; // make stbi__cleanup_jpeg safe
-
-    // validate req_comp
-    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
-
-    // load a jpeg image from whichever source, but leave in YCbCr format
-    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
-
-    // determine actual number of components to generate
-    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
-
-    is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
-
-    if (z->s->img_n == 3 && n < 3 && !is_rgb)
-        decode_n = 1;
-    else
-        decode_n = z->s->img_n;
-
-    // resample and color-convert
-    {
-        int k;
-        unsigned int i, j;
-        stbi_uc* output;
-        stbi_uc* coutput[4] = { NULL, NULL, NULL, NULL };
-
-        stbi__resample res_comp[4];
-
+    int bands;                  // bands converted at once, each with own line buffers
+    unsigned int band_rows;
+} stbi__jpeg_convert;
+
+// step a resampler on to the next output row
+static void stbi__resample_next_row(stbi__resample* r, int comp_y, int w2)
+{
+    if (++r->ystep >= r->vs) {
+        r->ystep = 0;
+        r->line0 = r->line1;
+        if (++r->ypos < comp_y)
+            r->line1 += w2;
+    }
+}
+
+// resample and color-convert one band of output rows, counting bands from
+// first_row. each band has its own line buffers and resampler state, so bands
+// can be converted in any order
+static void stbi__jpeg_convert_band(void* ctx, int band)
+{
+    stbi__jpeg_convert* c = (stbi__jpeg_convert*)ctx;
+    stbi__jpeg* z = c->z;
+    int k, n = c->n, decode_n = c->decode_n, is_rgb = c->is_rgb;
+    unsigned int i, j, w = c->out_w;
+    unsigned int j0 = c->first_row + band * c->band_rows;
+    unsigned int j1 = j0 + c->band_rows < c->end_row ? j0 + c->band_rows : c->end_row;
+    stbi_uc* coutput[4] = { NULL, NULL, NULL, NULL };
+    stbi_uc* linebuf[4];
+    stbi__resample res_comp[4];
+    int cx0[4], cw[4], coff[4];
+
+    for (k = 0; k < decode_n; ++k) {
+        stbi__resample* r = &res_comp[k];
+        int cx1;
+        res_comp[k] = c->res_comp[k];
+        // the upsamplers read one pixel either side of each one they expand,
+        // so run them from one pixel before the wanted columns to one after
+        cx0[k] = (int)c->x0 / r->hs - 1;
+        if (cx0[k] < 0) cx0[k] = 0;
+        cx1 = (int)(c->x0 + w - 1) / r->hs + 2;
+        if (cx1 > r->w_lores) cx1 = r->w_lores;
+        cw[k] = cx1 - cx0[k];
+        coff[k] = c->x0 - cx0[k] * r->hs;
+        linebuf[k] = z->img_comp[k].linebuf + band * (z->s->img_x + 3);
+        // skip the resampler ahead to the first row of this band
+        for (j = 0; j < j0; ++j)
+            stbi__resample_next_row(&res_comp[k], z->img_comp[k].y, z->img_comp[k].w2);
+    }
+
+    for (j = j0; j < j1; ++j) {
+        stbi_uc* dest = c->output + n * w * (c->flip ? c->end_row - 1 - j : j - c->first_row);
+        stbi_uc* row = dest;
+        stbi_uc* out;
+        stbi_uc keep = 0;
+        // 3-channel rows get a 4th byte stored past their last pixel, which
+        // lands on the row converted next, or when flipping, the one before.
+        // build the rows whose row there is in another band on the side,
+        // and put the byte back for the rest when flipping
+        if (c->scratch && (c->flip ? j == j0 && j0 > c->first_row : j + 1 == j1 && j1 < c->end_row))
+            row = c->scratch + band * (n * w + 1);
+        else if (n == 3 && c->flip && j > c->first_row)
+            keep = dest[n * w];
+        out = row;
         for (k = 0; k < decode_n; ++k) {
             stbi__resample* r = &res_comp[k];
-
-            // allocate line buffer big enough for upsampling off the edges
-            // with upsample factor of 4
-            z->img_comp[k].linebuf = (stbi_uc*)stbi__malloc(z->s->img_x + 3);
-            if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-            r->hs = z->img_h_max / z->img_comp[k].h;
-            r->vs = z->img_v_max / z->img_comp[k].v;
-            r->ystep = r->vs >> 1;
-            r->w_lores = (z->s->img_x + r->hs - 1) / r->hs;
-            r->ypos = 0;
-            r->line0 = r->line1 = z->img_comp[k].data;
-
-            if (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-            else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-            else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-            else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-            else                               r->resample = stbi__resample_row_generic;
-        }
-
-        // can't error after this so, this is safe
-        output = (stbi_uc*)stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-        if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-        // now go ahead and resample
-        for (j = 0; j < z->s->img_y; ++j) {
-            stbi_uc* out = output + n * z->s->img_x * j;
-            for (k = 0; k < decode_n; ++k) {
-                stbi__resample* r = &res_comp[k];
-                int y_bot = r->ystep >= (r->vs >> 1);
-                coutput[k] = r->resample(z->img_comp[k].linebuf,
-                    y_bot ? r->line1 : r->line0,
-                    y_bot ? r->line0 : r->line1,
-                    r->w_lores, r->hs);
-                if (++r->ystep >= r->vs) {
-                    r->ystep = 0;
-                    r->line0 = r->line1;
-                    if (++r->ypos < z->img_comp[k].y)
-                        r->line1 += z->img_comp[k].w2;
-                }
-            }
-            if (n >= 3) {
-                stbi_uc* y = coutput[0];
-                if (z->s->img_n == 3) {
-                    if (is_rgb) {
-                        for (i = 0; i < z->s->img_x; ++i) {
-                            out[0] = y[i];
-                            out[1] = coutput[1][i];
-                            out[2] = coutput[2][i];
-                            out[3] = 255;
-                            out += n;
-                        }
-                    }
-                    else {
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            int y_bot = r->ystep >= (r->vs >> 1);
+            coutput[k] = r->resample(linebuf[k],
+                (y_bot ? r->line1 : r->line0) + cx0[k],
+                (y_bot ? r->line0 : r->line1) + cx0[k],
+                cw[k], r->hs) + coff[k];
+            stbi__resample_next_row(r, z->img_comp[k].y, z->img_comp[k].w2);
+        }
+        if (n >= 3) {
+            stbi_uc* y = coutput[0];
+            if (z->s->img_n == 3) {
+                if (is_rgb) {
+                    for (i = 0; i < w; ++i) {
+                        out[0] = y[i];
+                        out[1] = coutput[1][i];
+                        out[2] = coutput[2][i];
+                        out[3] = 255;
+                        out += n;
                     }
                 }
-                else if (z->s->img_n == 4) {
-                    if (z->app14_color_transform == 0) { // CMYK
-                        for (i = 0; i < z->s->img_x; ++i) {
-                            stbi_uc m = coutput[3][i];
-                            out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                            out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                            out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                            out[3] = 255;
-                            out += n;
-                        }
-                    }
-                    else if (z->app14_color_transform == 2) { // YCCK
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                        for (i = 0; i < z->s->img_x; ++i) {
-                            stbi_uc m = coutput[3][i];
-                            out[0] = stbi__blinn_8x8(255 - out[0], m);
-                            out[1] = stbi__blinn_8x8(255 - out[1], m);
-                            out[2] = stbi__blinn_8x8(255 - out[2], m);
-                            out += n;
-                        }
-                    }
-                    else { // YCbCr + alpha?  Ignore the fourth channel for now
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                    }
+                else {
+                    z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
                 }
-                else
-                    for (i = 0; i < z->s->img_x; ++i) {
-                        out[0] = out[1] = out[2] = y[i];
-                        out[3] = 255; // not used if n==3
-                        out += n;
-                    }
             }
-            else {
-                if (is_rgb) {
-                    if (n == 1)
-                        for (i = 0; i < z->s->img_x; ++i)
-                            *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                    else {
-                        for (i = 0; i < z->s->img_x; ++i, out += 2) {
-                            out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                            out[1] = 255;
-                        }
+            else if (z->s->img_n == 4) {
+                if (z->app14_color_transform == 0) { // CMYK
+                    for (i = 0; i < w; ++i) {
+                        stbi_uc m = coutput[3][i];
+                        out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                        out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                        out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                        out[3] = 255;
+                        out += n;
                     }
                 }
-                else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-                    for (i = 0; i < z->s->img_x; ++i) {
+                else if (z->app14_color_transform == 2) { // YCCK
+                    z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
+                    for (i = 0; i < w; ++i) {
                         stbi_uc m = coutput[3][i];
-                        stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                        stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                        stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                        out[0] = stbi__compute_y(r, g, b);
-                        out[1] = 255;
+                        out[0] = stbi__blinn_8x8(255 - out[0], m);
+                        out[1] = stbi__blinn_8x8(255 - out[1], m);
+                        out[2] = stbi__blinn_8x8(255 - out[2], m);
                         out += n;
                     }
                 }
-                else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-                    for (i = 0; i < z->s->img_x; ++i) {
-                        out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+                else { // YCbCr + alpha?  Ignore the fourth channel for now
+                    z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], w, n);
+                }
+            }
+            else
+                for (i = 0; i < w; ++i) {
+                    out[0] = out[1] = out[2] = y[i];
+                    out[3] = 255; // not used if n==3
+                    out += n;
+                }
+        }
+        else {
+            if (is_rgb) {
+                if (n == 1)
+                    for (i = 0; i < w; ++i)
+                        *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                else {
+                    for (i = 0; i < w; ++i, out += 2) {
+                        out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
                         out[1] = 255;
-                        out += n;
                     }
                 }
-                else {
-                    stbi_uc* y = coutput[0];
-                    if (n == 1)
-                        for (i = 0; i < z->s->img_x; ++i) out[i] = y[i];
-                    else
-                        for (i = 0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+            }
+            else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+                for (i = 0; i < w; ++i) {
+                    stbi_uc m = coutput[3][i];
+                    stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+                    stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+                    stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+                    out[0] = stbi__compute_y(r, g, b);
+                    out[1] = 255;
+                    out += n;
+                }
+            }
+            else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+                for (i = 0; i < w; ++i) {
+                    out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+                    out[1] = 255;
+                    out += n;
                 }
             }
+            else {
+                stbi_uc* y = coutput[0];
+                if (n == 1)
+                    for (i = 0; i < w; ++i) out[i] = y[i];
+                else
+                    for (i = 0; i < w; ++i) { *out++ = y[i]; *out++ = 255; }
+            }
         }
-        stbi__cleanup_jpeg(z);
-        *out_x = z->s->img_x;
-        *out_y = z->s->img_y;
-        if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-        return output;
+        if (row != dest)
+            memcpy(dest, row, n * w);
+        else if (n == 3 && c->flip && j > c->first_row)
+            dest[n * w] = keep;
+    }
+}
+
+// convert rows [c->first_row,c->end_row) into c->output
+static void stbi__jpeg_convert_rows(stbi__jpeg_convert* c)
+{
+    int band, bands = (int)((c->end_row - c->first_row + c->band_rows - 1) / c->band_rows);
+#ifdef STBI_THREADS
+    if (bands > 1) {
+        stbi__parallel_for(stbi__jpeg_convert_band, c, bands);
+        return;
+    }
+#endif
+    for (band = 0; band < bands; ++band)
+        stbi__jpeg_convert_band(c, band);
+}
+
+// decode the image into its component planes, leaving it in YCbCr format,
+// and size img_x/img_y and the components to match them. cleans up the jpeg
+// on failure
+static int stbi__jpeg_decode_planes(stbi__jpeg* z)
+{
+    int k;
+    z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+    // load a jpeg image from whichever source, but leave in YCbCr format
+    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return 0; }
+
+    // progressive coefficients have all been through the idct by now
+    for (k = 0; k < z->s->img_n; ++k) {
+        if (z->img_comp[k].raw_coeff) {
+            STBI_FREE(z->img_comp[k].raw_coeff);
+            z->img_comp[k].raw_coeff = 0;
+            z->img_comp[k].coeff = 0;
+        }
+    }
+
+    // a scaled decode left smaller planes behind; size everything from here
+    // on to match them, rounding up like the full-size case does
+    if (z->idct_size < 8) {
+        z->s->img_x = (z->s->img_x * z->idct_size + 7) >> 3;
+        z->s->img_y = (z->s->img_y * z->idct_size + 7) >> 3;
+        for (k = 0; k < z->s->img_n; ++k) {
+            z->img_comp[k].x = (z->s->img_x * z->img_comp[k].h + z->img_h_max - 1) / z->img_h_max;
+            z->img_comp[k].y = (z->s->img_y * z->img_comp[k].v + z->img_v_max - 1) / z->img_v_max;
+        }
+    }
+    return 1;
+}
+
+// whether a 3-component image is stored as RGB rather than YCbCr
+static int stbi__jpeg_is_rgb(stbi__jpeg* z)
+{
+    return z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+}
+
+// decode the image, leaving it in YCbCr format, and set up the resamplers
+// and line buffers to convert it in up to c->bands bands at a time, none of
+// them shorter than min_band_rows. cleans up the jpeg on failure
+static int stbi__jpeg_prepare_convert(stbi__jpeg* z, stbi__jpeg_convert* c, int req_comp, int min_band_rows)
+{
+    int k, n, decode_n, is_rgb;
+
+    // validate req_comp
+    if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+
+    if (!stbi__jpeg_decode_planes(z)) return 0;
+
+    // determine actual number of components to generate
+    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+
+    is_rgb = stbi__jpeg_is_rgb(z);
+
+    if (z->s->img_n == 3 && n < 3 && !is_rgb)
+        decode_n = 1;
+    else
+        decode_n = z->s->img_n;
+
+    c->bands = 1;
+#ifdef STBI_THREADS
+    // one band per thread
+    if (stbi__thread_count > 1)
+        c->bands = stbi__worker_count(z->s->img_y / min_band_rows);
+#else
+    STBI_NOTUSED(min_band_rows);
+#endif
+
+    for (k = 0; k < decode_n; ++k) {
+        stbi__resample* r = &c->res_comp[k];
+
+        // allocate line buffer big enough for upsampling off the edges
+        // with upsample factor of 4, one per band
+        z->img_comp[k].linebuf = (stbi_uc*)stbi__malloc_mad2(c->bands, z->s->img_x + 3, 0);
+        if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__err("outofmem", "Out of memory"); }
+
+        r->hs = z->img_h_max / z->img_comp[k].h;
+        r->vs = z->img_v_max / z->img_comp[k].v;
+        r->ystep = r->vs >> 1;
+        r->w_lores = (z->s->img_x + r->hs - 1) / r->hs;
+        r->ypos = 0;
+        r->line0 = r->line1 = z->img_comp[k].data;
+
+        if (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+        else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+        else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+        else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+        else                               r->resample = stbi__resample_row_generic;
+    }
+
+    c->flip = 0;
+    c->scratch = NULL;
+    if (c->bands > 1 && n == 3) {
+        c->scratch = (stbi_uc*)stbi__malloc_mad3(c->bands, n, z->s->img_x, c->bands);
+        if (!c->scratch) { stbi__cleanup_jpeg(z); return stbi__err("outofmem", "Out of memory"); }
     }
+
+    c->z = z;
+    c->n = n;
+    c->decode_n = decode_n;
+    c->is_rgb = is_rgb;
+    return 1;
+}
+
+static stbi_uc* load_jpeg_image(stbi__jpeg* z, int* out_x, int* out_y, int* comp, int req_comp, int flip)
+{
+    stbi__jpeg_convert c;
+    stbi_uc* output;
+
+    // bands of at least 32 rows
+    if (!stbi__jpeg_prepare_convert(z, &c, req_comp, 32)) return NULL;
+
+    c.x0 = 0;
+    c.out_w = z->s->img_x;
+    c.first_row = 0;
+    c.end_row = z->s->img_y;
+    if (z->s->region == STBI__REGION_clipped) {
+        // only convert the region; stbi__process_frame_header clipped it
+        c.x0 = z->s->region_x;
+        c.out_w = z->s->region_w;
+        c.first_row = z->s->region_y;
+        c.end_row = z->s->region_y + z->s->region_h;
+    }
+    c.flip = flip;
+
+    // can't error after this so, this is safe
+    output = (stbi_uc*)stbi__malloc_mad3(c.n, c.out_w, c.end_row - c.first_row, 1);
+    if (!output) { STBI_FREE(c.scratch); stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
+
+    // now go ahead and resample
+    c.output = output;
+    c.band_rows = (c.end_row - c.first_row + c.bands - 1) / c.bands;
+    STBI_PROFILE_BEGIN(color);
+    stbi__jpeg_convert_rows(&c);
+    STBI_PROFILE_END(color);
+
+    STBI_FREE(c.scratch);
+    stbi__cleanup_jpeg(z);
+    *out_x = c.out_w;
+    *out_y = c.end_row - c.first_row;
+    if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+    return output;
 }
 
 static void* stbi__jpeg_load(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi__result_info* ri)
 {
     unsigned char* result;
     stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
-    STBI_NOTUSED(ri);
     j->s = s;
     stbi__setup_jpeg(j);
-    result = load_jpeg_image(j, x, y, comp, req_comp);
+    // store the rows bottom-up while converting them, rather than flip after
+    ri->flipped = stbi__vertically_flip_on_load;
+    result = load_jpeg_image(j, x, y, comp, req_comp, ri->flipped);
     STBI_FREE(j);
     return result;
 }
 
+// like stbi__jpeg_load, but only ever holds STBI__ROWS_PER_BAND rows per
+// thread of output, handing each band to the callback as soon as it's done
+static int stbi__jpeg_load_rows(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi_rows_callback callback, void* user)
+{
+    stbi__jpeg_convert c;
+    stbi_uc* buffer;
+    unsigned int step, y0, y1;
+    int ok = 1;
+    stbi__jpeg* z = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+    if (!z) return stbi__err("outofmem", "Out of memory");
+    z->s = s;
+    stbi__setup_jpeg(z);
+    if (!stbi__jpeg_prepare_convert(z, &c, req_comp, STBI__ROWS_PER_BAND)) { STBI_FREE(z); return 0; }
+
+    c.band_rows = STBI__ROWS_PER_BAND;
+    step = c.bands * c.band_rows;
+    buffer = (stbi_uc*)stbi__malloc_mad3(c.n, z->s->img_x, step, 1);
+    if (!buffer) {
+        STBI_FREE(c.scratch);
+        stbi__cleanup_jpeg(z);
+        STBI_FREE(z);
+        return stbi__err("outofmem", "Out of memory");
+    }
+
+    *x = z->s->img_x;
+    *y = z->s->img_y;
+    if (comp) *comp = z->s->img_n >= 3 ? 3 : 1;
+
+    c.output = buffer;
+    c.x0 = 0;
+    c.out_w = z->s->img_x;
+    c.flip = stbi__vertically_flip_on_load;
+    for (y0 = 0; ok && y0 < z->s->img_y; y0 += step) {
+        y1 = y0 + step < z->s->img_y ? y0 + step : z->s->img_y;
+        // when flipping, output rows y0..y1 are the image's last rows, which
+        // the converter stores bottom-up
+        c.first_row = stbi__vertically_flip_on_load ? z->s->img_y - y1 : y0;
+        c.end_row = c.first_row + (y1 - y0);
+        STBI_PROFILE_BEGIN(color);
+        stbi__jpeg_convert_rows(&c);
+        STBI_PROFILE_END(color);
+        if (!callback(user, y0, y1 - y0, buffer))
+            ok = stbi__err("stopped", "Row callback stopped the load");
+    }
+
+    STBI_FREE(buffer);
+    STBI_FREE(c.scratch);
+    stbi__cleanup_jpeg(z);
+    STBI_FREE(z);
+    return ok;
+}
+
+// hand back the decoded planes themselves, cropped to their real size
+static int stbi__jpeg_load_planes(stbi__context* s, int* x, int* y, stbi_planes* planes)
+{
+    int k, j, total = 0;
+    stbi_uc* data;
+    stbi__jpeg* z = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+    if (!z) return stbi__err("outofmem", "Out of memory");
+    z->s = s;
+    stbi__setup_jpeg(z);
+    if (!stbi__jpeg_decode_planes(z)) { STBI_FREE(z); return 0; }
+    if (z->s->img_n == 4 || stbi__jpeg_is_rgb(z)) {
+        stbi__cleanup_jpeg(z);
+        STBI_FREE(z);
+        return stbi__err("not YCbCr", "Only YCbCr and grayscale JPEGs can be loaded as planes");
+    }
+
+    // the component sizes are bounded by the (validated) image size
+    for (k = 0; k < z->s->img_n; ++k)
+        total += z->img_comp[k].x * z->img_comp[k].y;
+    data = (stbi_uc*)stbi__malloc(total);
+    if (!data) {
+        stbi__cleanup_jpeg(z);
+        STBI_FREE(z);
+        return stbi__err("outofmem", "Out of memory");
+    }
+
+    memset(planes, 0, sizeof(*planes));
+    planes->count = z->s->img_n;
+    for (k = 0; k < z->s->img_n; ++k) {
+        int w = z->img_comp[k].x, h = z->img_comp[k].y;
+        planes->w[k] = w;
+        planes->h[k] = h;
+        planes->data[k] = data;
+        for (j = 0; j < h; ++j) {
+            int src = stbi__vertically_flip_on_load ? h - 1 - j : j;
+            memcpy(data + (size_t)j * w, z->img_comp[k].data + (size_t)src * z->img_comp[k].w2, w);
+        }
+        data += (size_t)w * h;
+    }
+
+    *x = z->s->img_x;
+    *y = z->s->img_y;
+    stbi__cleanup_jpeg(z);
+    STBI_FREE(z);
+    return 1;
+}
+
 static int stbi__jpeg_test(stbi__context* s)
 {
     int r;
@@ -3979,6 +5579,8 @@ typedef struct
     char* zout_start;
     char* zout_end;
     int   z_expandable;
+    int   z_truncate; // 1: stop once the fixed buffer is full; 2: stopped
+
 
     stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
@@ -4045,6 +5647,10 @@ static int stbi__zexpand(stbi__zbuf* z, char* zout, int n)  // need to make room
     char* q;
     int cur, limit, old_limit;
     z->zout = zout;
+    if (z->z_truncate) {
+        z->z_truncate = 2;
+        return 0;
+    }
     if (!z->z_expandable) return stbi__err("output buffer limit", "Corrupt PNG");
     cur = (int)(z->zout - z->zout_start);
     limit = old_limit = (int)(z->zout_end - z->zout_start);
@@ -4101,11 +5707,17 @@ static int stbi__parse_huffman_block(stbi__zbuf* a)
             dist = stbi__zdist_base[z];
             if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
             if (zout - a->zout_start < dist) return stbi__err("bad dist", "Corrupt PNG");
+            p = (stbi_uc*)(zout - dist);
             if (zout + len > a->zout_end) {
+                if (a->z_truncate) {
+                    // keep the part of the match that fits, then stop
+                    while (zout < a->zout_end) *zout++ = *p++;
+                    return stbi__zexpand(a, zout, len);
+                }
                 if (!stbi__zexpand(a, zout, len)) return 0;
                 zout = a->zout;
+                p = (stbi_uc*)(zout - dist);
             }
-            p = (stbi_uc*)(zout - dist);
             if (dist == 1) { // run of one byte; common in images.
                 stbi_uc v = *p;
                 if (len) { do *zout++ = v; while (--len); }
@@ -4188,8 +5800,15 @@ static int stbi__parse_uncompressed_block(stbi__zbuf* a)
     nlen = header[3] * 256 + header[2];
     if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt", "Corrupt PNG");
     if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer", "Corrupt PNG");
-    if (a->zout + len > a->zout_end)
+    if (a->zout + len > a->zout_end) {
+        if (a->z_truncate) {
+            // keep the part of the block that fits, then stop
+            k = (int)(a->zout_end - a->zout);
+            memcpy(a->zout, a->zbuffer, k);
+            return stbi__zexpand(a, a->zout + k, len);
+        }
         if (!stbi__zexpand(a, a->zout, len)) return 0;
+    }
     memcpy(a->zout, a->zbuffer, len);
     a->zbuffer += len;
     a->zout += len;
@@ -4275,10 +5894,35 @@ static int stbi__do_zlib(stbi__zbuf* a, char* obuf, int olen, int exp, int parse
     a->zout = obuf;
     a->zout_end = obuf + olen;
     a->z_expandable = exp;
+    a->z_truncate = 0;
 
     return stbi__parse_zlib(a, parse_header);
 }
 
+// inflate just the first out_len bytes of the stream (or all of it, if
+// shorter), for callers that know they need no more
+static char* stbi__zlib_decode_prefix(const char* buffer, int len, int out_len, int* outlen, int parse_header)
+{
+    stbi__zbuf a;
+    char* p = (char*)stbi__malloc(out_len);
+    if (p == NULL) return NULL;
+    a.zbuffer = (stbi_uc*)buffer;
+    a.zbuffer_end = (stbi_uc*)buffer + len;
+    a.zout_start = p;
+    a.zout = p;
+    a.zout_end = p + out_len;
+    a.z_expandable = 0;
+    a.z_truncate = 1;
+    if (stbi__parse_zlib(&a, parse_header) || a.z_truncate == 2) {
+        *outlen = (int)(a.zout - a.zout_start);
+        return p;
+    }
+    else {
+        STBI_FREE(p);
+        return NULL;
+    }
+}
+
 STBIDEF char* stbi_zlib_decode_malloc_guesssize(const char* buffer, int len, int initial_size, int* outlen)
 {
     stbi__zbuf a;
@@ -4397,6 +6041,7 @@ typedef struct
     stbi__context* s;
     stbi_uc* idata, * expanded, * out;
     int depth;
+    int flipped; // out was unfiltered bottom-up, for stbi__vertically_flip_on_load
 } stbi__png;
 
 
@@ -4434,7 +6079,8 @@ static int stbi__paeth(int a, int b, int c)
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png* a, stbi_uc* raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// with flip, stores the rows bottom-up
+static int stbi__create_png_image_raw(stbi__png* a, stbi_uc* raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, int flip)
 {
     int bytes = (depth == 16 ? 2 : 1);
     stbi__context* s = a->s;
@@ -4461,7 +6107,8 @@ static int stbi__create_png_image_raw(stbi__png* a, stbi_uc* raw, stbi__uint32 r
     if (raw_len < img_len) return stbi__err("not enough pixels", "Corrupt PNG");
 
     for (j = 0; j < y; ++j) {
-        stbi_uc* cur = a->out + stride * j;
+        stbi_uc* row = a->out + stride * (flip ? y - 1 - j : j);
+        stbi_uc* cur = row;
         stbi_uc* prior;
         int filter = *raw++;
 
@@ -4474,7 +6121,7 @@ static int stbi__create_png_image_raw(stbi__png* a, stbi_uc* raw, stbi__uint32 r
             filter_bytes = 1;
             width = img_width_bytes;
         }
-        prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+        prior = flip ? cur + stride : cur - stride; // bugfix: need to compute this after 'cur +=' computation above
 
         // if first row, use special filter that doesn't sample previous row
         if (j == 0) filter = first_row_filter[filter];
@@ -4553,7 +6200,7 @@ static int stbi__create_png_image_raw(stbi__png* a, stbi_uc* raw, stbi__uint32 r
             // the loop above sets the high byte of the pixels' alpha, but for
             // 16 bit png files we also need the low byte set. we'll do that here.
             if (depth == 16) {
-                cur = a->out + stride * j; // start at the beginning of the row again
+                cur = row; // start at the beginning of the row again
                 for (i = 0; i < x; ++i, cur += output_bytes) {
                     cur[filter_bytes + 1] = 255;
                 }
@@ -4659,8 +6306,12 @@ static int stbi__create_png_image(stbi__png* a, stbi_uc* image_data, stbi__uint3
     int out_bytes = out_n * bytes;
     stbi_uc* final;
     int p;
-    if (!interlaced)
-        return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+    a->flipped = 0;
+    if (!interlaced) {
+        // unfilter straight into flipped rows, unless a region crop follows
+        a->flipped = stbi__vertically_flip_on_load && a->s->region != STBI__REGION_clipped;
+        return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, a->flipped);
+    }
 
     // de-interlacing
     final = (stbi_uc*)stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
@@ -4675,7 +6326,7 @@ static int stbi__create_png_image(stbi__png* a, stbi_uc* image_data, stbi__uint3
         y = (a->s->img_y - yorig[p] + yspc[p] - 1) / yspc[p];
         if (x && y) {
             stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1)* y;
-            if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
+            if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, 0)) {
                 STBI_FREE(final);
                 return 0;
             }
@@ -4760,22 +6411,19 @@ static int stbi__expand_png_palette(stbi__png* a, stbi_uc* palette, int len, int
     // between here and free(out) below, exitting would leak
     temp_out = p;
 
+    // palette entries are 4 bytes, so copy each as one word
     if (pal_img_n == 3) {
-        for (i = 0; i < pixel_count; ++i) {
-            int n = orig[i] * 4;
-            p[0] = palette[n];
-            p[1] = palette[n + 1];
-            p[2] = palette[n + 2];
+        // the word's 4th byte is overwritten by the next pixel, but the last
+        // pixel would write it past the end
+        for (i = 0; i + 1 < pixel_count; ++i) {
+            memcpy(p, palette + orig[i] * 4, 4);
             p += 3;
         }
+        memcpy(p, palette + orig[i] * 4, 3);
     }
     else {
         for (i = 0; i < pixel_count; ++i) {
-            int n = orig[i] * 4;
-            p[0] = palette[n];
-            p[1] = palette[n + 1];
-            p[2] = palette[n + 2];
-            p[3] = palette[n + 3];
+            memcpy(p, palette + orig[i] * 4, 4);
             p += 4;
         }
     }
@@ -4969,14 +6617,34 @@ static int stbi__parse_png_file(stbi__png* z, int scan, int req_comp)
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc*)stbi_zlib_decode_malloc_guesssize_headerflag((char*)z->idata, ioff, raw_len, (int*)&raw_len, !is_iphone);
+            STBI_PROFILE_BEGIN(inflate);
+            if (s->region == STBI__REGION_requested && !interlace) {
+                // only inflate and unfilter down to the last row the region needs
+                stbi__uint32 row_bytes = ((s->img_x * z->depth * s->img_n + 7) >> 3) + 1;
+                if (!stbi__clip_region(s, s->img_x, s->img_y, stbi__vertically_flip_on_load)) return 0;
+                s->img_y = s->region_y + s->region_h;
+                if (!stbi__mul2sizes_valid(row_bytes, s->img_y)) return stbi__err("too large", "Corrupt PNG");
+                raw_len = row_bytes * s->img_y;
+                z->expanded = (stbi_uc*)stbi__zlib_decode_prefix((char*)z->idata, ioff, raw_len, (int*)&raw_len, !is_iphone);
+            }
+            else
+                z->expanded = (stbi_uc*)stbi_zlib_decode_malloc_guesssize_headerflag((char*)z->idata, ioff, raw_len, (int*)&raw_len, !is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
+            STBI_PROFILE_END(inflate);
             STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n + 1 && req_comp != 3 && !pal_img_n) || has_trans)
                 s->img_out_n = s->img_n + 1;
             else
                 s->img_out_n = s->img_n;
+            STBI_PROFILE_BEGIN(unfilter);
             if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            STBI_PROFILE_END(unfilter);
+            if (s->region == STBI__REGION_clipped) {
+                // the rest of the pipeline only sees the region
+                stbi__crop_to_region(s, z->out, s->img_x, s->img_out_n * (z->depth == 16 ? 2 : 1));
+                s->img_x = s->region_w;
+                s->img_y = s->region_h;
+            }
             if (has_trans) {
                 if (z->depth == 16) {
                     if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -5036,11 +6704,12 @@ static void* stbi__do_png(stbi__png* p, int* x, int* y, int* n, int req_comp, st
             ri->bits_per_channel = p->depth;
         result = p->out;
         p->out = NULL;
+        ri->flipped = p->flipped;
         if (req_comp && req_comp != p->s->img_out_n) {
             if (ri->bits_per_channel == 8)
-                result = stbi__convert_format((unsigned char*)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+                result = stbi__convert_format((unsigned char*)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y, ri);
             else
-                result = stbi__convert_format16((stbi__uint16*)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+                result = stbi__convert_format16((stbi__uint16*)result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y, ri);
             p->s->img_out_n = req_comp;
             if (result == NULL) return result;
         }
@@ -5445,7 +7114,7 @@ static void* stbi__bmp_load(stbi__context* s, int* x, int* y, int* comp, int req
     }
 
     if (req_comp && req_comp != target) {
-        out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y);
+        out = stbi__convert_format(out, target, req_comp, s->img_x, s->img_y, ri);
         if (out == NULL) return out; // stbi__convert_format frees input on failure
     }
 
@@ -5787,7 +7456,7 @@ static void* stbi__tga_load(stbi__context* s, int* x, int* y, int* comp, int req
 
     // convert to target component count
     if (req_comp && req_comp != tga_comp)
-        tga_data = stbi__convert_format(tga_data, tga_comp, req_comp, tga_width, tga_height);
+        tga_data = stbi__convert_format(tga_data, tga_comp, req_comp, tga_width, tga_height, ri);
 
     //   the things I do to get rid of an error message, and yet keep
     //   Microsoft's C compilers happy... [8^(
@@ -6043,9 +7712,9 @@ static void* stbi__psd_load(stbi__context* s, int* x, int* y, int* comp, int req
     // convert to desired output format
     if (req_comp && req_comp != 4) {
         if (ri->bits_per_channel == 16)
-            out = (stbi_uc*)stbi__convert_format16((stbi__uint16*)out, 4, req_comp, w, h);
+            out = (stbi_uc*)stbi__convert_format16((stbi__uint16*)out, 4, req_comp, w, h, ri);
         else
-            out = stbi__convert_format(out, 4, req_comp, w, h);
+            out = stbi__convert_format(out, 4, req_comp, w, h, ri);
         if (out == NULL) return out; // stbi__convert_format frees input on failure
     }
 
@@ -6261,7 +7930,7 @@ static void* stbi__pic_load(stbi__context* s, int* px, int* py, int* comp, int r
     *px = x;
     *py = y;
     if (req_comp == 0) req_comp = *comp;
-    result = stbi__convert_format(result, 4, req_comp, x, y);
+    result = stbi__convert_format(result, 4, req_comp, x, y, ri);
 
     return result;
 }
@@ -6724,7 +8393,7 @@ static void* stbi__load_gif_main(stbi__context* s, int** delays, int* x, int* y,
                 }
                 memcpy(out + ((layers - 1) * stride), u, stride);
                 if (layers >= 2) {
-                    two_back = out - 2 * stride;
+                    two_back = out + (layers - 2) * stride;
                 }
 
                 if (delays) {
@@ -6740,7 +8409,7 @@ static void* stbi__load_gif_main(stbi__context* s, int** delays, int* x, int* y,
 
         // do the final conversion after loading everything; 
         if (req_comp && req_comp != 4)
-            out = stbi__convert_format(out, 4, req_comp, layers * g.w, g.h);
+            out = stbi__convert_format(out, 4, req_comp, layers * g.w, g.h, NULL);
 
         *z = layers;
         return out;
@@ -6766,7 +8435,7 @@ static void* stbi__gif_load(stbi__context* s, int* x, int* y, int* comp, int req
         // moved conversion to after successful load so that the same
         // can be done for multiple frames. 
         if (req_comp && req_comp != 4)
-            u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
+            u = stbi__convert_format(u, 4, req_comp, g.w, g.h, ri);
     }
     else if (g.out) {
         // if there was an error and we allocated an image buffer, free it!
@@ -6780,6 +8449,114 @@ static void* stbi__gif_load(stbi__context* s, int* x, int* y, int* comp, int req
     return u;
 }
 
+// counts the image descriptors without decoding any of them; whatever the
+// decoder would stop at (the trailer, an unknown block, the end of the data)
+// ends the count too
+static int stbi__gif_count_frames(stbi__context* s)
+{
+    int frames = 0;
+    int flags, len;
+    stbi__skip(s, 10); // signature, width, height
+    flags = stbi__get8(s);
+    stbi__skip(s, 2);  // background index, aspect ratio
+    if (flags & 0x80)
+        stbi__skip(s, 3 * (2 << (flags & 7)));
+
+    for (;;) {
+        switch (stbi__get8(s)) {
+        case 0x2C: // Image Descriptor
+            stbi__skip(s, 8);
+            flags = stbi__get8(s);
+            if (flags & 0x80)
+                stbi__skip(s, 3 * (2 << (flags & 7)));
+            stbi__skip(s, 1); // LZW minimum code size
+            ++frames;
+            break;
+        case 0x21: // extension
+            stbi__skip(s, 1);
+            break;
+        default:
+            return frames;
+        }
+        // image data and extensions are both a run of sub-blocks
+        while ((len = stbi__get8(s)) != 0)
+            stbi__skip(s, len);
+    }
+}
+
+// stbi__load_gif_main without the frame array. stbi__gif_load_next only looks
+// back two frames, for disposal mode 3, and that frame is nearly always still
+// in g->background: the canvas is copied there after the previous frame is
+// disposed of, which only changes it for disposal modes 2 and 3. so a frame is
+// copied aside just when its own disposal mode is one of those
+static int stbi__gif_load_frames(stbi__context* s, int frames, int* x, int* y, int* out_frames, stbi_gif_frame_callback callback, void* user)
+{
+    stbi__gif* g = (stbi__gif*)stbi__malloc(sizeof(stbi__gif));
+    stbi_uc* saved[2] = { NULL, NULL };
+    stbi_uc* two_back = NULL;
+    stbi_uc* u;
+    int comp, n, size = 0, ok = 1;
+    if (!g) return stbi__err("outofmem", "Out of memory");
+    memset(g, 0, sizeof(*g));
+
+    for (n = 0;; ++n) {
+        // frame n-1 is in g->out; find where it will be once frame n+1 needs it
+        stbi_uc* next_two_back = NULL;
+        if (n > 0) {
+            int dispose = (g->eflags & 0x1C) >> 2;
+            if (dispose == 2 || dispose == 3) {
+                // saved[n & 1] may still hold frame n-2, which this frame needs
+                stbi_uc** slot = &saved[(n - 1) & 1];
+                if (*slot == NULL && (*slot = (stbi_uc*)stbi__malloc(size)) == NULL) {
+                    ok = stbi__err("outofmem", "Out of memory");
+                    break;
+                }
+                memcpy(*slot, g->out, size);
+                next_two_back = *slot;
+            }
+            else {
+                next_two_back = g->background;
+            }
+        }
+
+        u = stbi__gif_load_next(s, g, &comp, 4, two_back);
+        two_back = next_two_back;
+        if (u == (stbi_uc*)s) {  // end of animated gif marker
+            if (n == 0) stbi__err("no frames", "Corrupt GIF");
+            u = 0;
+        }
+        if (u == 0) {
+            // as stbi__load_gif_main, a bad frame after the first ends the animation
+            if (n == 0) ok = 0;
+            else if (n < *out_frames) *out_frames = n;
+            break;
+        }
+
+        if (n == 0) {
+            *x = g->w;
+            *y = g->h;
+            *out_frames = frames;
+            size = 4 * g->w * g->h;
+        }
+
+        if (stbi__vertically_flip_on_load) stbi__vertical_flip(u, g->w, g->h, 4);
+        ok = callback(user, n, g->delay, u);
+        if (stbi__vertically_flip_on_load) stbi__vertical_flip(u, g->w, g->h, 4);
+        if (!ok) {
+            stbi__err("stopped", "Frame callback stopped the load");
+            break;
+        }
+    }
+
+    STBI_FREE(g->out);
+    STBI_FREE(g->history);
+    STBI_FREE(g->background);
+    STBI_FREE(saved[0]);
+    STBI_FREE(saved[1]);
+    STBI_FREE(g);
+    return ok;
+}
+
 static int stbi__gif_info(stbi__context* s, int* x, int* y, int* comp)
 {
     return stbi__gif_info_raw(s, x, y, comp);
@@ -6834,12 +8611,21 @@ static char* stbi__hdr_gettoken(stbi__context* z, char* buffer)
     return buffer;
 }
 
+// 2^e for the exponents RGBE can hold (-135..119), built directly rather
+// than with ldexp(); denormals included, so the result is the same
+static float stbi__hdr_exp2(int e)
+{
+    union { stbi__uint32 u; float f; } v;
+    v.u = e >= -126 ? (stbi__uint32)(e + 127) << 23 : (stbi__uint32)1 << (e + 149);
+    return v.f;
+}
+
 static void stbi__hdr_convert(float* output, stbi_uc* input, int req_comp)
 {
     if (input[3] != 0) {
         float f1;
         // Exponent
-        f1 = (float)ldexp(1.0f, input[3] - (int)(128 + 8));
+        f1 = stbi__hdr_exp2(input[3] - (int)(128 + 8));
         if (req_comp <= 2)
             output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
         else {
@@ -6862,19 +8648,93 @@ static void stbi__hdr_convert(float* output, stbi_uc* input, int req_comp)
     }
 }
 
+// round to nearest; values past the largest half (65504) saturate to it
+static stbi__uint16 stbi__float_to_half(float f)
+{
+    union { float f; stbi__uint32 u; } v;
+    stbi__uint32 sign, e, m, h;
+    v.f = f;
+    sign = (v.u >> 16) & 0x8000;
+    e = (v.u >> 23) & 0xff;
+    m = v.u & 0x7fffff;
+    if (e - 113 < 30) {
+        // normal half; rounding up may carry into the exponent
+        h = ((e - 112) << 10) + (m >> 13) + ((m >> 12) & 1);
+        return (stbi__uint16)(sign | (h > 0x7bff ? 0x7bff : h));
+    }
+    if (e == 255 && m) return (stbi__uint16)(sign | 0x7e00); // nan
+    if (e > 142) return (stbi__uint16)(sign | 0x7bff);
+    // denormal half; rounding up may carry into the smallest normal one
+    if (e < 102) return (stbi__uint16)sign;
+    m |= 0x800000;
+    return (stbi__uint16)(sign | ((m + (1u << (125 - e))) >> (126 - e)));
+}
+
+// RGBE and RGB9E5 both share one exponent between three mantissas, so an
+// RGBE pixel converts exactly unless it's out of RGB9E5's range
+static stbi__uint32 stbi__rgbe_to_rgb9e5(stbi_uc* input)
+{
+    stbi__uint32 m[3];
+    int k, e = input[3] - 113; // value = m8 * 2^(e8-136) = (m8*2) * 2^((e8-113)-24)
+    if (input[3] == 0) return 0;
+    for (k = 0; k < 3; ++k)
+        m[k] = (stbi__uint32)input[k] << 1;
+    if (e < 0) {
+        // too small: drop low mantissa bits, rounding
+        for (k = 0; k < 3; ++k)
+            m[k] = -e > 10 ? 0 : (m[k] + (1u << (-e - 1))) >> -e;
+        e = 0;
+    }
+    else if (e > 31) {
+        // too big: clamp to the largest value
+        for (k = 0; k < 3; ++k)
+            if (m[k]) m[k] = e - 31 >= 9 || (m[k] << (e - 31)) > 511 ? 511 : m[k] << (e - 31);
+        e = 31;
+    }
+    return m[0] | (m[1] << 9) | (m[2] << 18) | ((stbi__uint32)e << 27);
+}
+
+static void stbi__hdr_convert_row(void* output, stbi_uc* input, int width, int req_comp, int format)
+{
+    int i, k;
+    switch (format) {
+    case STBI__HDR_float:
+        for (i = 0; i < width; ++i)
+            stbi__hdr_convert((float*)output + i * req_comp, input + i * 4, req_comp);
+        break;
+    case STBI__HDR_half:
+        for (i = 0; i < width; ++i) {
+            float f[4];
+            stbi__hdr_convert(f, input + i * 4, req_comp);
+            for (k = 0; k < req_comp; ++k)
+                ((stbi__uint16*)output)[i * req_comp + k] = stbi__float_to_half(f[k]);
+        }
+        break;
+    default:
+        for (i = 0; i < width; ++i)
+            ((stbi__uint32*)output)[i] = stbi__rgbe_to_rgb9e5(input + i * 4);
+        break;
+    }
+}
+
 static float* stbi__hdr_load(stbi__context* s, int* x, int* y, int* comp, int req_comp, stbi__result_info* ri)
+{
+    STBI_NOTUSED(ri);
+    return (float*)stbi__hdr_load_as(s, x, y, comp, req_comp, STBI__HDR_float);
+}
+
+static void* stbi__hdr_load_as(stbi__context* s, int* x, int* y, int* comp, int req_comp, int format)
 {
     char buffer[STBI__HDR_BUFLEN];
     char* token;
     int valid = 0;
     int width, height;
     stbi_uc* scanline;
-    float* hdr_data;
-    int len;
+    stbi_uc* hdr_data;
+    int len, flat, pixel_bytes;
     unsigned char count, value;
     int i, j, k, c1, c2, z;
     const char* headerToken;
-    STBI_NOTUSED(ri);
 
     // Check identifier
     headerToken = stbi__hdr_gettoken(s, buffer);
@@ -6906,88 +8766,81 @@ static float* stbi__hdr_load(stbi__context* s, int* x, int* y, int* comp, int re
 
     if (comp) *comp = 3;
     if (req_comp == 0) req_comp = 3;
+    if (format == STBI__HDR_float)
+        pixel_bytes = req_comp * sizeof(float);
+    else if (format == STBI__HDR_half)
+        pixel_bytes = req_comp * 2;
+    else
+        pixel_bytes = 4;
 
-    if (!stbi__mad4sizes_valid(width, height, req_comp, sizeof(float), 0))
+    if (!stbi__mad3sizes_valid(width, height, pixel_bytes, 0))
         return stbi__errpf("too large", "HDR image is too large");
 
     // Read data
-    hdr_data = (float*)stbi__malloc_mad4(width, height, req_comp, sizeof(float), 0);
+    hdr_data = (stbi_uc*)stbi__malloc_mad3(width, height, pixel_bytes, 0);
     if (!hdr_data)
         return stbi__errpf("outofmem", "Out of memory");
-
-    // Load image data
-    // image data is stored as some number of sca
-    if (width < 8 || width >= 32768) {
-        // Read flat data
-        for (j = 0; j < height; ++j) {
-            for (i = 0; i < width; ++i) {
-                stbi_uc rgbe[4];
-            main_decode_loop:
-                stbi__getn(s, rgbe, 4);
-                stbi__hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
-            }
-        }
+    scanline = (stbi_uc*)stbi__malloc_mad2(width, 4, 0);
+    if (!scanline) {
+        STBI_FREE(hdr_data);
+        return stbi__errpf("outofmem", "Out of memory");
     }
-    else {
-        // Read RLE-encoded data
-        scanline = NULL;
 
-        for (j = 0; j < height; ++j) {
+    // Load image data
+    // each scanline is gathered as RGBE, then converted to the output format.
+    // widths outside 8..32767 can't be run-length encoded
+    flat = width < 8 || width >= 32768;
+    for (j = 0; j < height; ++j) {
+        i = 0;
+        if (!flat) {
             c1 = stbi__get8(s);
             c2 = stbi__get8(s);
             len = stbi__get8(s);
             if (c1 != 2 || c2 != 2 || (len & 0x80)) {
                 // not run-length encoded, so we have to actually use THIS data as a decoded
-                // pixel (note this can't be a valid pixel--one of RGB must be >= 128)
-                stbi_uc rgbe[4];
-                rgbe[0] = (stbi_uc)c1;
-                rgbe[1] = (stbi_uc)c2;
-                rgbe[2] = (stbi_uc)len;
-                rgbe[3] = (stbi_uc)stbi__get8(s);
-                stbi__hdr_convert(hdr_data, rgbe, req_comp);
+                // pixel (note this can't be a valid pixel--one of RGB must be >= 128); the
+                // rest of the image is flat too
+                scanline[0] = (stbi_uc)c1;
+                scanline[1] = (stbi_uc)c2;
+                scanline[2] = (stbi_uc)len;
+                scanline[3] = (stbi_uc)stbi__get8(s);
                 i = 1;
-                j = 0;
-                STBI_FREE(scanline);
-                goto main_decode_loop; // yes, this makes no sense
-            }
-            len <<= 8;
-            len |= stbi__get8(s);
-            if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
-            if (scanline == NULL) {
-                scanline = (stbi_uc*)stbi__malloc_mad2(width, 4, 0);
-                if (!scanline) {
-                    STBI_FREE(hdr_data);
-                    return stbi__errpf("outofmem", "Out of memory");
-                }
+                flat = 1;
             }
-
-            for (k = 0; k < 4; ++k) {
-                int nleft;
-                i = 0;
-                while ((nleft = width - i) > 0) {
-                    count = stbi__get8(s);
-                    if (count > 128) {
-                        // Run
-                        value = stbi__get8(s);
-                        count -= 128;
-                        if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                        for (z = 0; z < count; ++z)
-                            scanline[i++ * 4 + k] = value;
-                    }
-                    else {
-                        // Dump
-                        if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
-                        for (z = 0; z < count; ++z)
-                            scanline[i++ * 4 + k] = stbi__get8(s);
+            else {
+                len <<= 8;
+                len |= stbi__get8(s);
+                if (len != width) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("invalid decoded scanline length", "corrupt HDR"); }
+
+                for (k = 0; k < 4; ++k) {
+                    int nleft;
+                    i = 0;
+                    while ((nleft = width - i) > 0) {
+                        count = stbi__get8(s);
+                        if (count > 128) {
+                            // Run
+                            value = stbi__get8(s);
+                            count -= 128;
+                            if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                            for (z = 0; z < count; ++z)
+                                scanline[i++ * 4 + k] = value;
+                        }
+                        else {
+                            // Dump
+                            if (count > nleft) { STBI_FREE(hdr_data); STBI_FREE(scanline); return stbi__errpf("corrupt", "bad RLE data in HDR"); }
+                            for (z = 0; z < count; ++z)
+                                scanline[i++ * 4 + k] = stbi__get8(s);
+                        }
                     }
                 }
             }
-            for (i = 0; i < width; ++i)
-                stbi__hdr_convert(hdr_data + (j * width + i) * req_comp, scanline + i * 4, req_comp);
         }
-        if (scanline)
-            STBI_FREE(scanline);
+        // Read flat data
+        if (i < width)
+            stbi__getn(s, scanline + i * 4, (width - i) * 4);
+        stbi__hdr_convert_row(hdr_data + (size_t)j * width * pixel_bytes, scanline, width, req_comp, format);
     }
+    STBI_FREE(scanline);
 
     return hdr_data;
 }
@@ -7229,7 +9082,7 @@ static void* stbi__pnm_load(stbi__context* s, int* x, int* y, int* comp, int req
     stbi__getn(s, out, s->img_n * s->img_x * s->img_y);
 
     if (req_comp && req_comp != s->img_n) {
-        out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y);
+        out = stbi__convert_format(out, s->img_n, req_comp, s->img_x, s->img_y, ri);
         if (out == NULL) return out; // stbi__convert_format frees input on failure
     }
     return out;
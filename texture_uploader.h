@@ -0,0 +1,170 @@
+#ifndef TEXTURE_UPLOADER_H
+#define TEXTURE_UPLOADER_H
+
+#include <glad/glad.h>
+
+#include "gl_ext.h"
+#include "gl_state.h"
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// stages texture data through a ring of pixel unpack buffers, so that the
+// caller's memory can be freed as soon as a call returns and glTexSubImage2D
+// copies from GL memory without holding up the GL thread. a buffer is fenced
+// once it fills, and only written again once the GPU is done reading it;
+// meanwhile uploads carry on in the next ones, overlapping with rendering.
+//
+// storage is immutable (glTexStorage2D) with GL 4.2 or ARB_texture_storage,
+// and the buffers stay mapped with GL 4.4 or ARB_buffer_storage. without
+// them, glTexImage2D allocates each level and each write maps its range of
+// the buffer unsynchronized, which the fences make safe.
+//
+// works on the bound GL_TEXTURE_2D, like the glTex* calls it stands in for
+class TextureUploader
+{
+public:
+	// the uploader for the calling thread, and so for the context current on
+	// it (one per thread here, as with GLState), made on first use: the
+	// upload thread and the render thread each get their own. it is never
+	// destroyed: its buffers go with the context
+	static TextureUploader& instance()
+	{
+		static thread_local TextureUploader* uploader = new TextureUploader();
+		return *uploader;
+	}
+
+	TextureUploader(int slotCount = 4, size_t slotBytes = 8 << 20) : slotBytes(slotBytes), current(0), used(0)
+	{
+		texStorage2D = loadGLProc<TexStorage2DProc>("glTexStorage2D", 4, 2, "GL_ARB_texture_storage");
+		bufferStorage = loadGLProc<BufferStorageProc>("glBufferStorage", 4, 4, "GL_ARB_buffer_storage");
+
+		GLState& state = GLState::current();
+		slots.resize(slotCount);
+		for (unsigned int i = 0; i < slots.size(); i++)
+		{
+			glGenBuffers(1, &slots[i].buffer);
+			state.bindBuffer(GL_PIXEL_UNPACK_BUFFER, slots[i].buffer);
+			if (bufferStorage)
+			{
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				bufferStorage(GL_PIXEL_UNPACK_BUFFER, slotBytes, NULL, flags);
+				slots[i].mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slotBytes, flags);
+			}
+			else
+			{
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, slotBytes, NULL, GL_STREAM_DRAW);
+			}
+		}
+		state.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	// gives the bound texture storage for a full mip chain
+	void allocate(GLenum internalFormat, int width, int height, GLenum format, GLenum type)
+	{
+		int levels = 1;
+		while ((width >> levels) > 0 || (height >> levels) > 0)
+		{
+			levels++;
+		}
+
+		if (texStorage2D)
+		{
+			texStorage2D(GL_TEXTURE_2D, levels, internalFormat, width, height);
+			return;
+		}
+		for (int level = 0; level < levels; level++)
+		{
+			int w = width >> level > 0 ? width >> level : 1;
+			int h = height >> level > 0 ? height >> level : 1;
+			glTexImage2D(GL_TEXTURE_2D, level, internalFormat, w, h, 0, format, type, NULL);
+		}
+	}
+
+	// glTexSubImage2D of level 0 from tightly packed pixels, pixelBytes each.
+	// goes in bands of rows as big as the space left in the ring allows
+	void subImage(int x, int y, int width, int height, GLenum format, GLenum type, int pixelBytes, const void* pixels)
+	{
+		size_t rowBytes = (size_t)width * pixelBytes;
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		if (rowBytes > slotBytes)
+		{
+			// a single row won't fit; leave it to the driver
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, format, type, pixels);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			return;
+		}
+
+		GLState& state = GLState::current();
+		const unsigned char* src = (const unsigned char*)pixels;
+		for (int row = 0; row < height;)
+		{
+			size_t room = (slotBytes - used) / rowBytes;
+			if (room == 0)
+			{
+				nextSlot();
+				room = slotBytes / rowBytes;
+			}
+			int rows = height - row < (int)room ? height - row : (int)room;
+			size_t bytes = rows * rowBytes;
+
+			Slot& slot = slots[current];
+			state.bindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+			if (slot.mapped)
+			{
+				memcpy(slot.mapped + used, src, bytes);
+			}
+			else
+			{
+				void* dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, used, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+				if (!dest)
+				{
+					std::cout << "TextureUploader: failed to map unpack buffer" << std::endl;
+					break;
+				}
+				memcpy(dest, src, bytes);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			}
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, y + row, width, rows, format, type, (const void*)used);
+
+			// keep every band's offset aligned for any pixel type
+			used = (used + bytes + 15) & ~(size_t)15;
+			src += bytes;
+			row += rows;
+		}
+		// anything else still uploading from client memory must see 0 here
+		state.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+
+private:
+	struct Slot
+	{
+		unsigned int buffer = 0;
+		unsigned char* mapped = NULL;
+		GLsync fence = 0;
+	};
+
+	TexStorage2DProc texStorage2D = NULL;
+	BufferStorageProc bufferStorage = NULL;
+	vector<Slot> slots;
+	size_t slotBytes;
+	unsigned int current;
+	size_t used;
+
+	// fences the full buffer and moves on to the next, waiting for the GPU to
+	// finish with it if it is still being read from
+	void nextSlot()
+	{
+		slots[current].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		current = (current + 1) % slots.size();
+		used = 0;
+
+		waitFence(slots[current].fence);
+	}
+};
+
+#endif
@@ -0,0 +1,400 @@
+// cull_bench: checks and times the CPU culling kernels
+//
+// Checks FrustumCuller's vector kernel against Frustum::intersects, which is
+// also its scalar path: object for object and in the stats, for every count
+// from 1 to 64 (short counts leave the last register part padding) and for
+// scenes all in view, all out of it and mixed. Then times cull() over a large
+// random scene. The kernel is picked at compile time, so build it once per
+// kernel, from the repository root, with glm on the include path:
+//
+//     cl /O2 /EHsc /std:c++17 /I<glm> tools\cull_bench.cpp
+//     cl /O2 /EHsc /std:c++17 /arch:AVX /I<glm> tools\cull_bench.cpp
+//     g++ -O2 -std=c++17 -pthread -I<glm> tools/cull_bench.cpp -o cull_bench
+//     g++ -O2 -std=c++17 -pthread -mavx -I<glm> tools/cull_bench.cpp -o cull_bench
+//
+// OcclusionCuller is checked with a wall in front of the camera, made of two
+// triangles that share their corners or only their positions, on 1 to 4
+// threads: boxes behind it (the middle one across the seam between the
+// triangles) have to come out hidden, boxes in front of it, through it,
+// beside it or peeking past its edge visible, every run has to agree, and
+// no box of a random scene may be hidden unless the wall really covers it.
+// Then render() and test() are timed with a field of walls over the same
+// scene as the frustum.
+//
+// usage: cull_bench [options]
+//     --objects N   objects in the timed scenes (100000)
+//     --reps N      timed runs, reporting the fastest (20)
+//     --threads N   occlusion buffer threads to time, 0 for its own pick (0)
+// exits with 1 if a check fails.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "../frustum_culler.h"
+#include "../occlusion_culler.h"
+
+using namespace std;
+
+static const char* kernelName()
+{
+#if defined(__AVX__)
+	return "AVX";
+#elif defined(FRUSTUM_CULLER_SSE)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+static double benchNow()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// a cube of half size half at center, with its bounding sphere
+static WorldBounds cubeAt(const glm::vec3& center, float half)
+{
+	glm::mat4 model = glm::translate(glm::mat4(1.0f), center);
+	return WorldBounds(glm::vec3(-half), glm::vec3(half), half * 1.7320508f, model);
+}
+
+// the camera sits at z = 10 looking down -z, so the origin, where the
+// kernel's padding lanes are, is in view
+static glm::mat4 cameraViewProjection()
+{
+	glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -10.0f));
+	return glm::perspective(0.8f, 16.0f / 9.0f, 0.1f, 100.0f) * view;
+}
+
+enum Scene { SCENE_inside, SCENE_beyond, SCENE_mixed, SCENE_count };
+static const char* sceneNames[SCENE_count] = { "in view", "past the far plane", "mixed" };
+
+static void makeScene(Scene scene, int count, mt19937& random, vector<WorldBounds>& objects)
+{
+	uniform_real_distribution<float> spread(-60.0f, 60.0f);
+	uniform_real_distribution<float> depth(-120.0f, 10.0f);
+	objects.clear();
+	for (int i = 0; i < count; i++)
+	{
+		if (scene == SCENE_inside)
+		{
+			objects.push_back(cubeAt(glm::vec3(0.0f, 0.0f, -5.0f - i), 0.5f));
+		}
+		else if (scene == SCENE_beyond)
+		{
+			objects.push_back(cubeAt(glm::vec3(0.0f, 0.0f, -200.0f - i), 0.5f));
+		}
+		else
+		{
+			objects.push_back(cubeAt(glm::vec3(spread(random), spread(random), depth(random)), 1.0f));
+		}
+	}
+}
+
+// culls objects and compares every result and the stats with the scalar test
+static bool checkCull(FrustumCuller& culler, const vector<WorldBounds>& objects, const glm::mat4& viewProjection, string& failure)
+{
+	culler.clear();
+	for (unsigned int i = 0; i < objects.size(); i++)
+	{
+		culler.add(objects[i]);
+	}
+	culler.cull(viewProjection);
+
+	Frustum frustum(viewProjection);
+	unsigned int visible = 0;
+	for (unsigned int i = 0; i < objects.size(); i++)
+	{
+		bool expected = frustum.intersects(objects[i].center, objects[i].extents, objects[i].radius);
+		if (culler.visible(i) != expected)
+		{
+			failure = "object " + to_string(i) + " is " + (expected ? "in view" : "out of view") + " but the kernel says otherwise";
+			return false;
+		}
+		visible += expected;
+	}
+	const FrustumCuller::Stats& stats = culler.stats();
+	if (stats.tested != objects.size() || stats.visible != visible || stats.culled != objects.size() - visible)
+	{
+		failure = "stats say " + to_string(stats.tested) + " tested, " + to_string(stats.visible) + " visible, " + to_string(stats.culled) +
+			" culled; expected " + to_string(objects.size()) + ", " + to_string(visible) + ", " + to_string(objects.size() - visible);
+		return false;
+	}
+	return true;
+}
+
+static int checkFrustum()
+{
+	mt19937 random(1);
+	glm::mat4 viewProjection = cameraViewProjection();
+	FrustumCuller culler;
+	vector<WorldBounds> objects;
+	int failures = 0;
+	for (int count = 1; count <= 64; count++)
+	{
+		for (int scene = 0; scene < SCENE_count; scene++)
+		{
+			makeScene((Scene)scene, count, random, objects);
+			string failure;
+			if (!checkCull(culler, objects, viewProjection, failure))
+			{
+				cout << "FAIL frustum, " << count << " objects " << sceneNames[scene] << ": " << failure << endl;
+				failures++;
+			}
+		}
+	}
+	if (failures == 0)
+	{
+		cout << "ok   frustum kernel matches the scalar test for 1-64 objects" << endl;
+	}
+	return failures;
+}
+
+static void timeFrustum(int objectCount, int reps)
+{
+	mt19937 random(2);
+	glm::mat4 viewProjection = cameraViewProjection();
+	vector<WorldBounds> objects;
+	makeScene(SCENE_mixed, objectCount, random, objects);
+	FrustumCuller culler;
+	for (unsigned int i = 0; i < objects.size(); i++)
+	{
+		culler.add(objects[i]);
+	}
+
+	double best = 1e30;
+	for (int rep = 0; rep < reps; rep++)
+	{
+		double start = benchNow();
+		culler.cull(viewProjection);
+		double elapsed = benchNow() - start;
+		best = elapsed < best ? elapsed : best;
+	}
+	const FrustumCuller::Stats& stats = culler.stats();
+	printf("frustum  %8d objects  %8.3f ms  %8.1f Mobjects/s  (%u in view)\n", objectCount, best * 1000.0, objectCount / best / 1e6, stats.visible);
+}
+
+// a wall facing the camera: a quad at z from -half to half in x and y
+static const float wallZ = -5.0f;
+static const float wallHalf = 4.0f;
+static const glm::vec3 cameraPosition(0.0f, 0.0f, 10.0f);
+
+// split gives each triangle corners of its own, as a mesh with split
+// normals or texture coordinates would
+static void addWall(OcclusionCuller& occlusion, const glm::vec3& center, float half, bool split = false)
+{
+	static const unsigned int quad[] = { 0, 1, 2, 0, 2, 3 };
+	glm::vec3 corners[] = {
+		center + glm::vec3(-half, -half, 0.0f),
+		center + glm::vec3(half, -half, 0.0f),
+		center + glm::vec3(half, half, 0.0f),
+		center + glm::vec3(-half, half, 0.0f),
+	};
+	vector<glm::vec3> positions;
+	vector<unsigned int> indices;
+	for (int i = 0; i < 6; i++)
+	{
+		if (split)
+		{
+			positions.push_back(corners[quad[i]]);
+			indices.push_back(i);
+		}
+		else
+		{
+			indices.push_back(quad[i]);
+		}
+	}
+	if (!split)
+	{
+		positions.assign(corners, corners + 4);
+	}
+	occlusion.addOccluder(positions, indices, glm::mat4(1.0f));
+}
+
+// whether the wall really hides the box: all of it behind the wall, and
+// every corner seen through it
+static bool wallCovers(const WorldBounds& box)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner = box.center + glm::vec3((i & 1) ? box.extents.x : -box.extents.x, (i & 2) ? box.extents.y : -box.extents.y, (i & 4) ? box.extents.z : -box.extents.z);
+		if (corner.z >= wallZ)
+		{
+			return false;
+		}
+		// where the line from the camera to the corner crosses the wall
+		float t = (cameraPosition.z - wallZ) / (cameraPosition.z - corner.z);
+		glm::vec3 crossing = cameraPosition + (corner - cameraPosition) * t;
+		if (fabsf(crossing.x) > wallHalf || fabsf(crossing.y) > wallHalf)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static int checkOcclusion()
+{
+	struct Case
+	{
+		const char* name;
+		glm::vec3 center;
+		bool visible;
+	};
+	// the wall's edge, seen from the camera, reaches x = 6.67 at z = -15
+	static const Case cases[] = {
+		{ "behind the wall", glm::vec3(0.0f, 0.0f, -15.0f), false },
+		{ "behind a corner", glm::vec3(5.5f, 5.5f, -15.0f), false },
+		{ "in front of the wall", glm::vec3(0.0f, 0.0f, 0.0f), true },
+		{ "through the wall", glm::vec3(0.0f, 0.0f, wallZ), true },
+		{ "beside the wall", glm::vec3(12.0f, 0.0f, -15.0f), true },
+		{ "peeking past the edge", glm::vec3(6.67f, 0.0f, -15.0f), true },
+	};
+	const int caseCount = sizeof(cases) / sizeof(cases[0]);
+
+	mt19937 random(3);
+	vector<WorldBounds> boxes;
+	makeScene(SCENE_mixed, 5000, random, boxes);
+	for (int i = 0; i < caseCount; i++)
+	{
+		boxes.push_back(cubeAt(cases[i].center, 0.5f));
+	}
+	size_t firstCase = boxes.size() - caseCount;
+
+	int failures = 0;
+	vector<unsigned char> reference;
+	for (int run = 0; run < 8; run++)
+	{
+		int threads = run / 2 + 1;
+		bool split = run % 2 != 0;
+		string name = to_string(threads) + " threads, " + (split ? "split" : "shared") + " corners";
+		OcclusionCuller occlusion(320, 192, threads);
+		occlusion.begin(cameraViewProjection());
+		addWall(occlusion, glm::vec3(0.0f, 0.0f, wallZ), wallHalf, split);
+		occlusion.render();
+		vector<unsigned char> visible;
+		occlusion.test(boxes, visible);
+
+		for (int i = 0; i < caseCount; i++)
+		{
+			if ((visible[firstCase + i] != 0) != cases[i].visible)
+			{
+				cout << "FAIL occlusion, " << name << ": box " << cases[i].name << " came out " << (visible[firstCase + i] ? "visible" : "hidden") << endl;
+				failures++;
+			}
+		}
+		unsigned int hidden = 0;
+		for (size_t i = 0; i < boxes.size(); i++)
+		{
+			hidden += visible[i] == 0;
+			if (i < firstCase && !visible[i] && !wallCovers(boxes[i]))
+			{
+				cout << "FAIL occlusion, " << name << ": box " << i << " is hidden but the wall doesn't cover it" << endl;
+				failures++;
+			}
+		}
+		const OcclusionCuller::Stats& stats = occlusion.stats();
+		if (stats.triangles != 2 || stats.tested != boxes.size() || stats.occluded != hidden)
+		{
+			cout << "FAIL occlusion, " << name << ": stats say " << stats.triangles << " triangles, " << stats.tested << " tested, " << stats.occluded << " occluded; expected 2, " << boxes.size() << ", " << hidden << endl;
+			failures++;
+		}
+		if (run == 0)
+		{
+			reference = visible;
+		}
+		else if (visible != reference)
+		{
+			cout << "FAIL occlusion, " << name << ": results differ from 1 thread, shared corners" << endl;
+			failures++;
+		}
+	}
+	if (failures == 0)
+	{
+		cout << "ok   occlusion hides what the wall covers and nothing else, on 1-4 threads, shared or split" << endl;
+	}
+	return failures;
+}
+
+static void timeOcclusion(int objectCount, int reps, int threads)
+{
+	mt19937 random(2);
+	vector<WorldBounds> objects;
+	makeScene(SCENE_mixed, objectCount, random, objects);
+
+	// a field of walls across the view, at a few depths
+	uniform_real_distribution<float> spread(-40.0f, 40.0f);
+	uniform_real_distribution<float> depth(-80.0f, -5.0f);
+	vector<glm::vec3> walls;
+	for (int i = 0; i < 64; i++)
+	{
+		walls.push_back(glm::vec3(spread(random), spread(random) * 0.5f, depth(random)));
+	}
+
+	OcclusionCuller occlusion(320, 192, threads);
+	vector<unsigned char> visible;
+	double bestRender = 1e30, bestTest = 1e30;
+	for (int rep = 0; rep < reps; rep++)
+	{
+		double start = benchNow();
+		occlusion.begin(cameraViewProjection());
+		for (unsigned int i = 0; i < walls.size(); i++)
+		{
+			addWall(occlusion, walls[i], 3.0f);
+		}
+		occlusion.render();
+		double rendered = benchNow();
+		occlusion.test(objects, visible);
+		double tested = benchNow();
+		bestRender = min(bestRender, rendered - start);
+		bestTest = min(bestTest, tested - rendered);
+	}
+	const OcclusionCuller::Stats& stats = occlusion.stats();
+	printf("occlusion %d threads: render %u triangles %8.3f ms, test %d objects %8.3f ms  %8.1f Mobjects/s  (%u hidden)\n",
+		occlusion.threads(), stats.triangles, bestRender * 1000.0, objectCount, bestTest * 1000.0, objectCount / bestTest / 1e6, stats.occluded);
+}
+
+int main(int argc, char** argv)
+{
+	int objects = 100000, reps = 20, threads = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--objects" && i + 1 < argc)
+		{
+			objects = max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--reps" && i + 1 < argc)
+		{
+			reps = max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+		{
+			threads = max(0, atoi(argv[++i]));
+		}
+		else
+		{
+			cout << "usage: cull_bench [--objects N] [--reps N] [--threads N]" << endl;
+			return 1;
+		}
+	}
+
+	cout << "kernel: " << kernelName() << endl;
+	int failures = checkFrustum();
+	failures += checkOcclusion();
+	timeFrustum(objects, reps);
+	timeOcclusion(objects, reps, 1);
+	if (threads != 1)
+	{
+		timeOcclusion(objects, reps, threads);
+	}
+	return failures ? 1 : 0;
+}
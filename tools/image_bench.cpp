@@ -0,0 +1,593 @@
+// image_bench: decode throughput of stb_image's decoders
+//
+// Decodes every image of a corpus from memory and reports input MB/s, output
+// MPix/s, peak allocation and the time spent in each decode phase (see the
+// STBI_PROFILE_BEGIN/END hooks in stb_image.h), as text and optionally JSON
+// for comparing runs. It builds on its own, with the same stb_image
+// configuration as the app (stb_image.cpp), from the repository root:
+//
+//     cl /O2 /EHsc /std:c++17 tools\image_bench.cpp
+//     g++ -O2 -msse2 -std=c++17 -pthread tools/image_bench.cpp -o image_bench
+//
+// usage: image_bench [options] [files or directories...]
+//     --reps N      timed decodes of each file, after one untimed warmup (10)
+//     --cpu N       pin the benchmark to CPU N, -1 to not pin (0)
+//     --threads N   stb_image worker threads (1)
+//     --no-synth    skip the synthetic BMP/TGA/GIF/HDR files
+//     --json FILE   also write the results to FILE
+// without files it reads textures/ and models/nanosuit/.
+//
+// Methodology: files are read into memory first, so only decoding is timed.
+// The benchmark runs pinned to one CPU with one decode thread unless told
+// otherwise (worker threads would inherit the pin, so it doesn't pin with
+// --threads above 1). Each file reports its fastest decode, which the phase
+// times and throughputs come from, and the median. For steady numbers also
+// fix the CPU clock (disable turbo and power saving) and keep the machine
+// otherwise idle.
+//
+// The corpus only has PNGs and JPEGs, so unless --no-synth the first color
+// image is also re-encoded as uncompressed BMP and TGA, a flat Radiance HDR
+// and a GIF with a 3-3-2 palette, so that every decoder gets timed.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+using namespace std;
+
+// allocation tracking: each block carries its size in front of it
+static atomic<size_t> allocated(0);
+static atomic<size_t> peakAllocated(0);
+
+static void* benchMalloc(size_t size)
+{
+	size_t* block = (size_t*)malloc(size + 16);
+	if (!block)
+	{
+		return NULL;
+	}
+	block[0] = size;
+	size_t now = allocated += size;
+	size_t peak = peakAllocated;
+	while (now > peak && !peakAllocated.compare_exchange_weak(peak, now))
+	{
+	}
+	return (char*)block + 16;
+}
+
+static void benchFree(void* p)
+{
+	if (p)
+	{
+		size_t* block = (size_t*)((char*)p - 16);
+		allocated -= block[0];
+		free(block);
+	}
+}
+
+static void* benchRealloc(void* p, size_t size)
+{
+	if (!p)
+	{
+		return benchMalloc(size);
+	}
+	size_t old = ((size_t*)((char*)p - 16))[0];
+	void* q = benchMalloc(size);
+	if (q)
+	{
+		memcpy(q, p, old < size ? old : size);
+		benchFree(p);
+	}
+	return q;
+}
+
+// decode phase timing; stb_image calls these from the decoding thread only
+enum Phase { PHASE_inflate, PHASE_unfilter, PHASE_entropy, PHASE_idct, PHASE_color, PHASE_count };
+static const char* phaseNames[PHASE_count] = { "inflate", "unfilter", "entropy", "idct", "color" };
+static double phaseStart[PHASE_count];
+static double phaseTime[PHASE_count];
+
+static double benchNow()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#define STBI_MALLOC(sz) benchMalloc(sz)
+#define STBI_REALLOC(p, newsz) benchRealloc(p, newsz)
+#define STBI_FREE(p) benchFree(p)
+#define STBI_PROFILE_BEGIN(phase) (phaseStart[PHASE_##phase] = benchNow())
+#define STBI_PROFILE_END(phase) (phaseTime[PHASE_##phase] += benchNow() - phaseStart[PHASE_##phase])
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_THREADS
+#include "../stb_image.h"
+
+// declared like stb_image declares its Win32 calls, since windows.h would
+// clash with those
+#ifdef _WIN32
+STBI_EXTERN __declspec(dllimport) void* __stdcall GetCurrentThread(void);
+STBI_EXTERN __declspec(dllimport) size_t __stdcall SetThreadAffinityMask(void* thread, size_t mask);
+#endif
+
+static bool pinToCpu(int cpu)
+{
+#ifdef _WIN32
+	return SetThreadAffinityMask(GetCurrentThread(), (size_t)1 << cpu) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#endif
+}
+
+struct InputFile
+{
+	string name;
+	vector<stbi_uc> data;
+};
+
+struct Result
+{
+	string name, format;
+	size_t bytes = 0;
+	int width = 0, height = 0, channels = 0;
+	double minSeconds = 0, medianSeconds = 0;
+	size_t peakBytes = 0;
+	double phases[PHASE_count] = {};
+	string error;
+};
+
+static const char* formatOf(const vector<stbi_uc>& data)
+{
+	stbi__context s;
+	stbi__start_mem(&s, data.data(), (int)data.size());
+	if (stbi__jpeg_test(&s)) return "jpeg";
+	if (stbi__png_test(&s)) return "png";
+	if (stbi__bmp_test(&s)) return "bmp";
+	if (stbi__gif_test(&s)) return "gif";
+	if (stbi__psd_test(&s)) return "psd";
+	if (stbi__pic_test(&s)) return "pic";
+	if (stbi__pnm_test(&s)) return "pnm";
+	if (stbi__hdr_test(&s)) return "hdr";
+	// tga last, as stb_image does: its test is weak
+	if (stbi__tga_test(&s)) return "tga";
+	return "unknown";
+}
+
+static bool readFile(const string& path, vector<stbi_uc>& data)
+{
+	ifstream file(path, ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+	data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+	return true;
+}
+
+static void addInputs(const string& path, vector<InputFile>& inputs)
+{
+	namespace fs = std::filesystem;
+	vector<string> paths;
+	if (fs::is_directory(path))
+	{
+		for (const fs::directory_entry& entry : fs::directory_iterator(path))
+		{
+			if (entry.is_regular_file())
+			{
+				paths.push_back(entry.path().generic_string());
+			}
+		}
+		sort(paths.begin(), paths.end());
+	}
+	else
+	{
+		paths.push_back(path);
+	}
+	for (const string& p : paths)
+	{
+		InputFile input;
+		input.name = p;
+		// skip models, licenses and the like
+		if (readFile(p, input.data) && stbi_info_from_memory(input.data.data(), (int)input.data.size(), NULL, NULL, NULL))
+		{
+			inputs.push_back(input);
+		}
+	}
+}
+
+// synthetic files, from 8-bit RGB pixels
+
+static void put16le(vector<stbi_uc>& out, int v)
+{
+	out.push_back((stbi_uc)v);
+	out.push_back((stbi_uc)(v >> 8));
+}
+
+static void put32le(vector<stbi_uc>& out, int v)
+{
+	put16le(out, v);
+	put16le(out, v >> 16);
+}
+
+static vector<stbi_uc> writeBmp(const stbi_uc* rgb, int w, int h)
+{
+	int stride = (w * 3 + 3) & ~3;
+	vector<stbi_uc> out;
+	out.push_back('B');
+	out.push_back('M');
+	put32le(out, 54 + stride * h);
+	put32le(out, 0);
+	put32le(out, 54);
+	put32le(out, 40);
+	put32le(out, w);
+	put32le(out, h);
+	put16le(out, 1);
+	put16le(out, 24);
+	for (int i = 0; i < 6; i++)
+	{
+		put32le(out, 0);
+	}
+	// bottom-up BGR rows
+	for (int y = h - 1; y >= 0; y--)
+	{
+		const stbi_uc* p = rgb + (size_t)y * w * 3;
+		for (int x = 0; x < w; x++, p += 3)
+		{
+			out.push_back(p[2]);
+			out.push_back(p[1]);
+			out.push_back(p[0]);
+		}
+		out.resize(out.size() + stride - w * 3, 0);
+	}
+	return out;
+}
+
+static vector<stbi_uc> writeTga(const stbi_uc* rgb, int w, int h)
+{
+	vector<stbi_uc> out = { 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	put16le(out, w);
+	put16le(out, h);
+	out.push_back(24);
+	out.push_back(0x20); // top-down
+	for (size_t i = 0; i < (size_t)w * h; i++, rgb += 3)
+	{
+		out.push_back(rgb[2]);
+		out.push_back(rgb[1]);
+		out.push_back(rgb[0]);
+	}
+	return out;
+}
+
+static vector<stbi_uc> writeHdr(const stbi_uc* rgb, int w, int h)
+{
+	string header = "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " + to_string(h) + " +X " + to_string(w) + "\n";
+	vector<stbi_uc> out(header.begin(), header.end());
+	// flat RGBE pixels, linear and scaled up to use a range of exponents
+	for (size_t i = 0; i < (size_t)w * h; i++, rgb += 3)
+	{
+		float c[3];
+		for (int k = 0; k < 3; k++)
+		{
+			c[k] = powf(rgb[k] / 255.0f, 2.2f) * 16.0f;
+		}
+		float m = max(c[0], max(c[1], c[2]));
+		if (m < 1e-32f)
+		{
+			out.insert(out.end(), 4, 0);
+			continue;
+		}
+		int e;
+		float scale = frexpf(m, &e) * 256.0f / m;
+		for (int k = 0; k < 3; k++)
+		{
+			out.push_back((stbi_uc)(c[k] * scale));
+		}
+		out.push_back((stbi_uc)(e + 128));
+	}
+	return out;
+}
+
+// GIF with a 3-3-2 palette. the LZW stream clears the table every 128
+// codes, so codes stay 9 bits and every pixel is a literal
+static vector<stbi_uc> writeGif(const stbi_uc* rgb, int w, int h)
+{
+	vector<stbi_uc> out = { 'G', 'I', 'F', '8', '9', 'a' };
+	put16le(out, w);
+	put16le(out, h);
+	out.push_back(0xf7); // global palette of 256 entries
+	out.push_back(0);
+	out.push_back(0);
+	for (int i = 0; i < 256; i++)
+	{
+		out.push_back((stbi_uc)((i >> 5) * 255 / 7));
+		out.push_back((stbi_uc)(((i >> 2) & 7) * 255 / 7));
+		out.push_back((stbi_uc)((i & 3) * 255 / 3));
+	}
+	out.push_back(',');
+	put16le(out, 0);
+	put16le(out, 0);
+	put16le(out, w);
+	put16le(out, h);
+	out.push_back(0);
+	out.push_back(8); // LZW minimum code size
+
+	vector<stbi_uc> codes;
+	unsigned int bits = 0;
+	int bitCount = 0;
+	auto emit = [&](int code)
+	{
+		bits |= (unsigned int)code << bitCount;
+		for (bitCount += 9; bitCount >= 8; bitCount -= 8, bits >>= 8)
+		{
+			codes.push_back((stbi_uc)bits);
+		}
+	};
+	for (size_t i = 0; i < (size_t)w * h; i++, rgb += 3)
+	{
+		if (i % 128 == 0)
+		{
+			emit(256);
+		}
+		emit((rgb[0] & 0xe0) | ((rgb[1] >> 3) & 0x1c) | (rgb[2] >> 6));
+	}
+	emit(257);
+	if (bitCount > 0)
+	{
+		codes.push_back((stbi_uc)bits);
+	}
+	for (size_t i = 0; i < codes.size(); i += 255)
+	{
+		size_t n = min((size_t)255, codes.size() - i);
+		out.push_back((stbi_uc)n);
+		out.insert(out.end(), codes.begin() + i, codes.begin() + i + n);
+	}
+	out.push_back(0);
+	out.push_back(';');
+	return out;
+}
+
+static void addSynthetic(vector<InputFile>& inputs)
+{
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		int w, h, n;
+		const vector<stbi_uc>& data = inputs[i].data;
+		if (!stbi_info_from_memory(data.data(), (int)data.size(), &w, &h, &n) || n < 3)
+		{
+			continue;
+		}
+		stbi_uc* rgb = stbi_load_from_memory(data.data(), (int)data.size(), &w, &h, &n, 3);
+		if (!rgb)
+		{
+			continue;
+		}
+		string base = "synthetic/" + filesystem::path(inputs[i].name).stem().string();
+		inputs.push_back({ base + ".bmp", writeBmp(rgb, w, h) });
+		inputs.push_back({ base + ".tga", writeTga(rgb, w, h) });
+		inputs.push_back({ base + ".hdr", writeHdr(rgb, w, h) });
+		inputs.push_back({ base + ".gif", writeGif(rgb, w, h) });
+		stbi_image_free(rgb);
+		return;
+	}
+}
+
+static Result benchmark(const InputFile& input, int reps)
+{
+	Result result;
+	result.name = input.name;
+	result.format = formatOf(input.data);
+	result.bytes = input.data.size();
+
+	vector<double> times;
+	for (int rep = 0; rep <= reps; rep++)
+	{
+		int w, h, n;
+		double phases[PHASE_count];
+		fill(phaseTime, phaseTime + PHASE_count, 0.0);
+		peakAllocated = allocated.load();
+		size_t base = allocated;
+
+		double start = benchNow();
+		stbi_uc* pixels = stbi_load_from_memory(input.data.data(), (int)input.data.size(), &w, &h, &n, 0);
+		double seconds = benchNow() - start;
+		copy(phaseTime, phaseTime + PHASE_count, phases);
+		if (!pixels)
+		{
+			result.error = stbi_failure_reason();
+			return result;
+		}
+		size_t peak = peakAllocated - base;
+		stbi_image_free(pixels);
+
+		// rep 0 warms the caches up
+		if (rep == 0)
+		{
+			continue;
+		}
+		times.push_back(seconds);
+		result.peakBytes = max(result.peakBytes, peak);
+		if (times.size() == 1 || seconds < result.minSeconds)
+		{
+			result.minSeconds = seconds;
+			copy(phases, phases + PHASE_count, result.phases);
+		}
+		result.width = w;
+		result.height = h;
+		result.channels = n;
+	}
+	sort(times.begin(), times.end());
+	result.medianSeconds = times[times.size() / 2];
+	return result;
+}
+
+static string jsonString(const string& s)
+{
+	string out = "\"";
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+static void writeJson(ostream& out, const vector<Result>& results, int reps, int cpu, int threads)
+{
+	out << "{\n  \"reps\": " << reps << ", \"cpu\": " << cpu << ", \"threads\": " << threads << ",\n  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		out << "    { \"file\": " << jsonString(r.name) << ", \"format\": " << jsonString(r.format) << ", \"bytes\": " << r.bytes;
+		if (!r.error.empty())
+		{
+			out << ", \"error\": " << jsonString(r.error);
+		}
+		else
+		{
+			double pixels = (double)r.width * r.height;
+			out << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"channels\": " << r.channels
+				<< ", \"min_ms\": " << r.minSeconds * 1e3 << ", \"median_ms\": " << r.medianSeconds * 1e3
+				<< ", \"mb_per_s\": " << r.bytes / r.minSeconds / 1e6 << ", \"mpix_per_s\": " << pixels / r.minSeconds / 1e6
+				<< ", \"peak_alloc\": " << r.peakBytes << ", \"phases_ms\": {";
+			const char* separator = " ";
+			for (int p = 0; p < PHASE_count; p++)
+			{
+				if (r.phases[p] > 0)
+				{
+					out << separator << "\"" << phaseNames[p] << "\": " << r.phases[p] * 1e3;
+					separator = ", ";
+				}
+			}
+			out << " }";
+		}
+		out << " }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+	int reps = 10, cpu = 0, threads = 1;
+	bool synth = true;
+	string jsonPath;
+	vector<string> paths;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--reps" && i + 1 < argc)
+		{
+			reps = max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--cpu" && i + 1 < argc)
+		{
+			cpu = atoi(argv[++i]);
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+		{
+			threads = max(1, atoi(argv[++i]));
+		}
+		else if (arg == "--no-synth")
+		{
+			synth = false;
+		}
+		else if (arg == "--json" && i + 1 < argc)
+		{
+			jsonPath = argv[++i];
+		}
+		else if (arg.compare(0, 2, "--") == 0)
+		{
+			cout << "usage: image_bench [--reps N] [--cpu N] [--threads N] [--no-synth] [--json FILE] [files or directories...]" << endl;
+			return 1;
+		}
+		else
+		{
+			paths.push_back(arg);
+		}
+	}
+	if (paths.empty())
+	{
+		paths.push_back("textures");
+		paths.push_back("models/nanosuit");
+	}
+
+	if (threads > 1)
+	{
+		cpu = -1;
+	}
+	if (cpu >= 0 && !pinToCpu(cpu))
+	{
+		cout << "couldn't pin to CPU " << cpu << ", running unpinned" << endl;
+		cpu = -1;
+	}
+	stbi_set_thread_count(threads);
+
+	vector<InputFile> inputs;
+	for (const string& path : paths)
+	{
+		addInputs(path, inputs);
+	}
+	if (synth)
+	{
+		addSynthetic(inputs);
+	}
+	if (inputs.empty())
+	{
+		cout << "no images found" << endl;
+		return 1;
+	}
+
+	vector<Result> results;
+	printf("%-40s %-5s %10s %11s %9s %9s %8s %8s %9s  phases (ms)\n", "file", "fmt", "size", "pixels", "min ms", "med ms", "MB/s", "MPix/s", "peak KB");
+	for (const InputFile& input : inputs)
+	{
+		Result r = benchmark(input, reps);
+		results.push_back(r);
+		if (!r.error.empty())
+		{
+			printf("%-40s %-5s %10zu  failed: %s\n", r.name.c_str(), r.format.c_str(), r.bytes, r.error.c_str());
+			continue;
+		}
+		double pixels = (double)r.width * r.height;
+		string size = to_string(r.width) + "x" + to_string(r.height) + "x" + to_string(r.channels);
+		printf("%-40s %-5s %10zu %11s %9.3f %9.3f %8.1f %8.1f %9zu ", r.name.c_str(), r.format.c_str(), r.bytes, size.c_str(),
+			r.minSeconds * 1e3, r.medianSeconds * 1e3, r.bytes / r.minSeconds / 1e6, pixels / r.minSeconds / 1e6, r.peakBytes / 1024);
+		for (int p = 0; p < PHASE_count; p++)
+		{
+			if (r.phases[p] > 0)
+			{
+				printf(" %s %.3f", phaseNames[p], r.phases[p] * 1e3);
+			}
+		}
+		printf("\n");
+	}
+
+	if (!jsonPath.empty())
+	{
+		ofstream json(jsonPath);
+		writeJson(json, results, reps, cpu, threads);
+		if (!json)
+		{
+			cout << "couldn't write " << jsonPath << endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,179 @@
+#ifndef UNIFORM_RING_H
+#define UNIFORM_RING_H
+
+#include <glad/glad.h>
+
+#include "gl_ext.h"
+#include "gl_state.h"
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// one uniform buffer split into a segment per frame in flight, for the data
+// uniform blocks read (see frame_data.h). a frame writes its blocks into its
+// segment and binds ranges of it; the segment is fenced when the frame ends,
+// and only written again once the GPU is past that fence, so nothing has to
+// be copied or orphaned in between.
+//
+// with GL 4.4 or ARB_buffer_storage the buffer stays mapped and a write is a
+// memcpy. without, each write is a glBufferSubData into the segment.
+//
+// a frame that writes more than a segment holds makes the ring grow at the
+// next beginFrame(); until then push() sends what doesn't fit through a
+// buffer of its binding's own
+class UniformRing
+{
+public:
+	// frameBytes is what one frame can write, alignment included, before
+	// the ring has to grow
+	UniformRing(size_t frameBytes = 4 << 20, int frames = 3) : frameBytes(frameBytes), current(0), used(0), wanted(0)
+	{
+		GLint offsetAlignment = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offsetAlignment);
+		alignment = offsetAlignment > 0 ? offsetAlignment : 256;
+
+		bufferStorage = loadGLProc<BufferStorageProc>("glBufferStorage", 4, 4, "GL_ARB_buffer_storage");
+
+		fences.assign(frames, (GLsync)0);
+		allocate();
+	}
+
+	// moves to the next segment, waiting for the GPU to be done with it if
+	// it is still reading what was written there frames ago. if the last
+	// frame ran out of room, waits for every segment instead and remakes the
+	// buffer with segments that would have held it
+	void beginFrame()
+	{
+		if (wanted > frameBytes)
+		{
+			for (unsigned int i = 0; i < fences.size(); i++)
+			{
+				waitFence(fences[i]);
+			}
+			while (frameBytes < wanted)
+			{
+				frameBytes *= 2;
+			}
+			std::cout << "UniformRing: grew to " << frameBytes << " bytes a frame" << std::endl;
+			// unbound first, so GLState doesn't take a reused name for bound
+			GLState::current().bindBuffer(GL_UNIFORM_BUFFER, 0);
+			glDeleteBuffers(1, &id);
+			allocate();
+		}
+		current = (current + 1) % fences.size();
+		used = 0;
+		wanted = 0;
+		waitFence(fences[current]);
+	}
+
+	// fences the frame's segment; call after its last draw
+	void endFrame()
+	{
+		fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	// copies bytes into the frame's segment and returns their offset in the
+	// buffer, or -1 if the frame is out of room; the ring grows to fit at the
+	// next beginFrame()
+	GLintptr write(const void* data, size_t bytes)
+	{
+		wanted += align(bytes);
+		if (used + bytes > frameBytes)
+		{
+			return -1;
+		}
+		GLintptr offset = current * frameBytes + used;
+		if (mapped)
+		{
+			memcpy(mapped + offset, data, bytes);
+		}
+		else
+		{
+			GLState::current().bindBuffer(GL_UNIFORM_BUFFER, id);
+			glBufferSubData(GL_UNIFORM_BUFFER, offset, bytes, data);
+		}
+		used = align(used + bytes);
+		return offset;
+	}
+
+	// binds bytes of the buffer from offset (a write()'s) to a block binding
+	void bind(GLuint binding, GLintptr offset, size_t bytes)
+	{
+		GLState::current().bindBufferRange(GL_UNIFORM_BUFFER, binding, id, offset, bytes);
+	}
+
+	// write() then bind(). when the frame is out of room the data goes into
+	// a buffer kept for the binding instead, respecified each time, which GL
+	// keeps apart from what earlier draws read
+	void push(GLuint binding, const void* data, size_t bytes)
+	{
+		GLintptr offset = write(data, bytes);
+		if (offset >= 0)
+		{
+			bind(binding, offset, bytes);
+			return;
+		}
+		if (spares.size() <= binding)
+		{
+			spares.resize(binding + 1, 0);
+		}
+		if (spares[binding] == 0)
+		{
+			glGenBuffers(1, &spares[binding]);
+		}
+		GLState& state = GLState::current();
+		state.bindBuffer(GL_UNIFORM_BUFFER, spares[binding]);
+		glBufferData(GL_UNIFORM_BUFFER, bytes, data, GL_STREAM_DRAW);
+		state.bindBufferRange(GL_UNIFORM_BUFFER, binding, spares[binding], 0, bytes);
+	}
+
+	// bytes rounded up to where GL allows a bound range to start
+	size_t align(size_t bytes) const
+	{
+		return (bytes + alignment - 1) / alignment * alignment;
+	}
+
+	unsigned int buffer() const
+	{
+		return id;
+	}
+
+private:
+	BufferStorageProc bufferStorage = NULL;
+	unsigned int id = 0;
+	unsigned char* mapped = NULL;
+	vector<GLsync> fences;
+	// push()'s buffers for what didn't fit, by binding
+	vector<GLuint> spares;
+	size_t frameBytes;
+	size_t alignment;
+	unsigned int current;
+	size_t used;
+	// what the frame has asked to write, fitting or not
+	size_t wanted;
+
+	// a segment per fence, frameBytes each
+	void allocate()
+	{
+		size_t bytes = frameBytes * fences.size();
+		GLState& state = GLState::current();
+		glGenBuffers(1, &id);
+		state.bindBuffer(GL_UNIFORM_BUFFER, id);
+		mapped = NULL;
+		if (bufferStorage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			bufferStorage(GL_UNIFORM_BUFFER, bytes, NULL, flags);
+			mapped = (unsigned char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, bytes, flags);
+		}
+		else
+		{
+			glBufferData(GL_UNIFORM_BUFFER, bytes, NULL, GL_DYNAMIC_DRAW);
+		}
+	}
+};
+
+#endif
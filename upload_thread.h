@@ -0,0 +1,155 @@
+#ifndef UPLOAD_THREAD_H
+#define UPLOAD_THREAD_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// what UploadThread::submit hands back: the job is done, and everything it
+// uploaded usable from the render context, once ready() says so
+class UploadTicket
+{
+public:
+	// polls without blocking; call from the render thread
+	bool ready()
+	{
+		if (done)
+		{
+			return true;
+		}
+		GLsync sync = fence.load();
+		if (sync == 0)
+		{
+			return false;
+		}
+		GLenum status = glClientWaitSync(sync, 0, 0);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+		{
+			glDeleteSync(sync);
+			done = true;
+		}
+		return done;
+	}
+
+private:
+	friend class UploadThread;
+	atomic<GLsync> fence{ 0 };
+	bool done = false;
+};
+
+// runs upload jobs (decoding, glTexSubImage2D, glBufferData, ...) on a thread
+// of its own, with a hidden context that shares objects with the main
+// window, so the render loop keeps presenting frames while assets load.
+// each job is followed by a fence, flushed so the render context sees it.
+// vertex array objects aren't shared between contexts, so jobs must leave
+// those to the render thread
+class UploadThread
+{
+public:
+	// call from the main thread, as GLFW only creates windows there. if the
+	// shared context can't be made, jobs run on the calling thread instead
+	UploadThread(GLFWwindow* window)
+	{
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		context = glfwCreateWindow(1, 1, "", NULL, window);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+		if (context == NULL)
+		{
+			std::cout << "Failed to create upload context, uploading on the render thread" << std::endl;
+			return;
+		}
+		worker = thread(&UploadThread::run, this);
+	}
+
+	~UploadThread()
+	{
+		stop();
+	}
+
+	shared_ptr<UploadTicket> submit(function<void()> job)
+	{
+		shared_ptr<UploadTicket> ticket = make_shared<UploadTicket>();
+		if (context == NULL)
+		{
+			job();
+			ticket->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			return ticket;
+		}
+		{
+			lock_guard<mutex> lock(queueMutex);
+			jobs.push_back(Job{ job, ticket });
+		}
+		queueChanged.notify_one();
+		return ticket;
+	}
+
+	// finishes the job in progress, drops the rest and releases the context.
+	// call before glfwTerminate and before anything the jobs refer to goes
+	void stop()
+	{
+		if (context == NULL)
+		{
+			return;
+		}
+		{
+			lock_guard<mutex> lock(queueMutex);
+			stopping = true;
+			jobs.clear();
+		}
+		queueChanged.notify_one();
+		worker.join();
+		glfwDestroyWindow(context);
+		context = NULL;
+	}
+
+private:
+	struct Job
+	{
+		function<void()> run;
+		shared_ptr<UploadTicket> ticket;
+	};
+
+	GLFWwindow* context = NULL;
+	thread worker;
+	mutex queueMutex;
+	condition_variable queueChanged;
+	deque<Job> jobs;
+	bool stopping = false;
+
+	void run()
+	{
+		glfwMakeContextCurrent(context);
+		for (;;)
+		{
+			Job job;
+			{
+				unique_lock<mutex> lock(queueMutex);
+				queueChanged.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (stopping)
+				{
+					break;
+				}
+				job = jobs.front();
+				jobs.pop_front();
+			}
+			job.run();
+			GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			// a fence only signals once it reaches the GPU
+			glFlush();
+			job.ticket->fence = fence;
+		}
+		glfwMakeContextCurrent(NULL);
+	}
+};
+
+#endif